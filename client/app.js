@@ -347,6 +347,10 @@ let connectionStatus;
 let ws;
 let typingTimer;
 let isTyping = false;
+let oldestMessageId = null;       // id самого раннего загруженного сообщения
+let hasMoreHistory = false;       // Есть ли на сервере более ранние сообщения
+let historyRequestPending = false;
+let lastMessageId = null;         // id последнего полученного сообщения (для досылки при переподключении)
 
 // Ждем полную загрузку DOM перед инициализацией элементов
 document.addEventListener('DOMContentLoaded', async function() {
@@ -425,6 +429,9 @@ document.addEventListener('DOMContentLoaded', async function() {
     
     // Инициализируем обработчик отправки сообщений
     setupMessageForm();
+    
+    // Подгрузка ранней истории при прокрутке вверх
+    setupHistoryPaging();
   } else {
     // Если нет токена или он истек, показываем форму входа
     document.getElementById('auth-container').classList.remove('hidden');
@@ -453,8 +460,11 @@ function createWebSocketUrl() {
   // Если мы уже имеем порт или путь в хосте, не добавляем /socket
   const socketPath = '/socket';
   
+  // При переподключении сервер досылает только сообщения после последнего полученного
+  const query = lastMessageId ? `?last_id=${lastMessageId}` : '';
+  
   // Добавляем путь, если он отсутствует
-  const wsUrl = `${protocol}${host}${socketPath}`;
+  const wsUrl = `${protocol}${host}${socketPath}${query}`;
   
   console.log("Создан WebSocket URL:", {
     pageProtocol: window.location.protocol,
@@ -709,56 +719,31 @@ function setupWebSocketHandlers() {
         li.innerHTML = `<i class="fas fa-info-circle"></i> ${data.text || "Системное сообщение"}`;
         li.className = "system-message system-notification";
         messagesList.appendChild(li);
-      } else if (data.type === "typing") {
-        // Показываем, что кто-то печатает
-        if (data.user !== username) {
-          showTypingIndicator(data.user);
+      } else if (data.type === "presence") {
+        // Сервер присылает пакет: кто набирает текст в комнате
+        const typingUsers = (data.typing || []).filter(user => user !== username);
+        if (typingUsers.length > 0) {
+          showTypingIndicator(typingUsers.join(", "));
         }
+      } else if (data.type === "pong") {
+        console.log("Pong received:", data.timestamp);
+        showToast("Сервер ответил на пинг");
+      } else if (data.type === "history") {
+        renderHistoryPage(data);
+        // Для более ранних страниц сохраняем позицию прокрутки
+        if (data.before_id) return;
+      } else if (data.type === "resync") {
+        // Сервер не успевал отправлять сообщения и сбросил очередь:
+        // запрашиваем пропущенное после последнего полученного сообщения
+        ws.send(JSON.stringify({
+          type: "resume",
+          last_id: lastMessageId || 0
+        }));
       } else if (data.type === "message") {
-        const li = document.createElement("li");
-        li.className = data.user === username ? "self" : "other";
-        
-        // Создаем аватар
-        const avatar = document.createElement("div");
-        avatar.className = "avatar";
-        
-        // Генерируем цвет аватара на основе имени
-        const avatarColor = generateColorFromName(data.user);
-        avatar.style.backgroundColor = avatarColor;
-        
-        // Добавляем инициалы пользователя
-        const initials = getInitials(data.user);
-        avatar.textContent = initials;
-  
-        const container = document.createElement("div");
-        container.className = "message-container";
-  
-        const nameDiv = document.createElement("div");
-        nameDiv.textContent = data.user;
-        nameDiv.className = "name";
-  
-        const messageDiv = document.createElement("div");
-        messageDiv.textContent = data.text;
-        messageDiv.className = "message message-new";
-        
-        // Удаляем класс "message-new" после завершения анимации
-        setTimeout(() => {
-          messageDiv.classList.remove("message-new");
-        }, 1500);
-        
-        // Добавляем время сообщения
-        const timeDiv = document.createElement("div");
-        const now = new Date();
-        timeDiv.textContent = now.getHours().toString().padStart(2, '0') + ':' + 
-                             now.getMinutes().toString().padStart(2, '0');
-        timeDiv.className = "message-time";
-  
-        container.appendChild(nameDiv);
-        container.appendChild(messageDiv);
-        li.appendChild(container);
-        li.appendChild(avatar); // Аватар после контейнера сообщения для правильного отображения
-        li.appendChild(timeDiv);
-        messagesList.appendChild(li);
+        // Сообщение могло уже прийти в ответ на resume
+        if (data.id && lastMessageId && data.id <= lastMessageId) return;
+        messagesList.appendChild(createMessageElement(data));
+        rememberMessageId(data.id);
       }
     } catch (err) {
       console.error("Error parsing message:", err);
@@ -771,6 +756,116 @@ function setupWebSocketHandlers() {
   };
 }
 
+// Функция для создания элемента сообщения чата
+function createMessageElement(data) {
+  const li = document.createElement("li");
+  li.className = data.user === username ? "self" : "other";
+  
+  // Создаем аватар
+  const avatar = document.createElement("div");
+  avatar.className = "avatar";
+  
+  // Генерируем цвет аватара на основе имени
+  const avatarColor = generateColorFromName(data.user);
+  avatar.style.backgroundColor = avatarColor;
+  
+  // Добавляем инициалы пользователя
+  const initials = getInitials(data.user);
+  avatar.textContent = initials;
+  
+  const container = document.createElement("div");
+  container.className = "message-container";
+  
+  const nameDiv = document.createElement("div");
+  nameDiv.textContent = data.user;
+  nameDiv.className = "name";
+  
+  const messageDiv = document.createElement("div");
+  messageDiv.textContent = data.text;
+  messageDiv.className = "message message-new";
+  
+  // Удаляем класс "message-new" после завершения анимации
+  setTimeout(() => {
+    messageDiv.classList.remove("message-new");
+  }, 1500);
+  
+  // Добавляем время сообщения
+  const timeDiv = document.createElement("div");
+  const now = new Date();
+  timeDiv.textContent = now.getHours().toString().padStart(2, '0') + ':' + 
+                       now.getMinutes().toString().padStart(2, '0');
+  timeDiv.className = "message-time";
+  
+  container.appendChild(nameDiv);
+  container.appendChild(messageDiv);
+  li.appendChild(container);
+  li.appendChild(avatar); // Аватар после контейнера сообщения для правильного отображения
+  li.appendChild(timeDiv);
+
+  return li;
+}
+
+// Запоминает id последнего полученного сообщения
+function rememberMessageId(id) {
+  if (id && (!lastMessageId || id > lastMessageId)) {
+    lastMessageId = id;
+  }
+}
+
+// Функция для отображения страницы истории.
+// Первая страница приходит при подключении и заменяет содержимое чата,
+// пропущенные при переподключении сообщения (after_id) добавляются в конец,
+// более ранние страницы (ответ на history_before) добавляются сверху.
+function renderHistoryPage(data) {
+  const messages = data.messages || [];
+  historyRequestPending = false;
+  
+  if (data.after_id) {
+    messages
+      .filter(msg => !lastMessageId || msg.id > lastMessageId)
+      .forEach(msg => {
+        messagesList.appendChild(createMessageElement(msg));
+        rememberMessageId(msg.id);
+      });
+    return;
+  }
+  
+  hasMoreHistory = !!data.has_more;
+  if (!data.before_id) {
+    messagesList.innerHTML = "";
+    messages.forEach(msg => messagesList.appendChild(createMessageElement(msg)));
+    messages.forEach(msg => rememberMessageId(msg.id));
+  } else {
+    const chatContainer = document.getElementById("chat");
+    const previousHeight = chatContainer.scrollHeight;
+    const fragment = document.createDocumentFragment();
+    messages.forEach(msg => fragment.appendChild(createMessageElement(msg)));
+    messagesList.insertBefore(fragment, messagesList.firstChild);
+    chatContainer.scrollTop += chatContainer.scrollHeight - previousHeight;
+  }
+  
+  if (messages.length > 0 && (!data.before_id || messages[0].id < oldestMessageId)) {
+    oldestMessageId = messages[0].id;
+  }
+}
+
+// Функция для подгрузки более ранней истории при прокрутке к началу чата
+function setupHistoryPaging() {
+  const chatContainer = document.getElementById("chat");
+  if (!chatContainer) return;
+  
+  chatContainer.addEventListener("scroll", () => {
+    if (chatContainer.scrollTop > 0 || !hasMoreHistory || historyRequestPending) return;
+    if (!ws || ws.readyState !== WebSocket.OPEN || !oldestMessageId) return;
+    
+    historyRequestPending = true;
+    ws.send(JSON.stringify({
+      type: "history_before",
+      before_id: oldestMessageId
+    }));
+  });
+}
+
 // Функция для настройки формы отправки сообщений
 function setupMessageForm() {
   const form = document.getElementById("form");
@@ -1,4 +1,6 @@
 #pragma once
+#include <chrono>
+#include <optional>
 #include <string>
 #include "jwt-cpp/jwt.h"  // Изменение с <jwt-cpp/jwt.h> на "jwt-cpp/jwt.h"
 #include <openssl/evp.h>
@@ -6,11 +8,18 @@
 #include <iomanip>
 #include <sstream>
 #include "db.hpp"
+#include "logger.hpp"
 
 // Ключ для подписи JWT - в реальном приложении должен храниться безопасно
 // и быть более длинным и уникальным
 const std::string JWT_SECRET = "secureJwtSecretKey2025";
 
+// Результат проверки токена: пользователь и момент истечения срока действия
+struct TokenInfo {
+    int user_id;
+    std::chrono::system_clock::time_point expires_at;
+};
+
 class Auth {
 public:
     static std::string hash_password(const std::string& password) {
@@ -66,6 +75,13 @@ public:
 
     // Проверяет JWT токен и возвращает ID пользователя
     static std::optional<int> verify_token(const std::string& token) {
+        auto info = verify(token);
+        if (!info) return std::nullopt;
+        return info->user_id;
+    }
+
+    // Проверяет JWT токен и возвращает ID пользователя вместе со сроком действия токена
+    static std::optional<TokenInfo> verify(const std::string& token) {
         try {
             auto decoded = jwt::decode(token);
             
@@ -78,12 +94,17 @@ public:
             
             // Извлекаем ID пользователя из токена
             if (decoded.has_payload_claim("user_id")) {
-                return std::stoi(decoded.get_payload_claim("user_id").as_string());
+                TokenInfo info;
+                info.user_id = std::stoi(decoded.get_payload_claim("user_id").as_string());
+                info.expires_at = decoded.has_expires_at()
+                    ? decoded.get_expires_at()
+                    : std::chrono::system_clock::time_point::max();
+                return info;
             } else {
                 return std::nullopt;
             }
         } catch (std::exception& e) {
-            std::cerr << "JWT verification error: " << e.what() << std::endl;
+            LOG_WARN("JWT verification error: " << e.what());
             return std::nullopt;
         }
         
@@ -0,0 +1,253 @@
+// Микробенчмарки горячих функций сервера (Google Benchmark).
+// БД — SQLite в памяти. Сессии — ChatSession без сетевого соединения: адресованные
+// им кадры копятся в очереди ожидания (не больше send_queue_frames), поэтому
+// замер включает постановку кадров на strand сессий, но не запись в сокет.
+//
+//   ./chat_bench --benchmark_filter=Broadcast
+#include <benchmark/benchmark.h>
+#include <boost/asio.hpp>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include "auth.hpp"
+#include "chat_server.hpp"
+#include "chat_session.hpp"
+#include "db.hpp"
+#include "segment_log.hpp"
+
+namespace {
+
+// БД в памяти с одним пользователем (id 1) и messages сообщениями в комнате по умолчанию.
+// Слово "message" есть в каждом сообщении, "topicN" — в каждом сотом.
+// Для MessageStoreKind::segments сообщения лежат в журнале во временном каталоге.
+class BenchDb {
+public:
+    BenchDb(std::size_t messages, MessageStoreKind store) {
+        std::unique_ptr<MessageStore> log;
+        if (store == MessageStoreKind::segments) {
+            char dir[] = "/tmp/chat_bench_XXXXXX";
+            if (!mkdtemp(dir)) throw std::runtime_error("mkdtemp failed");
+            dir_ = dir;
+            log = std::make_unique<SegmentLogStore>(dir_, 64 * 1024 * 1024);
+        }
+        db_ = std::make_unique<Db>(":memory:", 0, 4096, std::move(log));
+        db_->register_user("bench", "Bench", Auth::hash_password("bench"));
+        std::vector<NewMessage> batch;
+        for (std::size_t i = 0; i < messages; ++i) {
+            batch.push_back({0, 1, kDefaultRoom, "message " + std::to_string(i) + " topic" + std::to_string(i % 100)});
+            if (batch.size() == 1000) {
+                db_->save_messages(batch);
+                batch.clear();
+            }
+        }
+        if (!batch.empty()) db_->save_messages(batch);
+    }
+
+    ~BenchDb() {
+        db_.reset();
+        if (!dir_.empty()) std::filesystem::remove_all(dir_);
+    }
+
+    Db* operator->() { return db_.get(); }
+
+private:
+    std::string dir_;
+    std::unique_ptr<Db> db_;
+};
+
+// Сервер, который не принимает соединений: io_context не запущен,
+// готовые обработчики выполняются явно через poll() в потоке бенчмарка
+class BenchServer {
+public:
+    BenchServer() : work_(boost::asio::make_work_guard(ioc_)) {
+        ServerConfig config;
+        config.db_path = ":memory:";
+        server_ = std::make_unique<ChatServer>(ioc_, tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0), config);
+    }
+
+    ~BenchServer() { poll(); }
+
+    std::shared_ptr<ChatSession> add_session() {
+        auto session = std::make_shared<ChatSession>(tcp::socket(boost::asio::make_strand(ioc_)), *server_);
+        server_->join(session);
+        return session;
+    }
+
+    // Регистрирует пользователя и привязывает к нему сессию так же, как кадр "join" клиента
+    void login(const std::shared_ptr<ChatSession>& session, const std::string& nickname) {
+        json response = server_->register_new_user(nickname, nickname, "bench");
+        session->handle_frame(json{
+            {"type", "join"},
+            {"user", nickname},
+            {"token", response["token"]}
+        }.dump());
+        poll();
+    }
+
+    void poll() { ioc_.poll(); }
+
+    ChatServer& server() { return *server_; }
+
+private:
+    boost::asio::io_context ioc_;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_;
+    std::unique_ptr<ChatServer> server_;
+};
+
+// Db
+
+void BM_DbSaveMessage(benchmark::State& state) {
+    BenchDb db(static_cast<std::size_t>(state.range(0)), MessageStoreKind::sqlite);
+    for (auto _ : state) {
+        db->save_message(1, "hello");
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DbSaveMessage)->Arg(0)->Arg(10000)->Arg(100000);
+
+// Пакет того же размера, что по умолчанию собирает MessageWriter
+void BM_DbSaveMessagesBatch(benchmark::State& state, MessageStoreKind store) {
+    BenchDb db(static_cast<std::size_t>(state.range(0)), store);
+    std::vector<NewMessage> batch(64, NewMessage{0, 1, kDefaultRoom, "hello"});
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db->save_messages(batch));
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(batch.size()));
+}
+BENCHMARK_CAPTURE(BM_DbSaveMessagesBatch, sqlite, MessageStoreKind::sqlite)->Arg(0)->Arg(10000)->Arg(100000);
+BENCHMARK_CAPTURE(BM_DbSaveMessagesBatch, segments, MessageStoreKind::segments)->Arg(0)->Arg(10000)->Arg(100000);
+
+// Последняя страница истории (подключение клиента)
+void BM_DbLoadMessagesLatest(benchmark::State& state, MessageStoreKind store) {
+    BenchDb db(static_cast<std::size_t>(state.range(0)), store);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db->load_messages(kDefaultRoom, 0, 50));
+    }
+}
+BENCHMARK_CAPTURE(BM_DbLoadMessagesLatest, sqlite, MessageStoreKind::sqlite)->Arg(1000)->Arg(10000)->Arg(100000);
+BENCHMARK_CAPTURE(BM_DbLoadMessagesLatest, segments, MessageStoreKind::segments)->Arg(1000)->Arg(10000)->Arg(100000);
+
+// Страница из середины таблицы (прокрутка истории вверх)
+void BM_DbLoadMessagesBefore(benchmark::State& state, MessageStoreKind store) {
+    BenchDb db(static_cast<std::size_t>(state.range(0)), store);
+    long long before_id = state.range(0) / 2;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db->load_messages(kDefaultRoom, before_id, 50));
+    }
+}
+BENCHMARK_CAPTURE(BM_DbLoadMessagesBefore, sqlite, MessageStoreKind::sqlite)->Arg(1000)->Arg(10000)->Arg(100000);
+BENCHMARK_CAPTURE(BM_DbLoadMessagesBefore, segments, MessageStoreKind::segments)->Arg(1000)->Arg(10000)->Arg(100000);
+
+// Первая страница поиска: редкое слово (1% сообщений) и слово из каждого сообщения
+void BM_DbSearchMessages(benchmark::State& state, MessageStoreKind store, const char* text) {
+    BenchDb db(static_cast<std::size_t>(state.range(0)), store);
+    SearchQuery query;
+    query.text = text;
+    query.room = kDefaultRoom;
+    query.limit = 21;
+    query.candidates = ServerConfig().search_candidates;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db->search_messages(query));
+    }
+}
+BENCHMARK_CAPTURE(BM_DbSearchMessages, sqlite_rare, MessageStoreKind::sqlite, "topic7")->Arg(10000)->Arg(100000);
+BENCHMARK_CAPTURE(BM_DbSearchMessages, segments_rare, MessageStoreKind::segments, "topic7")->Arg(10000)->Arg(100000);
+BENCHMARK_CAPTURE(BM_DbSearchMessages, sqlite_common, MessageStoreKind::sqlite, "message")->Arg(10000)->Arg(100000);
+BENCHMARK_CAPTURE(BM_DbSearchMessages, segments_common, MessageStoreKind::segments, "message")->Arg(10000)->Arg(100000);
+
+// Auth
+
+void BM_AuthHashPassword(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Auth::hash_password("correct horse battery staple"));
+    }
+}
+BENCHMARK(BM_AuthHashPassword);
+
+void BM_AuthCreateToken(benchmark::State& state) {
+    User user{1, "bench", "Bench", ""};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Auth::create_token(user));
+    }
+}
+BENCHMARK(BM_AuthCreateToken);
+
+void BM_AuthVerifyToken(benchmark::State& state) {
+    std::string token = Auth::create_token(User{1, "bench", "Bench", ""});
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Auth::verify_token(token));
+    }
+}
+BENCHMARK(BM_AuthVerifyToken);
+
+// Разбор и обработка кадров ChatSession
+
+// Обработка одного кадра вошедшего пользователя, включая выполнение
+// обработчиков, которые он поставил на strand сессий
+void run_dispatch(benchmark::State& state, const std::string& frame) {
+    BenchServer bench;
+    auto session = bench.add_session();
+    bench.login(session, "bench");
+    for (auto _ : state) {
+        session->handle_frame(frame);
+        bench.poll();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_DispatchMessage(benchmark::State& state) {
+    run_dispatch(state, json{
+        {"type", "message"},
+        {"user", "bench"},
+        {"text", "hello"},
+        {"client_id", 1}
+    }.dump());
+}
+BENCHMARK(BM_DispatchMessage);
+
+void BM_DispatchHistoryBefore(benchmark::State& state) {
+    run_dispatch(state, json{
+        {"type", "history_before"},
+        {"before_id", 1000000},
+        {"limit", 50}
+    }.dump());
+}
+BENCHMARK(BM_DispatchHistoryBefore);
+
+// Кадр незарегистрированного типа: разбор, промах поиска маршрута, кадр отбрасывается
+void BM_DispatchUnknown(benchmark::State& state) {
+    run_dispatch(state, json{
+        {"type", "bench_unknown"},
+        {"user", "bench"}
+    }.dump());
+}
+BENCHMARK(BM_DispatchUnknown);
+
+// Рассылка
+
+// Один кадр всем сессиям: обход снимка и постановка кадра на strand каждой сессии
+void BM_Broadcast(benchmark::State& state) {
+    BenchServer bench;
+    std::vector<std::shared_ptr<ChatSession>> sessions;
+    for (std::int64_t i = 0; i < state.range(0); ++i) sessions.push_back(bench.add_session());
+    Frame frame = make_frame(json{
+        {"type", "message"},
+        {"id", 1},
+        {"room", kDefaultRoom},
+        {"user", "bench"},
+        {"text", "hello"},
+        {"timestamp", "2025-01-01 00:00:00"}
+    }.dump());
+    for (auto _ : state) {
+        bench.server().broadcast(frame);
+        bench.poll();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Broadcast)->Arg(10)->Arg(1000)->Arg(10000);
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -1,320 +1,119 @@
 #include "chat_server.hpp"
+#include "chat_session.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "segment_log.hpp"
 #include <boost/asio/post.hpp>
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <deque>
+#include <optional>
+#include <sstream>
 #include <functional> // для std::hash
+#include <iterator>
 
-class ChatSession : public std::enable_shared_from_this<ChatSession> {
-public:
-    ChatSession(tcp::socket socket, ChatServer& server)
-        : ws_(std::move(socket)), server_(server), connected_(false) {}
+namespace {
 
-    void start() {
-        ws_.async_accept(
-            [self = shared_from_this()](beast::error_code ec) {
-                if (ec) {
-                    std::cerr << "Error accepting WebSocket: " << ec.message() << std::endl;
-                    return;
-                }
-                // Соединение установлено
-                self->connected_ = true;
-                std::cerr << "WebSocket accepted successfully" << std::endl;
-                
-                // Отправляем историю чата после успешного соединения
-                self->server_.send_chat_history(self);
-                
-                // Начинаем чтение сообщений
-                self->do_read();
-            });
-    }
+// Время UTC в формате "YYYY-MM-DD HH:MM:SS" (поле timestamp кадров)
+std::string format_timestamp(long long ts) {
+    std::time_t t = static_cast<std::time_t>(ts);
+    std::tm tm{};
+    gmtime_r(&t, &tm);
+    char buf[20];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    return buf;
+}
 
-    void send(const std::string& msg) {
-        // Проверяем, установлено ли соединение
-        if (!connected_) {
-            std::cerr << "Attempting to send message before connection established, queueing: " << msg << std::endl;
-            pending_messages_.push_back(msg);
-            return;
-        }
-        
-        // Используем post для избежания состояния гонки
-        boost::asio::post(ws_.get_executor(),
-            [self = shared_from_this(), msg]{
-                self->queue_.push_back(msg);
-                if (self->queue_.size() > 1) return;
-                self->do_write();
-            });
-    }
+std::string current_timestamp() { return format_timestamp(std::time(nullptr)); }
 
-private:
-    websocket::stream<tcp::socket> ws_;
-    ChatServer& server_;
-    beast::flat_buffer buffer_;
-    std::vector<std::string> queue_;
-    std::vector<std::string> pending_messages_; // Сообщения, ожидающие установки соединения
-    bool connected_;                           // Флаг установленного соединения
-
-    void do_read() {
-        ws_.async_read(buffer_,
-            [self = shared_from_this()](beast::error_code ec, std::size_t) {
-                if (ec) {
-                    self->server_.leave(self);
-                    return;
-                }
-                auto data = beast::buffers_to_string(self->buffer_.data());
-                self->buffer_.consume(self->buffer_.size());
-                
-                // Парсим JSON и сохраняем сообщение в БД
-                try {
-                    std::cerr << "Received raw data: " << data << std::endl;
-                    
-                    json j = json::parse(data);
-                    std::cerr << "Parsed JSON: type=" << j.value("type", "unknown") << std::endl;
-                    
-                    if (j.contains("type") && j["type"] == "register") {
-                        // Обработка регистрации нового пользователя
-                        std::cerr << "Register request from user: " << j.value("username", "unknown") << std::endl;
-                        
-                        if (j.contains("nickname") && j.contains("display_name") && j.contains("password")) {
-                            std::string nickname = j["nickname"];
-                            std::string display_name = j["display_name"];
-                            std::string password = j["password"];
-                            
-                            // Проверяем, существует ли уже пользователь с таким никнеймом
-                            bool nickname_exists = self->server_.db().check_nickname_exists(nickname);
-                            
-                            json response;
-                            if (nickname_exists) {
-                                response = {
-                                    {"type", "register_response"},
-                                    {"success", false},
-                                    {"error", "Пользователь с таким никнеймом уже существует"}
-                                };
-                            } else {
-                                // Хэшируем пароль
-                                std::string password_hash = Auth::hash_password(password);
-                                
-                                // Пытаемся зарегистрировать пользователя
-                                bool success = self->server_.db().register_user(nickname, display_name, password_hash);
-                                
-                                if (success) {
-                                    // Получаем созданного пользователя
-                                    auto user = self->server_.db().get_user_by_nickname(nickname);
-                                    if (user) {
-                                        // Создаем JWT токен
-                                        std::string token = Auth::create_token(*user);
-                                        
-                                        response = {
-                                            {"type", "register_response"},
-                                            {"success", true},
-                                            {"token", token},
-                                            {"nickname", nickname},
-                                            {"display_name", display_name}
-                                        };
-                                    } else {
-                                        response = {
-                                            {"type", "register_response"},
-                                            {"success", false},
-                                            {"error", "Ошибка при создании пользователя"}
-                                        };
-                                    }
-                                } else {
-                                    response = {
-                                        {"type", "register_response"},
-                                        {"success", false},
-                                        {"error", "Ошибка при создании пользователя"}
-                                    };
-                                }
-                            }
-                            
-                            // Отправляем ответ только текущему клиенту
-                            self->send(response.dump());
-                            self->do_read();
-                            return;
-                        }
-                    }
-                    else if (j.contains("type") && j["type"] == "login") {
-                        // Обработка логина
-                        std::cerr << "Login request from user: " << j.value("nickname", "unknown") << std::endl;
-                        
-                        if (j.contains("nickname") && j.contains("password")) {
-                            std::string nickname = j["nickname"];
-                            std::string password = j["password"];
-                            
-                            // Хэшируем пароль
-                            std::string password_hash = Auth::hash_password(password);
-                            
-                            // Проверяем логин и пароль
-                            auto user = self->server_.db().login_user(nickname, password_hash);
-                            
-                            json response;
-                            if (user) {
-                                // Создаем JWT токен
-                                std::string token = Auth::create_token(*user);
-                                
-                                response = {
-                                    {"type", "login_response"},
-                                    {"success", true},
-                                    {"token", token},
-                                    {"nickname", user->nickname},
-                                    {"display_name", user->display_name}
-                                };
-                            } else {
-                                response = {
-                                    {"type", "login_response"},
-                                    {"success", false},
-                                    {"error", "Неверный никнейм или пароль"}
-                                };
-                            }
-                            
-                            // Отправляем ответ только текущему клиенту
-                            self->send(response.dump());
-                            self->do_read();
-                            return;
-                        }
-                    }
-                    else if (j.contains("type") && j["type"] == "join") {
-                        // Обработка сообщения "join" - пользователь присоединился
-                        std::cerr << "Join message from user: " << j.value("user", "unknown") << std::endl;
-                        
-                        // Проверяем JWT токен если он есть
-                        bool auth_success = false;
-                        std::string display_name = j.value("user", "unknown");
-                        
-                        if (j.contains("token")) {
-                            std::string token = j["token"];
-                            auto user_id = Auth::verify_token(token);
-                            
-                            if (user_id) {
-                                auto user = self->server_.db().get_user_by_id(*user_id);
-                                // Проверяем по display_name, так как для фронтенда это будет отображаемое имя
-                                if (user && user->display_name == display_name) {
-                                    auth_success = true;
-                                }
-                            }
-                        }
-                        
-                        if (!auth_success) {
-                            json response = {
-                                {"type", "auth_error"},
-                                {"error", "Недействительный токен аутентификации"}
-                            };
-                            
-                            // Отправляем ошибку только текущему клиенту
-                            self->send(response.dump());
-                            self->do_read();
-                            return;
-                        }
-                        
-                        // Отправляем всем только broadcast, чтобы все узнали о новом пользователе
-                    }
-                    else if (j.contains("type") && j["type"] == "clear_history") {
-                        // Обработка команды очистки истории
-                        std::cerr << "*** Clear history command received ***" << std::endl;
-                        
-                        // Очищаем историю чата
-                        self->server_.clear_chat_history();
-                        
-                        // Не пересылаем это сообщение другим клиентам через broadcast
-                        self->do_read();
-                        return;
-                    }
-                    else if (j.contains("type") && j["type"] == "message" && j.contains("user") && j.contains("text")) {
-                        std::string username = j["user"];
-                        std::string message = j["text"];
-                        std::cerr << "Message from " << username << ": " << message << std::endl;
-                        
-                        // Проверяем JWT токен если он есть
-                        bool auth_success = false;
-                        int user_id = 0;
-                        
-                        if (j.contains("token")) {
-                            std::string token = j["token"];
-                            auto verified_user_id = Auth::verify_token(token);
-                            
-                            if (verified_user_id) {
-                                auto user = self->server_.db().get_user_by_id(*verified_user_id);
-                                // Проверяем по display_name, так как это отображаемое имя
-                                if (user && user->display_name == username) {
-                                    auth_success = true;
-                                    user_id = user->id;
-                                }
-                            }
-                        }
-                        
-                        if (!auth_success) {
-                            json response = {
-                                {"type", "auth_error"},
-                                {"error", "Недействительный токен аутентификации"}
-                            };
-                            
-                            // Отправляем ошибку только текущему клиенту
-                            self->send(response.dump());
-                            self->do_read();
-                            return;
-                        }
-                        
-                        // Сохраняем оригинальное имя пользователя в поле text
-                        // в формате JSON, чтобы восстановить позже
-                        json msgObj;
-                        msgObj["user"] = username;
-                        msgObj["text"] = message;
-                        std::string jsonText = msgObj.dump();
-                        
-                        self->server_.db().save_message(user_id, jsonText);
-                        std::cerr << "Saved message to DB: user_id=" << user_id << ", content=" << jsonText << std::endl;
-                    }
-                } catch (const std::exception& e) {
-                    // Ошибка парсинга JSON или сохранения в БД
-                    std::cerr << "Error parsing/saving message: " << e.what() << std::endl;
-                }
-                
-                self->server_.broadcast(data);           // рассылаем всем
-                self->do_read();
-            });
+std::unique_ptr<MessageStore> make_message_store(const ServerConfig& config) {
+    if (config.message_store == MessageStoreKind::segments) {
+        return std::make_unique<SegmentLogStore>(config.segments_dir, config.segment_bytes);
     }
+    return nullptr; // Таблицы самой БД
+}
 
-    void do_write() {
-        // Проверяем, что очередь не пуста и соединение установлено
-        if (queue_.empty() || !connected_) {
-            return;
-        }
-        
-        ws_.async_write(boost::asio::buffer(queue_.front()),
-            [self = shared_from_this()](beast::error_code ec, std::size_t) {
-                if (ec) {
-                    std::cerr << "Error writing to WebSocket: " << ec.message() << std::endl;
-                    self->server_.leave(self);
-                    return;
-                }
-                self->queue_.erase(self->queue_.begin());
-                
-                // Проверяем отложенные сообщения
-                if (self->queue_.empty() && !self->pending_messages_.empty()) {
-                    std::cerr << "Processing " << self->pending_messages_.size() << " pending messages" << std::endl;
-                    for (const auto& msg : self->pending_messages_) {
-                        self->queue_.push_back(msg);
-                    }
-                    self->pending_messages_.clear();
-                }
-                
-                if (!self->queue_.empty()) self->do_write();
-            });
-    }
-};
+// Кадр сообщения комнаты без id: id присваивается при публикации
+json message_json(const std::string& room, const std::string& username, const std::string& text) {
+    json msg;
+    msg["type"] = "message";
+    msg["room"] = room;
+    msg["user"] = username;
+    msg["text"] = text;
+    msg["timestamp"] = current_timestamp();
+    return msg;
+}
+
+json direct_json(long long id, const std::string& from, const std::string& from_name,
+                 const std::string& to, const std::string& text) {
+    return {
+        {"type", "direct"},
+        {"id", id},
+        {"from", from},
+        {"from_name", from_name},
+        {"to", to},
+        {"text", text},
+        {"timestamp", current_timestamp()}
+    };
+}
 
+} // namespace
 
-ChatServer::ChatServer(boost::asio::io_context& ioc, tcp::endpoint ep)
-    : acceptor_(ioc), db_("chat.db") {
+ChatServer::ChatServer(boost::asio::io_context& ioc, tcp::endpoint ep, const ServerConfig& config)
+    : config_(config), ioc_(ioc), acceptor_(ioc), rooms_(std::make_shared<const RoomMap>()),
+      db_(config.db_path, config.db_readers, config.user_cache, make_message_store(config), config.db_convert_vacuum),
+      last_message_id_(db_.last_message_id()),
+      recent_(config.recent_messages),
+      last_direct_id_(db_.last_direct_message_id()),
+      writer_(db_, config.db_batch_size, std::chrono::milliseconds(config.db_flush_ms)),
+      auth_pool_(config.auth_threads, config.auth_queue),
+      typing_(std::chrono::milliseconds(config.typing_interval_ms)),
+      typing_timer_(boost::asio::make_strand(ioc)) {
+    recent_.reset(last_message_id_);
     beast::error_code ec;
     acceptor_.open(ep.protocol(), ec);
     acceptor_.set_option(boost::asio::socket_base::reuse_address(true), ec);
+    if (config_.cluster) {
+        // Порт слушают все процессы кластера, ядро распределяет между ними соединения
+        using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+        acceptor_.set_option(reuse_port(true), ec);
+    }
     acceptor_.bind(ep, ec);
+    if (ec) LOG_ERROR("Failed to bind " << ep << ": " << ec.message());
     acceptor_.listen(boost::asio::socket_base::max_listen_connections, ec);
+
+    if (config_.cluster) {
+        std::string name = config_.cluster_bus.empty() ? "chat-server-" + std::to_string(ep.port())
+                                                       : config_.cluster_bus;
+        bus_ = std::make_unique<ClusterBus>(ioc, std::move(name),
+            [this](json& request) { sequence(request); },
+            [this](const json& event) { apply(event); },
+            [this] { on_bus_reset(); });
+    }
+
+    RetentionPolicy retention;
+    retention.max_age_seconds = static_cast<long long>(config_.retention_days) * 24 * 3600;
+    retention.max_messages = config_.retention_messages;
+    retention.max_bytes = config_.retention_bytes;
+    // Поток нужен и без срока хранения: очищенная история удаляется в нём же.
+    // В кластере БД общая, сообщения удаляет только ведущий процесс.
+    std::function<bool()> active;
+    if (bus_) active = [this] { return bus_->is_hub(); };
+    retention_ = std::make_unique<RetentionTask>(db_, retention, config_.retention_batch,
+                                                 std::chrono::milliseconds(config_.retention_interval_ms),
+                                                 std::move(active));
 }
 
-void ChatServer::run() { do_accept(); }
+void ChatServer::run() {
+    if (bus_) bus_->start();
+    do_accept();
+}
 
 void ChatServer::do_accept() {
-    acceptor_.async_accept([this](beast::error_code ec, tcp::socket socket) {
+    // Каждое соединение получает собственный strand: обработчики одной сессии
+    // не выполняются параллельно, а разные сессии обслуживаются всеми потоками
+    acceptor_.async_accept(boost::asio::make_strand(ioc_), [this](beast::error_code ec, tcp::socket socket) {
         if (!ec) {
             auto session = std::make_shared<ChatSession>(std::move(socket), *this);
             join(session);
@@ -326,96 +125,726 @@ void ChatServer::do_accept() {
 }
 
 void ChatServer::join(std::shared_ptr<ChatSession> s) {
-    std::lock_guard<std::mutex> l(mtx_);
+    std::lock_guard<std::mutex> l(registry_mtx_);
+    SessionEntry entry;
+    entry.rooms.insert(kDefaultRoom);
+    if (!members_.emplace(s, std::move(entry)).second) return;
     sessions_.insert(s);
+    add_to_room(s, kDefaultRoom);
 }
 
 void ChatServer::leave(std::shared_ptr<ChatSession> s) {
-    std::lock_guard<std::mutex> l(mtx_);
+    std::lock_guard<std::mutex> l(registry_mtx_);
+    auto it = members_.find(s);
+    if (it == members_.end()) return;
+    for (const auto& room : it->second.rooms) remove_from_room(s, room);
+    unbind_user(s, it->second);
+    members_.erase(it);
     sessions_.erase(s);
 }
 
-void ChatServer::broadcast(const std::string& msg) {
-    std::lock_guard<std::mutex> l(mtx_);
-    std::cerr << "Broadcasting message: " << msg << std::endl;
+JoinResult ChatServer::join_room(std::shared_ptr<ChatSession> s, const std::string& room) {
+    std::lock_guard<std::mutex> l(registry_mtx_);
+    auto it = members_.find(s);
+    if (it == members_.end()) return JoinResult::already_joined; // Сессия уже отключилась
+    auto& rooms = it->second.rooms;
+    if (rooms.count(room)) return JoinResult::already_joined;
+    if (rooms.size() >= config_.max_rooms) return JoinResult::too_many_rooms;
+    rooms.insert(room);
+    add_to_room(s, room);
+    return JoinResult::joined;
+}
+
+bool ChatServer::leave_room(std::shared_ptr<ChatSession> s, const std::string& room) {
+    std::lock_guard<std::mutex> l(registry_mtx_);
+    auto it = members_.find(s);
+    if (it == members_.end() || it->second.rooms.erase(room) == 0) return false;
+    remove_from_room(s, room);
+    return true;
+}
+
+bool ChatServer::is_member(const std::shared_ptr<ChatSession>& s, const std::string& room) {
+    std::lock_guard<std::mutex> l(registry_mtx_);
+    auto it = members_.find(s);
+    return it != members_.end() && it->second.rooms.count(room) > 0;
+}
+
+// Вызывается под registry_mtx_. Карта комнат копируется, только если комнаты ещё нет.
+void ChatServer::add_to_room(const std::shared_ptr<ChatSession>& s, const std::string& room) {
+    auto rooms = std::atomic_load(&rooms_);
+    auto it = rooms->find(room);
+    if (it != rooms->end()) {
+        it->second->insert(s);
+        return;
+    }
+    auto set = std::make_shared<SessionSet>();
+    set->insert(s);
+    auto next = std::make_shared<RoomMap>(*rooms);
+    next->emplace(room, std::move(set));
+    std::atomic_store(&rooms_, std::shared_ptr<const RoomMap>(std::move(next)));
+}
+
+// Вызывается под registry_mtx_
+void ChatServer::remove_from_room(const std::shared_ptr<ChatSession>& s, const std::string& room) {
+    auto rooms = std::atomic_load(&rooms_);
+    auto it = rooms->find(room);
+    if (it == rooms->end()) return;
+    it->second->erase(s);
+    if (it->second->empty()) {
+        auto next = std::make_shared<RoomMap>(*rooms);
+        next->erase(room);
+        std::atomic_store(&rooms_, std::shared_ptr<const RoomMap>(std::move(next)));
+    }
+}
+
+void ChatServer::bind_user(std::shared_ptr<ChatSession> s, int user_id) {
+    std::lock_guard<std::mutex> l(registry_mtx_);
+    auto it = members_.find(s);
+    if (it == members_.end() || it->second.user_id == user_id) return;
+    unbind_user(s, it->second);
+    if (user_id == 0) return;
+    it->second.user_id = user_id;
+    auto& sessions = user_sessions_[user_id];
+    if (!sessions) sessions = std::make_shared<UserSessions>();
+    sessions->insert(s);
+}
+
+// Вызывается под registry_mtx_
+void ChatServer::unbind_user(const std::shared_ptr<ChatSession>& s, SessionEntry& entry) {
+    if (entry.user_id == 0) return;
+    auto u = user_sessions_.find(entry.user_id);
+    if (u != user_sessions_.end()) {
+        u->second->erase(s);
+        if (u->second->empty()) user_sessions_.erase(u);
+    }
+    entry.user_id = 0;
+}
+
+std::size_t ChatServer::send_to_user(int user_id, const Frame& frame) {
+    // Под мьютексом только поиск; отправка идёт уже по снимку
+    std::shared_ptr<UserSessions> sessions;
+    {
+        std::lock_guard<std::mutex> l(registry_mtx_);
+        auto it = user_sessions_.find(user_id);
+        if (it == user_sessions_.end()) return 0;
+        sessions = it->second;
+    }
+    std::size_t sent = 0;
+    sessions->for_each([&](const std::shared_ptr<ChatSession>& s) {
+        s->send(frame);
+        ++sent;
+    });
+    return sent;
+}
+
+std::vector<SessionQueueStats> ChatServer::queue_stats() {
+    std::vector<SessionQueueStats> stats;
+    stats.reserve(sessions_.size());
+    sessions_.for_each([&](const std::shared_ptr<ChatSession>& s) { stats.push_back(s->queue_stats()); });
+    return stats;
+}
+
+std::string ChatServer::render_metrics() {
+    std::ostringstream out;
+    metrics().write(out);
+    
+    // Состояние на момент запроса: снимается с реестра и очередей сессий
+    auto stats = queue_stats();
+    std::size_t frames_sum = 0, frames_max = 0, bytes_sum = 0, bytes_max = 0;
+    static constexpr std::size_t kDepthBounds[] = {0, 1, 8, 64, 512};
+    std::size_t depth_buckets[std::size(kDepthBounds)] = {};
+    for (const auto& st : stats) {
+        frames_sum += st.frames;
+        bytes_sum += st.bytes;
+        frames_max = std::max(frames_max, st.frames);
+        bytes_max = std::max(bytes_max, st.bytes);
+        for (std::size_t i = 0; i < std::size(kDepthBounds); ++i) {
+            if (st.frames <= kDepthBounds[i]) ++depth_buckets[i];
+        }
+    }
+    
+    out << "# HELP chat_sessions Connected sessions\n"
+        << "# TYPE chat_sessions gauge\n"
+        << "chat_sessions " << stats.size() << '\n'
+        << "# HELP chat_rooms Rooms with at least one subscriber\n"
+        << "# TYPE chat_rooms gauge\n"
+        << "chat_rooms " << std::atomic_load(&rooms_)->size() << '\n'
+        << "# HELP chat_send_queue_frames Frames waiting in session send queues\n"
+        << "# TYPE chat_send_queue_frames gauge\n"
+        << "chat_send_queue_frames{stat=\"sum\"} " << frames_sum << '\n'
+        << "chat_send_queue_frames{stat=\"max\"} " << frames_max << '\n'
+        << "# HELP chat_send_queue_bytes Bytes waiting in session send queues\n"
+        << "# TYPE chat_send_queue_bytes gauge\n"
+        << "chat_send_queue_bytes{stat=\"sum\"} " << bytes_sum << '\n'
+        << "chat_send_queue_bytes{stat=\"max\"} " << bytes_max << '\n'
+        << "# HELP chat_send_queue_sessions Sessions whose send queue holds at most le frames\n"
+        << "# TYPE chat_send_queue_sessions gauge\n";
+    for (std::size_t i = 0; i < std::size(kDepthBounds); ++i) {
+        out << "chat_send_queue_sessions{le=\"" << kDepthBounds[i] << "\"} " << depth_buckets[i] << '\n';
+    }
+    out << "chat_send_queue_sessions{le=\"+Inf\"} " << stats.size() << '\n'
+        << "# HELP chat_auth_queue_depth Register/login jobs waiting or running\n"
+        << "# TYPE chat_auth_queue_depth gauge\n"
+        << "chat_auth_queue_depth " << auth_pool_.depth() << '\n'
+        << "# HELP chat_log_dropped_total Log records dropped by a full log queue\n"
+        << "# TYPE chat_log_dropped_total counter\n"
+        << "chat_log_dropped_total " << Log::dropped() << '\n';
+    return out.str();
+}
+
+void ChatServer::broadcast(std::string msg) {
+    broadcast(make_frame(std::move(msg)));
+}
+
+void ChatServer::broadcast(Frame frame) {
+    if (bus_) {
+        bus_->publish({{"kind", "broadcast"}, {"frame", frame->text()}});
+        return;
+    }
+    broadcast_local(frame);
+}
+
+void ChatServer::broadcast_local(const Frame& frame) {
+    // Кадр уже сериализован вызывающей стороной: повторный разбор JSON не нужен,
+    // а каждой сессии передаётся только ссылка на общий буфер
+    LOG_DEBUG("Broadcasting message: " << frame->text());
+    ScopedTimer timer(metrics().broadcast_seconds);
+    sessions_.for_each([&](const std::shared_ptr<ChatSession>& s) { s->send(frame); });
+}
+
+void ChatServer::broadcast_room(const std::string& room, Frame frame) {
+    if (bus_) {
+        bus_->publish({{"kind", "room"}, {"room", room}, {"frame", frame->text()}});
+        return;
+    }
+    broadcast_room_local(room, frame);
+}
+
+void ChatServer::broadcast_room_local(const std::string& room, const Frame& frame) {
+    auto rooms = std::atomic_load(&rooms_);
+    auto it = rooms->find(room);
+    if (it == rooms->end()) return;
+    LOG_DEBUG("Broadcasting to room " << room << ": " << frame->text());
+    ScopedTimer timer(metrics().broadcast_seconds);
+    it->second->for_each([&](const std::shared_ptr<ChatSession>& s) { s->send(frame); });
+}
+
+json ChatServer::register_new_user(const std::string& nickname, const std::string& display_name,
+                                   const std::string& password) {
+    // Проверяем, существует ли уже пользователь с таким никнеймом
+    bool nickname_exists = db_.check_nickname_exists(nickname);
+    
+    json response;
+    if (nickname_exists) {
+        response = {
+            {"type", "register_response"},
+            {"success", false},
+            {"error", "Пользователь с таким никнеймом уже существует"}
+        };
+    } else {
+        // Хэшируем пароль
+        std::string password_hash = Auth::hash_password(password);
+        
+        // Пытаемся зарегистрировать пользователя
+        bool success = db_.register_user(nickname, display_name, password_hash);
+        
+        if (success) {
+            // Получаем созданного пользователя
+            auto user = db_.get_user_by_nickname(nickname);
+            if (user) {
+                // Создаем JWT токен
+                std::string token = Auth::create_token(*user);
+                
+                response = {
+                    {"type", "register_response"},
+                    {"success", true},
+                    {"token", token},
+                    {"nickname", nickname},
+                    {"display_name", display_name}
+                };
+            } else {
+                response = {
+                    {"type", "register_response"},
+                    {"success", false},
+                    {"error", "Ошибка при создании пользователя"}
+                };
+            }
+        } else {
+            response = {
+                {"type", "register_response"},
+                {"success", false},
+                {"error", "Ошибка при создании пользователя"}
+            };
+        }
+    }
     
-    // Проверяем, что это валидный JSON
+    return response;
+}
+
+json ChatServer::authenticate_user(const std::string& nickname, const std::string& password) {
+    // Хэшируем пароль
+    std::string password_hash = Auth::hash_password(password);
+    
+    // Проверяем логин и пароль
+    auto user = db_.login_user(nickname, password_hash);
+    
+    json response;
+    if (user) {
+        // Создаем JWT токен
+        std::string token = Auth::create_token(*user);
+        
+        response = {
+            {"type", "login_response"},
+            {"success", true},
+            {"token", token},
+            {"nickname", user->nickname},
+            {"display_name", user->display_name}
+        };
+    } else {
+        response = {
+            {"type", "login_response"},
+            {"success", false},
+            {"error", "Неверный никнейм или пароль"}
+        };
+    }
+    
+    return response;
+}
+
+void ChatServer::publish_message(int user_id, const std::string& room, const std::string& username,
+                                 const std::string& text, MessageWriter::Callback on_saved) {
+    // В БД пишется только текст: имя автора история берёт из users по user_id
+    if (bus_) {
+        // id присвоит ведущий кластера, в БД сообщение пишет процесс отправителя
+        json request = {{"kind", "message"}, {"room", room}, {"user", username}, {"text", text}};
+        bus_->publish(std::move(request),
+            [this, user_id, room, text, on_saved = std::move(on_saved)](const json* event) mutable {
+                if (!event) {
+                    if (on_saved) on_saved(false, 0);
+                    return;
+                }
+                writer_.enqueue({event->at("id").get<long long>(), user_id, room, std::move(text)},
+                                std::move(on_saved));
+            });
+        return;
+    }
+    
+    json msg = message_json(room, username, text);
+    
+    // Под мьютексом только присвоение id, запись в кольцо и в очередь записи: хранилище
+    // получает сообщения в порядке id (этого требует журнал сегментов). Рассылка идёт
+    // после, параллельно с рассылками других сообщений. Порядок id в каждой сессии
+    // восстанавливает сама сессия: кадр помнит, какие сообщения ещё рассылались, когда
+    // началась его рассылка, и сессия берёт их из кольца раньше него (ChatSession::enqueue).
+    long long id;
+    Frame frame;
+    {
+        std::lock_guard<std::mutex> l(publish_mtx_);
+        id = ++last_message_id_;
+        msg["id"] = id;
+        long long ordered_after = fanning_out_.empty() ? id - 1 : fanning_out_.front() - 1;
+        frame = make_frame(msg.dump(), id, ordered_after);
+        fanning_out_.push_back(id);
+        recent_.push(id, room, frame);
+        writer_.enqueue({id, user_id, room, text}, std::move(on_saved));
+    }
+    broadcast_room_local(room, frame);
+    std::lock_guard<std::mutex> l(publish_mtx_);
+    fanning_out_.erase(std::find(fanning_out_.begin(), fanning_out_.end(), id));
+}
+
+void ChatServer::publish_typing(const User& user, const std::string& room) {
+    if (!typing_.add(user.id, user.display_name, room, TypingTracker::Clock::now())) return;
+    // Первое событие после рассылки: таймер меняется только на своём strand
+    boost::asio::post(typing_timer_.get_executor(), [this] {
+        typing_timer_.expires_after(std::chrono::milliseconds(config_.typing_flush_ms));
+        typing_timer_.async_wait([this](beast::error_code ec) {
+            if (!ec) flush_typing();
+        });
+    });
+}
+
+void ChatServer::flush_typing() {
+    for (auto& [room, users] : typing_.take(TypingTracker::Clock::now())) {
+        json presence = {
+            {"type", "presence"},
+            {"room", room},
+            {"typing", users}
+        };
+        broadcast_room(room, make_frame(presence.dump()));
+    }
+}
+
+void ChatServer::publish_direct(const User& sender, const User& recipient, const std::string& text,
+                                MessageWriter::Callback on_saved) {
+    if (bus_) {
+        json request = {
+            {"kind", "direct"},
+            {"sender_id", sender.id},
+            {"recipient_id", recipient.id},
+            {"from", sender.nickname},
+            {"from_name", sender.display_name},
+            {"to", recipient.nickname},
+            {"text", text}
+        };
+        bus_->publish(std::move(request),
+            [this, sender_id = sender.id, recipient_id = recipient.id, text,
+             on_saved = std::move(on_saved)](const json* event) mutable {
+                if (!event) {
+                    if (on_saved) on_saved(false, 0);
+                    return;
+                }
+                NewMessage message{event->at("id").get<long long>(), sender_id, std::string(), std::move(text)};
+                message.recipient_id = recipient_id;
+                writer_.enqueue(std::move(message), std::move(on_saved));
+            });
+        return;
+    }
+    
+    NewMessage message{0, sender.id, std::string(), text};
+    message.recipient_id = recipient.id;
+    long long id;
+    Frame frame;
+    {
+        // Очередь записи, как и у сообщений комнат, идёт в порядке id
+        std::lock_guard<std::mutex> l(publish_mtx_);
+        id = message.id = ++last_direct_id_;
+        frame = make_frame(direct_json(id, sender.nickname, sender.display_name, recipient.nickname, text).dump());
+        writer_.enqueue(std::move(message), std::move(on_saved));
+    }
+    
+    // Обходим только сессии двух участников, а не всех подключённых:
+    // получателю и всем устройствам отправителя (включая текущее)
+    std::size_t delivered = send_to_user(recipient.id, frame);
+    if (sender.id != recipient.id) send_to_user(sender.id, frame);
+    LOG_DEBUG("Direct message " << id << " from " << sender.nickname << " to " << recipient.nickname
+              << ": delivered to " << delivered << " sessions");
+}
+
+void ChatServer::send_direct_history(std::shared_ptr<ChatSession> session, const User& user, const User& peer,
+                                     long long before_id, std::size_t limit) {
+    if (limit == 0) limit = config_.history_page_size;
+    limit = std::min(limit, config_.history_max_page);
+    
+    try {
+        auto rows = db_.load_direct_messages(user.id, peer.id, before_id, limit + 1);
+        bool has_more = rows.size() > limit;
+        if (has_more) rows.erase(rows.begin());
+        
+        json messages = json::array();
+        for (const auto& row : rows) {
+            const User& from = row.sender_id == user.id ? user : peer;
+            const User& to = row.sender_id == user.id ? peer : user;
+            messages.push_back({
+                {"type", "direct"},
+                {"id", row.id},
+                {"from", from.nickname},
+                {"from_name", from.display_name},
+                {"to", to.nickname},
+                {"text", row.text},
+                {"timestamp", format_timestamp(row.ts)}
+            });
+        }
+        
+        json page;
+        page["type"] = "direct_history";
+        page["with"] = peer.nickname;
+        page["messages"] = std::move(messages);
+        page["has_more"] = has_more;
+        if (before_id > 0) page["before_id"] = before_id;
+        session->send(page.dump());
+    } catch(const std::exception& e) {
+        LOG_ERROR("Error sending direct history: " << e.what());
+    }
+}
+
+namespace {
+
+// Преобразует строку из БД в сообщение в формате, который ожидает клиент
+json history_message(const StoredMessage& row) {
+    return {
+        {"type", "message"},
+        {"id", row.id},
+        {"room", row.room},
+        {"user", row.user},
+        {"text", row.text},
+        {"timestamp", format_timestamp(row.ts)}
+    };
+}
+
+} // namespace
+
+void ChatServer::send_chat_history(std::shared_ptr<ChatSession> session, const std::string& room,
+                                   long long before_id, std::size_t limit) {
     try {
-        json j = json::parse(msg);
-        // Всё в порядке, JSON валидный
+        session->send(history_page(room, before_id, limit)); // Вся страница уходит одним кадром
     } catch(const std::exception& e) {
-        std::cerr << "Warning: Broadcast message is not valid JSON: " << e.what() << std::endl;
+        LOG_ERROR("Error sending chat history: " << e.what());
     }
+}
+
+Frame ChatServer::history_page(const std::string& room, long long before_id, std::size_t limit) {
+    // Реестр сессий не блокируем: Db синхронизирует доступ сам, а рассылка не должна ждать чтения истории
+    if (limit == 0) limit = config_.history_page_size;
+    limit = std::min(limit, config_.history_max_page);
+    
+    // Читаем на одну строку больше, чтобы узнать, есть ли ещё более ранние сообщения
+    auto rows = db_.load_messages(room, before_id, limit + 1);
+    bool has_more = rows.size() > limit;
+    if (has_more) rows.erase(rows.begin());
+    
+    json messages = json::array();
+    for (const auto& row : rows) messages.push_back(history_message(row));
     
-    for (auto& s : sessions_) s->send(msg);
+    json page;
+    page["type"] = "history";
+    page["room"] = room;
+    page["messages"] = std::move(messages);
+    page["has_more"] = has_more;
+    if (before_id > 0) page["before_id"] = before_id;
+    
+    LOG_DEBUG("Sending history page of " << room << ": " << rows.size() << " messages, before_id=" << before_id);
+    return make_frame(page.dump());
 }
 
-void ChatServer::send_chat_history(std::shared_ptr<ChatSession> session) {
-    std::lock_guard<std::mutex> l(mtx_);
-    db_.load_messages([session](int user_id, const std::string& text, const std::string& ts) {
+void ChatServer::send_search_results(std::shared_ptr<ChatSession> session, SearchQuery query) {
+    if (query.limit == 0) query.limit = config_.history_page_size;
+    query.limit = std::min(query.limit, config_.history_max_page);
+    query.candidates = config_.search_candidates;
+    std::size_t limit = query.limit;
+    
+    try {
+        // Как и в истории, одна лишняя строка показывает, есть ли следующая страница
+        ++query.limit;
+        auto rows = db_.search_messages(query);
+        bool has_more = rows.size() > limit;
+        if (has_more) rows.pop_back();
+        
+        json messages = json::array();
+        for (const auto& row : rows) messages.push_back(history_message(row));
+        
+        json page;
+        page["type"] = "search_results";
+        page["room"] = query.room;
+        page["query"] = query.text;
+        page["offset"] = query.offset;
+        page["messages"] = std::move(messages);
+        page["has_more"] = has_more;
+        
+        LOG_DEBUG("Search in " << query.room << " for \"" << query.text << "\": " << rows.size() << " messages");
+        session->send(page.dump());
+    } catch(const std::exception& e) {
+        LOG_ERROR("Error searching messages: " << e.what());
+    }
+}
+
+std::optional<std::unordered_set<std::string>> ChatServer::session_rooms(const std::shared_ptr<ChatSession>& s) {
+    std::lock_guard<std::mutex> l(registry_mtx_);
+    auto it = members_.find(s);
+    if (it == members_.end()) return std::nullopt;
+    return it->second.rooms;
+}
+
+std::optional<std::vector<Frame>> ChatServer::recent_missed(const std::shared_ptr<ChatSession>& session,
+                                                            long long last_id, long long& up_to) {
+    up_to = 0;
+    if (last_id <= 0) return std::nullopt;
+    auto rooms = session_rooms(session);
+    if (!rooms) return std::vector<Frame>{};
+    
+    // Недавний разрыв досылаем из памяти готовыми кадрами, без обращения к БД
+    auto frames = recent_.since(last_id, *rooms, &up_to);
+    if (frames) LOG_DEBUG("Resuming from id " << last_id << ": " << frames->size() << " messages from memory");
+    return frames;
+}
+
+void ChatServer::load_missed_messages(const std::shared_ptr<ChatSession>& session, long long last_id,
+                                      MissedCallback done) {
+    auto rooms = session_rooms(session);
+    if (!rooms) return;
+    long long up_to;
+    {
+        std::lock_guard<std::mutex> l(publish_mtx_);
+        up_to = last_message_id_;
+    }
+    auto job = [this, rooms = std::move(*rooms), last_id, up_to, done = std::move(done)] {
+        // Ждём записи только сообщений до up_to: в БД есть всё, что разослано до запроса.
+        // В кластере сообщения других процессов могут быть ещё не записаны: граница
+        // не задаётся, повторы отбросит клиент.
+        writer_.wait_persisted(up_to);
+        done(missed_pages(rooms, last_id), bus_ ? 0 : up_to);
+    };
+    if (!auth_pool_.try_post(job)) {
+        LOG_WARN("Auth pool is full, loading missed messages on the io thread");
+        job();
+    }
+}
+
+// Из БД — по комнатам, каждой отдельной страницей
+std::vector<Frame> ChatServer::missed_pages(const std::unordered_set<std::string>& rooms, long long last_id) {
+    std::vector<Frame> frames;
+    for (const auto& room : rooms) {
         try {
-            // Пытаемся распарсить сохраненный JSON
-            json msgData;
-            std::string username, messageText;
-            
-            try {
-                msgData = json::parse(text);
-                // Проверяем наличие полей user и text
-                if (msgData.contains("user")) {
-                    username = msgData["user"].get<std::string>();
-                } else {
-                    username = "User_" + std::to_string(user_id);
-                }
-                
-                if (msgData.contains("text")) {
-                    messageText = msgData["text"].get<std::string>();
-                } else {
-                    messageText = text;
-                }
-            } catch(...) {
-                // Если не получилось распарсить как JSON, используем старый формат
-                username = "User_" + std::to_string(user_id);
-                messageText = text;
+            std::size_t limit = config_.history_max_page;
+            auto rows = last_id > 0 ? db_.load_messages_after(room, last_id, limit + 1) : std::vector<StoredMessage>{};
+            if (last_id <= 0 || rows.size() > limit) {
+                // Клиент ничего не видел или разрыв слишком большой:
+                // комната начинается заново с последней страницы
+                frames.push_back(history_page(room, 0, 0));
+                continue;
             }
-
-            // Создаем JSON сообщение в формате, который ожидает клиент
-            json msg;
-            msg["type"] = "message";
-            msg["user"] = username;
-            msg["text"] = messageText;
-            // timestamp не используется клиентом, но можем оставить для будущего использования
-            msg["timestamp"] = ts;
             
-            std::string json_str = msg.dump();
-            std::cerr << "Sending history message: " << json_str << std::endl;
-            session->send(json_str); // Отправляем сериализованный JSON
+            json messages = json::array();
+            for (const auto& row : rows) messages.push_back(history_message(row));
+            
+            json page;
+            page["type"] = "history";
+            page["room"] = room;
+            page["messages"] = std::move(messages);
+            page["has_more"] = false;
+            page["after_id"] = last_id;
+            
+            LOG_DEBUG("Resuming " << room << " from id " << last_id << ": " << rows.size() << " messages from DB");
+            frames.push_back(make_frame(page.dump()));
         } catch(const std::exception& e) {
-            std::cerr << "Error sending chat history: " << e.what() << std::endl;
+            LOG_ERROR("Error loading missed messages: " << e.what());
         }
-    });
+    }
+    return frames;
 }
 
 void ChatServer::clear_chat_history() {
-    std::lock_guard<std::mutex> l(mtx_);
+    // Сообщение всем клиентам о том, что история очищена
+    json notification;
+    notification["type"] = "system";
+    notification["text"] = "История чата была очищена администратором";
+    
+    if (bus_) {
+        // Очистку выполняет каждый процесс кластера, получив событие шины (см. apply)
+        LOG_INFO("Clearing chat history in the cluster");
+        bus_->publish({{"kind", "clear"}, {"frame", notification.dump()}});
+        return;
+    }
+    
     try {
-        std::cerr << "=======================================" << std::endl;
-        std::cerr << "CLEARING CHAT HISTORY FROM DATABASE..." << std::endl;
-        std::cerr << "=======================================" << std::endl;
-        db_.clear_messages();
-        
-        // Отправляем всем клиентам сообщение о том, что история очищена
-        json notification;
-        notification["type"] = "system";
-        notification["text"] = "История чата была очищена администратором";
-        
-        std::string notification_str = notification.dump();
-        std::cerr << "Sending notification to all clients: " << notification_str << std::endl;
-        for (auto& s : sessions_) s->send(notification_str);
-        
-        std::cerr << "=======================================" << std::endl;
-        std::cerr << "CHAT HISTORY HAS BEEN CLEARED SUCCESSFULLY" << std::endl;
-        std::cerr << "=======================================" << std::endl;
+        LOG_INFO("Clearing chat history");
+        // Граница — последнее опубликованное сообщение. Публикация её не ждёт: сообщения
+        // до границы дописываются в хранилище без мьютекса публикации, сами они удаляются в фоне
+        long long up_to;
+        {
+            std::lock_guard<std::mutex> pl(publish_mtx_);
+            up_to = last_message_id_;
+        }
+        writer_.wait_persisted(up_to);
+        db_.clear_messages(up_to);
+        {
+            // Кольцо начинается заново: очищенные сообщения больше не досылаются из памяти
+            std::lock_guard<std::mutex> pl(publish_mtx_);
+            recent_.reset(last_message_id_);
+        }
+        broadcast_local(make_frame(notification.dump()));
+        retention_->wake();
+        LOG_INFO("Chat history cleared");
+    } catch (const std::exception& e) {
+        LOG_ERROR("Error clearing chat history: " << e.what());
+    }
+}
+
+// Вызывается только у ведущего, на strand шины: запросы всех процессов проходят
+// здесь по одному, поэтому id сообщений общие и идут подряд во всём кластере
+void ChatServer::sequence(json& request) {
+    try {
+        const auto& kind = request.at("kind").get_ref<const std::string&>();
+        if (kind == "message") {
+            json msg = message_json(request.at("room").get<std::string>(), request.at("user").get<std::string>(),
+                                    request.at("text").get<std::string>());
+            std::lock_guard<std::mutex> l(publish_mtx_);
+            long long id = last_message_id_ + 1;
+            msg["id"] = id;
+            request["id"] = id;
+            request["frame"] = msg.dump();
+            request.erase("user");
+            request.erase("text");
+        } else if (kind == "direct") {
+            long long id = last_direct_id_ + 1;
+            request["id"] = id;
+            request["frame"] = direct_json(id, request.at("from").get<std::string>(),
+                                           request.at("from_name").get<std::string>(),
+                                           request.at("to").get<std::string>(),
+                                           request.at("text").get<std::string>()).dump();
+            for (const char* field : {"from", "from_name", "to", "text"}) request.erase(field);
+        } else if (kind == "clear") {
+            // Граница очистки: всё, что разослано раньше
+            std::lock_guard<std::mutex> l(publish_mtx_);
+            request["id"] = last_message_id_;
+        }
     } catch (const std::exception& e) {
-        std::cerr << "ERROR CLEARING CHAT HISTORY: " << e.what() << std::endl;
+        LOG_ERROR("Invalid cluster bus request: " << e.what());
     }
-}
\ No newline at end of file
+}
+
+// Выполняется в каждом процессе на strand шины, в порядке ведущего
+void ChatServer::apply(const json& event) {
+    try {
+        const auto& kind = event.at("kind").get_ref<const std::string&>();
+        // События шины применяются по одному, поэтому рассылка сообщения начинается,
+        // когда рассылка предыдущих уже закончена
+        long long message_id = kind == "message" ? event.at("id").get<long long>() : 0;
+        auto frame = make_frame(event.at("frame").get<std::string>(), message_id,
+                                std::max<long long>(0, message_id - 1));
+        if (kind == "message") {
+            const auto& room = event.at("room").get_ref<const std::string&>();
+            {
+                std::lock_guard<std::mutex> l(publish_mtx_);
+                // Процесс пропустил события (подключился позже или переподключался к шине):
+                // кольцо начинается заново, более ранние сообщения досылаются из БД
+                if (message_id != last_message_id_ + 1) recent_.reset(message_id - 1);
+                last_message_id_ = message_id;
+                recent_.push(message_id, room, frame);
+            }
+            broadcast_room_local(room, frame);
+        } else if (kind == "direct") {
+            last_direct_id_ = event.at("id").get<long long>();
+            int sender_id = event.at("sender_id").get<int>();
+            int recipient_id = event.at("recipient_id").get<int>();
+            std::size_t delivered = send_to_user(recipient_id, frame);
+            if (sender_id != recipient_id) send_to_user(sender_id, frame);
+            LOG_DEBUG("Direct message " << last_direct_id_ << ": delivered to " << delivered << " local sessions");
+        } else if (kind == "room") {
+            broadcast_room_local(event.at("room").get_ref<const std::string&>(), frame);
+        } else if (kind == "clear") {
+            // Каждый процесс дописывает свою очередь записи и отмечает границу очистки:
+            // сообщения, разосланные после очистки, сохраняются. Удаляет их ведущий в фоне.
+            long long up_to = event.at("id").get<long long>();
+            writer_.wait_persisted(up_to);
+            db_.clear_messages(up_to);
+            {
+                std::lock_guard<std::mutex> l(publish_mtx_);
+                recent_.reset(last_message_id_);
+            }
+            broadcast_local(frame);
+            retention_->wake();
+            LOG_INFO("Chat history cleared");
+        } else {
+            broadcast_local(frame);
+        }
+    } catch (const std::exception& e) {
+        LOG_ERROR("Invalid cluster bus event: " << e.what());
+    }
+}
+
+void ChatServer::on_bus_reset() {
+    // Если этот процесс станет ведущим, нумерация продолжится не ниже уже сохранённых id
+    try {
+        std::lock_guard<std::mutex> l(publish_mtx_);
+        last_message_id_ = std::max(last_message_id_, db_.last_message_id());
+        last_direct_id_ = std::max(last_direct_id_.load(), db_.last_direct_message_id());
+    } catch (const std::exception& e) {
+        LOG_ERROR("Failed to read last message ids: " << e.what());
+    }
+    // Новый ведущий доудаляет очищенную историю, если прежний не успел
+    if (retention_) retention_->wake();
+    // За время разрыва события могли не дойти: клиенты дозапросят пропущенное
+    // по последнему полученному id, как после переполнения очереди
+    broadcast_local(resync_frame());
+}
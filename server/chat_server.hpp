@@ -2,10 +2,26 @@
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
 #include <nlohmann/json.hpp>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <mutex>
 #include "db.hpp"
 #include "auth.hpp"
+#include "cluster_bus.hpp"
+#include "config.hpp"
+#include "cpu_pool.hpp"
+#include "frame.hpp"
+#include "message_writer.hpp"
+#include "recent_messages.hpp"
+#include "retention.hpp"
+#include "session_set.hpp"
+#include "typing_tracker.hpp"
 
 namespace beast  = boost::beast;
 namespace http   = beast::http;
@@ -13,24 +29,147 @@ namespace websocket = beast::websocket;
 using tcp = boost::asio::ip::tcp;
 using json = nlohmann::json;
 
+// Состояние очереди отправки сессии (для поиска медленных клиентов)
+struct SessionQueueStats {
+    std::string remote;   // Адрес клиента
+    std::string user;     // Никнейм, если пользователь уже вошёл
+    std::size_t frames;   // Кадров в очереди
+    std::size_t bytes;    // Байт в очереди
+    std::size_t dropped;  // Отброшено кадров за время жизни сессии
+};
+
+// Результат подписки на комнату
+enum class JoinResult {
+    joined,
+    already_joined,
+    too_many_rooms // Сессия уже держит ServerConfig::max_rooms комнат
+};
+
 class ChatSession;
 class ChatServer {
 public:
-    ChatServer(boost::asio::io_context& ioc, tcp::endpoint endpoint);
+    ChatServer(boost::asio::io_context& ioc, tcp::endpoint endpoint, const ServerConfig& config);
 
     void run();
+    // Новая сессия сразу подписана на комнату по умолчанию
     void join(std::shared_ptr<ChatSession> session);
     void leave(std::shared_ptr<ChatSession> session);
-    void broadcast(const std::string& msg);
-    void send_chat_history(std::shared_ptr<ChatSession> session);
+    // Подписка на комнату и отписка; false — сессия ещё не была подписана
+    JoinResult join_room(std::shared_ptr<ChatSession> session, const std::string& room);
+    bool leave_room(std::shared_ptr<ChatSession> session, const std::string& room);
+    bool is_member(const std::shared_ptr<ChatSession>& session, const std::string& room);
+    // Привязывает сессию к пользователю, подтверждённому токеном (0 — отвязать).
+    // У одного пользователя может быть несколько сессий (несколько устройств).
+    void bind_user(std::shared_ptr<ChatSession> session, int user_id);
+    // Отправляет кадр всем сессиям пользователя, возвращает их число
+    std::size_t send_to_user(int user_id, const Frame& frame);
+    // Рассылка всем подключённым (системные уведомления, присоединение пользователя).
+    // В режиме кластера рассылки идут через шину и доходят до сессий всех процессов.
+    void broadcast(std::string msg);
+    void broadcast(Frame frame);
+    // Рассылка только подписчикам комнаты
+    void broadcast_room(const std::string& room, Frame frame);
+    // Публикует сообщение чата в комнату: присваивает ему id, сохраняет кадр в кольце
+    // последних сообщений, ставит в очередь записи в БД и рассылает подписчикам комнаты
+    void publish_message(int user_id, const std::string& room, const std::string& username,
+                         const std::string& text, MessageWriter::Callback on_saved);
+    // Публикует личное сообщение: рассылает его сессиям получателя и остальным
+    // сессиям отправителя и ставит в очередь записи в БД
+    void publish_direct(const User& sender, const User& recipient, const std::string& text,
+                        MessageWriter::Callback on_saved);
+    // Пользователь набирает текст в комнате. События не рассылаются сразу: раз в
+    // typing_flush_ms подписчики каждой комнаты получают один кадр "presence"
+    void publish_typing(const User& user, const std::string& room);
+    // Отправляет страницу переписки user с peer одним кадром "direct_history"
+    void send_direct_history(std::shared_ptr<ChatSession> session, const User& user, const User& peer,
+                             long long before_id = 0, std::size_t limit = 0);
+    // Кадры сообщений с id > last_id из всех комнат сессии (переподключение, ответ на resync)
+    // из кольца последних сообщений. up_to — все сообщения комнат сессии с id <= up_to есть
+    // в этих кадрах. std::nullopt — разрыв не помещается в кольцо, нужен load_missed_messages.
+    std::optional<std::vector<Frame>> recent_missed(const std::shared_ptr<ChatSession>& session, long long last_id,
+                                                    long long& up_to);
+    // То же страницами истории из БД. Чтение идёт в пуле auth_pool(), а не на strand сессии;
+    // done вызывается из потока пула (up_to == 0 — граница не известна).
+    using MissedCallback = std::function<void(std::vector<Frame> frames, long long up_to)>;
+    void load_missed_messages(const std::shared_ptr<ChatSession>& session, long long last_id, MissedCallback done);
+    // Отправляет страницу истории комнаты одним кадром "history".
+    // before_id <= 0 — последние сообщения, limit == 0 — размер страницы по умолчанию.
+    void send_chat_history(std::shared_ptr<ChatSession> session, const std::string& room,
+                           long long before_id = 0, std::size_t limit = 0);
+    // Отправляет страницу результатов поиска одним кадром "search_results".
+    // query.limit == 0 — размер страницы истории по умолчанию.
+    void send_search_results(std::shared_ptr<ChatSession> session, SearchQuery query);
     void clear_chat_history(); // Новый метод для очистки истории чата
+    std::vector<SessionQueueStats> queue_stats();
+    // Страница /metrics в текстовом формате Prometheus
+    std::string render_metrics();
+    // Регистрация и вход: возвращают готовый ответ клиенту.
+    // Выполняются в пуле auth_pool(), так как хешируют пароль и обращаются к БД.
+    json register_new_user(const std::string& nickname, const std::string& display_name,
+                           const std::string& password);
+    json authenticate_user(const std::string& nickname, const std::string& password);
 
     Db& db() { return db_; }
+    const ServerConfig& config() const { return config_; }
+    MessageWriter& writer() { return writer_; }
+    CpuPool& auth_pool() { return auth_pool_; }
+    const RecentMessages& recent_messages() const { return recent_; }
 
 private:
+    // Комнаты, на которые подписана сессия, и пользователь, к которому она привязана
+    struct SessionEntry {
+        std::unordered_set<std::string> rooms;
+        int user_id = 0;
+    };
+    using SessionSet = SnapshotSet<ChatSession>;
+    using UserSessions = SnapshotSet<ChatSession, 1>; // У пользователя единицы сессий
+    using RoomMap = std::unordered_map<std::string, std::shared_ptr<SessionSet>>;
+
+    // Кадр "history" со страницей истории комнаты (before_id и limit — как в send_chat_history)
+    Frame history_page(const std::string& room, long long before_id, std::size_t limit);
+    std::vector<Frame> missed_pages(const std::unordered_set<std::string>& rooms, long long last_id);
+    std::optional<std::unordered_set<std::string>> session_rooms(const std::shared_ptr<ChatSession>& session);
     void do_accept();
+    // Рассылка только сессиям этого процесса
+    void broadcast_local(const Frame& frame);
+    void broadcast_room_local(const std::string& room, const Frame& frame);
+    // Кластер: ведущий дополняет запрос до события (присваивает id), каждый процесс
+    // применяет события шины к своим сессиям в общем порядке
+    void sequence(json& request);
+    void apply(const json& event);
+    void on_bus_reset();
+    void flush_typing(); // Выполняется на strand таймера typing_timer_
+    // Вызываются под registry_mtx_
+    void unbind_user(const std::shared_ptr<ChatSession>& session, SessionEntry& entry);
+    void add_to_room(const std::shared_ptr<ChatSession>& session, const std::string& room);
+    void remove_from_room(const std::shared_ptr<ChatSession>& session, const std::string& room);
+    const ServerConfig config_;
+    boost::asio::io_context& ioc_;
     tcp::acceptor acceptor_;
-    std::unordered_set<std::shared_ptr<ChatSession>> sessions_;
-    std::mutex mtx_;
+    // Все подключённые сессии. Рассылка обходит снимки, не беря registry_mtx_,
+    // поэтому подключение и отключение клиентов её не останавливают (см. session_set.hpp).
+    SessionSet sessions_;
+    // Подписчики комнат; пустые комнаты удаляются. Карта тоже копируется при записи
+    // (только при создании и удалении комнаты), так что broadcast_room не берёт registry_mtx_:
+    // снимок читается std::atomic_load (в libstdc++ — короткая внутренняя блокировка).
+    std::shared_ptr<const RoomMap> rooms_;
+    // Сессии каждого вошедшего пользователя: личное сообщение обходит только их
+    std::unordered_map<int, std::shared_ptr<UserSessions>> user_sessions_;
+    std::unordered_map<std::shared_ptr<ChatSession>, SessionEntry> members_;
+    // Сериализует изменения членства (members_, user_sessions_, замену rooms_).
+    // Рассылка его не берёт; изменения под ним копируют только один шард.
+    std::mutex registry_mtx_;
     Db db_;
+    std::mutex publish_mtx_;    // Упорядочивает присвоение id, запись в кольцо и очередь записи
+    long long last_message_id_; // Последний присвоенный id сообщения
+    std::vector<long long> fanning_out_; // id сообщений, рассылка которых ещё идёт (по возрастанию)
+    RecentMessages recent_;
+    std::atomic<long long> last_direct_id_; // Последний присвоенный id личного сообщения
+    MessageWriter writer_; // Объявлен после db_: останавливается и дописывает очередь раньше закрытия БД
+    CpuPool auth_pool_;    // Также останавливается раньше закрытия БД
+    TypingTracker typing_;
+    // Взводится первым событием набора после рассылки; в простое не просыпается
+    boost::asio::steady_timer typing_timer_;
+    std::unique_ptr<ClusterBus> bus_; // Только в режиме кластера
+    std::unique_ptr<RetentionTask> retention_; // Удаляет старую и очищенную историю; останавливается первым
 };
\ No newline at end of file
@@ -0,0 +1,947 @@
+#pragma once
+#include <boost/asio/post.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include "chat_server.hpp"
+#include "client_frame.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+
+// WebSocket-сессия одного клиента. Все обработчики сессии выполняются на её strand.
+class ChatSession : public std::enable_shared_from_this<ChatSession> {
+public:
+    ChatSession(tcp::socket socket, ChatServer& server)
+        : ws_(std::move(socket)), server_(server), connected_(false) {
+        beast::error_code ec;
+        auto endpoint = beast::get_lowest_layer(ws_).remote_endpoint(ec);
+        if (!ec) remote_ = endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+    }
+
+    // Снимок состояния очереди; безопасно вызывать из любого потока
+    SessionQueueStats queue_stats() const {
+        SessionQueueStats stats;
+        stats.remote = remote_;
+        {
+            std::lock_guard<std::mutex> l(stats_mtx_);
+            stats.user = stats_user_;
+        }
+        stats.frames = queued_frames_.load(std::memory_order_relaxed);
+        stats.bytes = queued_bytes_stat_.load(std::memory_order_relaxed);
+        stats.dropped = dropped_frames_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    void start() {
+        // Сокет создан на strand сессии, поэтому все обработчики ws_
+        // (и все обращения к очередям ниже) выполняются последовательно
+        boost::asio::dispatch(ws_.get_executor(), [self = shared_from_this()]{
+            // Сначала читаем HTTP-запрос на upgrade: из его адреса берём параметры подключения
+            http::async_read(self->ws_.next_layer(), self->buffer_, self->req_,
+                [self](beast::error_code ec, std::size_t) {
+                    if (ec) {
+                        LOG_ERROR("Error reading WebSocket upgrade request: " << ec.message());
+                        self->server_.leave(self);
+                        return;
+                    }
+                    if (!websocket::is_upgrade(self->req_)) {
+                        // Обычный HTTP-запрос (например, /metrics): один ответ и закрытие
+                        self->serve_http();
+                        return;
+                    }
+                    self->do_accept();
+                });
+        });
+    }
+
+    void serve_http() {
+        metrics().http_requests.inc();
+        auto target = req_.target();
+        auto path = target.substr(0, target.find('?'));
+        
+        auto res = std::make_shared<http::response<http::string_body>>();
+        res->version(req_.version());
+        res->keep_alive(false);
+        if (req_.method() == http::verb::get && path == "/metrics") {
+            res->result(http::status::ok);
+            res->set(http::field::content_type, "text/plain; version=0.0.4");
+            res->body() = server_.render_metrics();
+        } else {
+            res->result(http::status::not_found);
+            res->set(http::field::content_type, "text/plain");
+            res->body() = "Not found\n";
+        }
+        res->prepare_payload();
+        
+        http::async_write(ws_.next_layer(), *res,
+            [self = shared_from_this(), res](beast::error_code, std::size_t) {
+                beast::error_code ec;
+                self->ws_.next_layer().shutdown(tcp::socket::shutdown_send, ec);
+                self->server_.leave(self);
+            });
+    }
+
+    void do_accept() {
+        // ?last_id=N — клиент переподключается и уже видел сообщения до N включительно
+        long long last_id = query_param(req_.target(), "last_id");
+        
+        const auto& config = server_.config();
+        if (config.deflate) {
+            // Сжатие предлагается клиенту, только если он сам его запросил.
+            // Без переноса контекста каждое сообщение сжимается независимо,
+            // и сессия не держит окно словаря между сообщениями.
+            // Сжимает каждая сессия сама: рассылка в комнату на N клиентов
+            // сжимает один и тот же кадр N раз.
+            websocket::permessage_deflate pmd;
+            pmd.server_enable = true;
+            pmd.server_no_context_takeover = true;
+            pmd.client_no_context_takeover = true;
+            pmd.compLevel = config.deflate_level;
+            pmd.memLevel = 4;
+            ws_.set_option(pmd);
+        }
+        
+        // Бинарный подпротокол: первый из предложенных клиентом, который знает сервер.
+        // Клиенты разных форматов могут состоять в одной комнате.
+        if (auto protocol = negotiate_protocol(req_[http::field::sec_websocket_protocol])) {
+            format_ = protocol->second;
+            ws_.set_option(websocket::stream_base::decorator(
+                [name = std::string(protocol->first)](websocket::response_type& res) {
+                    res.set(http::field::sec_websocket_protocol, name);
+                }));
+            ws_.binary(format_ != WireFormat::json);
+        }
+        
+        ws_.async_accept(req_,
+                [self = shared_from_this(), last_id](beast::error_code ec) {
+                    if (ec) {
+                        LOG_ERROR("Error accepting WebSocket: " << ec.message());
+                        self->server_.leave(self);
+                        return;
+                    }
+                    // Соединение установлено
+                    metrics().connections_total.inc();
+                    self->connected_ = true;
+                    self->req_ = {};
+                    LOG_INFO("WebSocket accepted successfully" << (self->format_ == WireFormat::json ? "" :
+                             self->format_ == WireFormat::msgpack ? " (msgpack)" : " (cbor)"));
+                    
+                    // Отправляем историю чата после успешного соединения:
+                    // при переподключении — только пропущенные сообщения
+                    if (last_id > 0) {
+                        self->resume_from(last_id);
+                    } else {
+                        self->server_.send_chat_history(self, kDefaultRoom);
+                    }
+                    
+                    // Сообщения, пришедшие до установки соединения, отправляем после истории:
+                    // strand выполняет post-задачи в порядке их постановки
+                    boost::asio::post(self->ws_.get_executor(), [self]{
+                        self->flush_pending();
+                    });
+                    
+                    // Начинаем чтение сообщений
+                    self->do_read();
+                });
+    }
+
+    void send(std::string msg) {
+        send(make_frame(std::move(msg)));
+    }
+
+    void send(Frame frame) {
+        // send вызывается из любых потоков, поэтому состояние сессии
+        // меняется только внутри strand. В задачу копируется только указатель на кадр.
+        boost::asio::post(ws_.get_executor(),
+            [self = shared_from_this(), frame = std::move(frame)]() mutable {
+                // Проверяем, установлено ли соединение
+                if (!self->connected_) {
+                    LOG_DEBUG("Attempting to send message before connection established, queueing: " << frame->text());
+                    self->pending_messages_.push_back(std::move(frame));
+                    // До установки соединения храним не больше, чем допускает очередь отправки
+                    if (self->pending_messages_.size() > self->server_.config().send_queue_frames) {
+                        self->pending_messages_.pop_front();
+                        self->count_dropped(1);
+                    }
+                    return;
+                }
+                self->enqueue(std::move(frame));
+            });
+    }
+
+    // Разбирает и обрабатывает один кадр клиента. Вызывается на strand сессии;
+    // ответы уходят через send, поэтому сетевое соединение для обработки не нужно.
+    // Кадр (JSON или бинарный формат соединения) разбирается один раз,
+    // обработчик выбирается по хешу типа кадра.
+    // Кадр неизвестного типа или без обязательных полей отбрасывается: кадр клиента
+    // (в нём может быть токен) никогда не рассылается другим как есть.
+    void handle_frame(std::string_view data, WireFormat format = WireFormat::json) {
+        metrics().frames_in.inc();
+        if (format == WireFormat::json) LOG_DEBUG("Received raw data: " << data);
+        
+        ClientFrame frame;
+        std::string error;
+        if (!parse_client_frame(data, format, frame, error)) {
+            LOG_ERROR("Error parsing message: " << error);
+            return;
+        }
+        // Отброшенные кадры считаются в метрике, а в журнал попадают только на уровне debug:
+        // клиент не должен заполнять журнал такими кадрами
+        const Route* route = find_route(frame);
+        if (!route) {
+            metrics().frames_rejected.inc();
+            LOG_DEBUG("Dropping frame of unknown type '" << frame.type << "'");
+            return;
+        }
+        try {
+            if (!(this->*route->handler)(frame)) {
+                metrics().frames_rejected.inc();
+                LOG_DEBUG("Dropping " << frame.type << " frame without required fields");
+            }
+        } catch (const std::exception& e) {
+            // Например, ошибка БД
+            LOG_ERROR("Error handling " << frame.type << ": " << e.what());
+        }
+    }
+
+private:
+    // Числовой параметр из строки запроса ("/socket?last_id=42"), 0 — если параметра нет
+    static long long query_param(beast::string_view target, beast::string_view name) {
+        auto query = target.find('?');
+        while (query != beast::string_view::npos) {
+            auto begin = query + 1;
+            auto end = target.find('&', begin);
+            auto pair = target.substr(begin, end == beast::string_view::npos ? beast::string_view::npos : end - begin);
+            auto eq = pair.find('=');
+            if (eq != beast::string_view::npos && pair.substr(0, eq) == name) {
+                try {
+                    return std::stoll(std::string(pair.substr(eq + 1)));
+                } catch (...) {
+                    return 0;
+                }
+            }
+            query = end;
+        }
+        return 0;
+    }
+
+    // Подпротокол из заголовка Sec-WebSocket-Protocol ("chat.msgpack, chat.json"):
+    // первый поддерживаемый из списка клиента
+    static std::optional<std::pair<beast::string_view, WireFormat>> negotiate_protocol(beast::string_view offered) {
+        while (!offered.empty()) {
+            auto comma = offered.find(',');
+            auto name = offered.substr(0, comma);
+            offered = comma == beast::string_view::npos ? beast::string_view() : offered.substr(comma + 1);
+            while (!name.empty() && name.front() == ' ') name.remove_prefix(1);
+            while (!name.empty() && name.back() == ' ') name.remove_suffix(1);
+            if (name == "chat.msgpack") return std::make_pair(name, WireFormat::msgpack);
+            if (name == "chat.cbor") return std::make_pair(name, WireFormat::cbor);
+            if (name == "chat.json") return std::make_pair(name, WireFormat::json);
+        }
+        return std::nullopt;
+    }
+
+    // Комната из поля "room" кадра; без поля — комната по умолчанию.
+    // std::nullopt — имя комнаты некорректно.
+    static std::optional<std::string> room_param(const ClientFrame& frame) {
+        if (frame.bad_room) return std::nullopt;
+        if (!frame.room) return std::string(kDefaultRoom);
+        if (frame.room->empty() || frame.room->size() > 64) return std::nullopt;
+        return *frame.room;
+    }
+
+    static json room_error(const std::string& error) {
+        return {
+            {"type", "room_error"},
+            {"error", error}
+        };
+    }
+
+    static json search_error(const std::string& error) {
+        return {
+            {"type", "search_error"},
+            {"error", error}
+        };
+    }
+    
+    // Время из поля кадра: "YYYY-MM-DD" или "YYYY-MM-DD HH:MM:SS" (UTC, как timestamp
+    // сообщений) в секундах; без поля — 0. false — время некорректно.
+    static bool time_param(const std::optional<std::string>& value, long long& seconds) {
+        seconds = 0;
+        if (!value) return true;
+        std::tm tm{};
+        char tail = 0;
+        int fields = std::sscanf(value->c_str(), "%4d-%2d-%2d%*[ T]%2d:%2d:%2d%c", &tm.tm_year, &tm.tm_mon,
+                                 &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tail);
+        if ((fields != 3 || value->size() != 10) && fields != 6) return false;
+        int year = tm.tm_year, month = tm.tm_mon, day = tm.tm_mday;
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        std::time_t t = timegm(&tm);
+        // timegm нормализует 2024-02-30 в 1 марта: такую дату считаем некорректной
+        if (t < 0 || tm.tm_year + 1900 != year || tm.tm_mon + 1 != month || tm.tm_mday != day) return false;
+        seconds = static_cast<long long>(t);
+        return true;
+    }
+    
+    static json auth_error() {
+        return {
+            {"type", "auth_error"},
+            {"error", "Недействительный токен аутентификации"}
+        };
+    }
+
+    static json direct_error() {
+        return {
+            {"type", "direct_error"},
+            {"error", "Пользователь не найден"}
+        };
+    }
+
+    websocket::stream<tcp::socket> ws_;
+    ChatServer& server_;
+    beast::flat_buffer buffer_;
+    http::request<http::string_body> req_; // Запрос на upgrade, нужен только до установки соединения
+    // Очередь отправки; front() — кадр, который сейчас пишется в сокет
+    std::deque<Frame> queue_;
+    std::size_t queued_bytes_ = 0;
+    std::deque<Frame> pending_messages_; // Сообщения, ожидающие установки соединения
+    bool connected_;                           // Флаг установленного соединения (меняется только на strand)
+    WireFormat format_ = WireFormat::json;     // Формат кадров, выбранный подпротоколом при подключении
+    bool closing_ = false;                     // Соединение закрывается из-за переполнения очереди
+    bool resyncing_ = false;                   // Клиенту отправлен "resync", запроса "resume" ещё не было
+    bool catching_up_ = false;                 // Пропущенное читается из БД (см. resume_from)
+    bool held_overflow_ = false;               // held_ переполнилась, после ответа нужен новый resync
+    std::deque<Frame> held_;                   // Сообщения комнат, пришедшие во время чтения из БД
+    // Комнаты сессии (копия записи реестра сервера, меняется только на strand)
+    std::unordered_set<std::string> rooms_{std::string(kDefaultRoom)};
+    long long last_sent_id_ = 0;               // Последнее сообщение комнаты, поставленное в очередь
+    
+    // Статистика очереди для чтения из других потоков
+    std::string remote_;
+    mutable std::mutex stats_mtx_;
+    std::string stats_user_;
+    std::atomic<std::size_t> queued_frames_{0};
+    std::atomic<std::size_t> queued_bytes_stat_{0};
+    std::atomic<std::size_t> dropped_frames_{0};
+
+    void count_dropped(std::size_t frames) {
+        dropped_frames_.fetch_add(frames, std::memory_order_relaxed);
+        metrics().frames_dropped.inc(frames);
+    }
+
+    void update_queue_stats() {
+        queued_frames_.store(queue_.size(), std::memory_order_relaxed);
+        queued_bytes_stat_.store(queued_bytes_, std::memory_order_relaxed);
+    }
+
+    // Кадр в формате этого соединения (бинарное представление строится один раз на кадр)
+    const std::string& payload(const Frame& frame) const {
+        return frame->payload(format_);
+    }
+
+    // Ставит кадр в очередь отправки с учётом пределов (выполняется на strand).
+    // reply — кадр ответа на resume: ставится без проверок (см. resume_from).
+    void enqueue(Frame frame, bool reply = false) {
+        if (closing_ || payload(frame).empty()) return;
+        
+        long long id = frame->message_id();
+        if (!reply && id > 0) {
+            // После "resync" сообщения комнат придут в ответе на resume; кадр, уже
+            // вошедший в ответ, — повтор
+            if (resyncing_) {
+                count_dropped(1);
+                return;
+            }
+            if (catching_up_) {
+                // До ответа из БД неизвестно, какие из них в него войдут: кадры ждут ответа
+                if (held_.size() >= server_.config().send_queue_frames) {
+                    count_dropped(held_.size() + 1);
+                    held_.clear();
+                    held_overflow_ = true;
+                    return;
+                }
+                held_.push_back(std::move(frame));
+                return;
+            }
+            if (id <= last_sent_id_) return;
+            // Более ранние сообщения, рассылка которых шла параллельно, ещё не дошли:
+            // они уже есть в кольце и ставятся раньше этого кадра, а их собственные
+            // кадры потом отбрасываются по id
+            long long from = std::max(last_sent_id_, frame->ordered_after());
+            if (from + 1 < id) {
+                auto earlier = server_.recent_messages().between(from, id, rooms_);
+                if (!earlier) {
+                    // Кольцо уже вытеснило их: клиент запросит пропущенное сам
+                    count_dropped(1);
+                    enqueue(resync_frame());
+                    return;
+                }
+                for (auto& f : *earlier) {
+                    push(std::move(f), false);
+                    if (resyncing_ || closing_) return; // Очередь переполнилась
+                }
+            }
+        }
+        push(std::move(frame), reply);
+    }
+
+    // Ставит кадр в конец очереди с проверкой пределов
+    void push(Frame frame, bool reply) {
+        long long id = frame->message_id();
+        if (frame == resync_frame()) resyncing_ = true;
+        
+        // Один кадр больше предела ещё не значит, что клиент не успевает: в пустую
+        // очередь он ставится всегда, иначе resync и resume повторялись бы без конца
+        const auto& config = server_.config();
+        if (!reply && !queue_.empty() &&
+            (queue_.size() + 1 > config.send_queue_frames ||
+             queued_bytes_ + payload(frame).size() > config.send_queue_bytes)) {
+            if (!handle_overflow(frame)) return;
+        }
+        
+        last_sent_id_ = std::max(last_sent_id_, id);
+        queued_bytes_ += payload(frame).size();
+        queue_.push_back(std::move(frame));
+        update_queue_stats();
+        if (queue_.size() == 1) do_write();
+    }
+
+    // Применяет политику переполнения. true — новый кадр всё ещё нужно поставить в очередь.
+    // Кадр в начале очереди уже пишется в сокет, поэтому его не трогаем.
+    bool handle_overflow(const Frame& frame) {
+        const auto& config = server_.config();
+        std::size_t before = queue_.size();
+        
+        switch (config.overflow_policy) {
+        case OverflowPolicy::drop_oldest:
+            while (queue_.size() > 1 &&
+                   (queue_.size() + 1 > config.send_queue_frames ||
+                    queued_bytes_ + payload(frame).size() > config.send_queue_bytes)) {
+                queued_bytes_ -= payload(queue_[1]).size();
+                queue_.erase(queue_.begin() + 1);
+            }
+            count_dropped(before - queue_.size());
+            LOG_WARN("Slow consumer " << remote_ << ": dropped " << before - queue_.size() << " oldest frames");
+            return true;
+            
+        case OverflowPolicy::coalesce: {
+            // Вся невыписанная очередь заменяется одним кадром: клиент запросит
+            // пропущенные сообщения по последнему полученному id ("resume")
+            const Frame& resync = resync_frame();
+            drop_backlog();
+            count_dropped(before - queue_.size() + 1);
+            LOG_WARN("Slow consumer " << remote_ << ": coalesced " << before << " queued frames into resync");
+            resyncing_ = true;
+            queued_bytes_ += payload(resync).size();
+            queue_.push_back(resync);
+            update_queue_stats();
+            if (queue_.size() == 1) do_write();
+            return false;
+        }
+            
+        case OverflowPolicy::disconnect:
+            drop_backlog();
+            count_dropped(before - queue_.size() + 1);
+            LOG_WARN("Slow consumer " << remote_ << ": disconnecting");
+            closing_ = true;
+            update_queue_stats();
+            if (queue_.empty()) do_close();
+            return false;
+        }
+        return false;
+    }
+
+    // Досылает сообщения после last_id: при переподключении и в ответ на "resync".
+    // Недавний разрыв берётся из кольца и ставится в очередь сразу, в этом же обработчике
+    // strand. Больший читается из БД в пуле потоков, а strand тем временем копит новые
+    // сообщения комнат в held_ и ставит их следом за ответом.
+    void resume_from(long long last_id) {
+        // Уже идущее чтение из БД вернёт всё, что разослано до него, а новое — в held_
+        if (catching_up_) return;
+        resyncing_ = false;
+        auto self = shared_from_this();
+        long long up_to = 0;
+        if (auto frames = server_.recent_missed(self, last_id, up_to)) {
+            finish_resume(std::move(*frames), last_id, up_to);
+            return;
+        }
+        catching_up_ = true;
+        server_.load_missed_messages(self, last_id, [self, last_id](std::vector<Frame> frames, long long up_to) {
+            boost::asio::post(self->ws_.get_executor(), [self, last_id, frames = std::move(frames), up_to]() mutable {
+                self->finish_resume(std::move(frames), last_id, up_to);
+            });
+        });
+    }
+
+    // Ответ на resume ставится без проверки пределов: он ограничен кольцом последних
+    // сообщений или страницей на комнату, а ответ больше предела иначе снова вызвал бы
+    // resync. Кадры рассылки, вошедшие в ответ, отбрасываются по id, более новые встают
+    // следом в порядке id.
+    void finish_resume(std::vector<Frame> frames, long long last_id, long long up_to) {
+        catching_up_ = false;
+        last_sent_id_ = std::max<long long>(last_id, 0);
+        for (auto& frame : frames) enqueue(std::move(frame), true);
+        last_sent_id_ = std::max(last_sent_id_, up_to);
+        
+        auto held = std::move(held_);
+        held_.clear();
+        if (held_overflow_) {
+            // Клиент снова запросит пропущенное после последнего полученного id
+            held_overflow_ = false;
+            count_dropped(held.size());
+            enqueue(resync_frame());
+            return;
+        }
+        for (auto& frame : held) enqueue(std::move(frame));
+    }
+
+    // Отбрасывает всё, кроме кадра, который сейчас пишется
+    void drop_backlog() {
+        while (queue_.size() > 1) {
+            queued_bytes_ -= payload(queue_.back()).size();
+            queue_.pop_back();
+        }
+    }
+
+    void do_close() {
+        ws_.async_close(websocket::close_reason(websocket::close_code::policy_error, "slow consumer"),
+            [self = shared_from_this()](beast::error_code) {
+                self->server_.leave(self);
+            });
+    }
+    std::optional<User> user_;                 // Пользователь, подтверждённый токеном при join
+    std::chrono::system_clock::time_point token_expires_; // Когда токен нужно проверить заново
+
+    // Запускает регистрацию/вход в пуле CPU-потоков. Ответ отправляется через send,
+    // то есть возвращается на strand сессии. При заполненной очереди пула клиент
+    // сразу получает отказ, а поток io_context не ждёт.
+    void run_auth_job(const char* response_type, std::function<json()> job) {
+        std::string type = response_type;
+        auto queued_at = std::chrono::steady_clock::now();
+        bool queued = server_.auth_pool().try_post([self = shared_from_this(), type, job = std::move(job), queued_at] {
+            json response;
+            try {
+                response = job();
+            } catch (const std::exception& e) {
+                LOG_ERROR("Error handling " << type << ": " << e.what());
+                response = {
+                    {"type", type},
+                    {"success", false},
+                    {"error", "Внутренняя ошибка сервера"}
+                };
+            }
+            metrics().auth_seconds.observe(std::chrono::steady_clock::now() - queued_at);
+            self->send(response.dump());
+        });
+        
+        if (!queued) {
+            LOG_WARN("Auth pool is full, rejecting " << type);
+            json response = {
+                {"type", type},
+                {"success", false},
+                {"error", "Сервер перегружен, попробуйте позже"}
+            };
+            send(response.dump());
+        }
+    }
+
+    // Пользователь, от имени которого пришёл кадр. Подпись токена проверяется
+    // один раз (при join); повторно — только после истечения срока действия токена.
+    const User* authenticate(const ClientFrame& frame) {
+        if (user_ && std::chrono::system_clock::now() < token_expires_) return &*user_;
+        set_user(std::nullopt);
+        
+        if (!frame.token) return nullptr;
+        auto info = Auth::verify(*frame.token);
+        if (!info) return nullptr;
+        
+        auto user = server_.db().get_user_by_id(info->user_id);
+        if (!user) return nullptr;
+        token_expires_ = info->expires_at;
+        set_user(std::move(user));
+        return &*user_;
+    }
+
+    // Привязывает сессию к пользователю (или отвязывает) и обновляет индекс
+    // сессий пользователя на сервере, через который доставляются личные сообщения
+    void set_user(std::optional<User> user) {
+        int previous = user_ ? user_->id : 0;
+        user_ = std::move(user);
+        int current = user_ ? user_->id : 0;
+        if (previous != current) server_.bind_user(shared_from_this(), current);
+        std::lock_guard<std::mutex> l(stats_mtx_);
+        stats_user_ = user_ ? user_->nickname : std::string();
+    }
+
+    void flush_pending() {
+        if (pending_messages_.empty()) return;
+        LOG_DEBUG("Processing " << pending_messages_.size() << " pending messages");
+        auto pending = std::move(pending_messages_);
+        pending_messages_.clear();
+        for (auto& msg : pending) enqueue(std::move(msg));
+    }
+
+    // Обработчик кадра; false — в кадре нет обязательных полей
+    using FrameHandler = bool (ChatSession::*)(const ClientFrame&);
+    
+    struct Route {
+        std::uint64_t type_hash;
+        std::string_view type;
+        FrameHandler handler;
+    };
+    
+    static constexpr Route route(std::string_view type, FrameHandler handler) {
+        return {frame_type_hash(type), type, handler};
+    }
+    
+    // Таблица обработчиков: хеши типов вычисляются при компиляции, поэтому
+    // поиск — сравнение целых чисел; строка сверяется только при совпадении хеша
+    static const Route* find_route(const ClientFrame& frame) {
+        static constexpr Route routes[] = {
+            route("message", &ChatSession::on_message),
+            route("join", &ChatSession::on_join),
+            route("register", &ChatSession::on_register),
+            route("login", &ChatSession::on_login),
+            route("history_before", &ChatSession::on_history_before),
+            route("resume", &ChatSession::on_resume),
+            route("join_room", &ChatSession::on_join_room),
+            route("leave_room", &ChatSession::on_leave_room),
+            route("direct", &ChatSession::on_direct),
+            route("direct_history", &ChatSession::on_direct_history),
+            route("clear_history", &ChatSession::on_clear_history),
+            route("search", &ChatSession::on_search),
+            route("typing", &ChatSession::on_typing),
+            route("ping", &ChatSession::on_ping),
+        };
+        for (const auto& r : routes) {
+            if (r.type_hash == frame.type_hash && r.type == frame.type) return &r;
+        }
+        return nullptr;
+    }
+    
+    bool on_register(const ClientFrame& frame) {
+        // Обработка регистрации нового пользователя
+        if (!frame.nickname || !frame.display_name || !frame.password) return false;
+        LOG_DEBUG("Register request from user: " << *frame.nickname);
+        
+        // Хеширование и запросы к БД выполняются в пуле CPU-потоков
+        run_auth_job("register_response",
+            [self = shared_from_this(), nickname = *frame.nickname,
+             display_name = *frame.display_name, password = *frame.password] {
+                return self->server_.register_new_user(nickname, display_name, password);
+            });
+        return true;
+    }
+    
+    bool on_login(const ClientFrame& frame) {
+        // Обработка логина
+        if (!frame.nickname || !frame.password) return false;
+        LOG_DEBUG("Login request from user: " << *frame.nickname);
+        
+        run_auth_job("login_response",
+            [self = shared_from_this(), nickname = *frame.nickname, password = *frame.password] {
+                return self->server_.authenticate_user(nickname, password);
+            });
+        return true;
+    }
+    
+    bool on_join(const ClientFrame& frame) {
+        // Обработка сообщения "join" - пользователь присоединился
+        std::string display_name = frame.user.value_or("unknown");
+        LOG_DEBUG("Join message from user: " << display_name);
+        
+        // Проверяем JWT токен и привязываем пользователя к сессии:
+        // дальнейшие кадры этого соединения токен заново не проверяют
+        set_user(std::nullopt);
+        const User* user = authenticate(frame);
+        
+        // Проверяем по display_name, так как для фронтенда это будет отображаемое имя
+        if (!user || user->display_name != display_name) {
+            set_user(std::nullopt);
+            // Отправляем ошибку только текущему клиенту
+            send(auth_error().dump());
+            return true;
+        }
+        
+        // Рассылаем всем, чтобы все узнали о новом пользователе.
+        // Кадр собираем сами: токен из исходного сообщения другим клиентам не нужен.
+        json joined = {
+            {"type", "join"},
+            {"user", user->display_name}
+        };
+        server_.broadcast(joined.dump());
+        return true;
+    }
+    
+    bool on_history_before(const ClientFrame& frame) {
+        // Запрос более ранней страницы истории комнаты (прокрутка вверх)
+        auto room = room_param(frame);
+        auto self = shared_from_this();
+        if (frame.before_id > 0 && room && server_.is_member(self, *room)) {
+            server_.send_chat_history(self, *room, frame.before_id, frame.limit);
+        }
+        return true;
+    }
+    
+    bool on_resume(const ClientFrame& frame) {
+        // Клиент получил "resync" (очередь была переполнена) и просит
+        // сообщения после последнего полученного id
+        resume_from(frame.last_id);
+        return true;
+    }
+    
+    bool on_join_room(const ClientFrame& frame) {
+        // Подписка на комнату: подтверждение и последняя страница её истории
+        auto room = room_param(frame);
+        if (!room) {
+            send(room_error("Некорректное имя комнаты").dump());
+            return true;
+        }
+        auto self = shared_from_this();
+        switch (server_.join_room(self, *room)) {
+        case JoinResult::joined:
+            rooms_.insert(*room);
+            break;
+        case JoinResult::already_joined:
+            break;
+        case JoinResult::too_many_rooms:
+            send(room_error("Слишком много комнат: не больше " +
+                            std::to_string(server_.config().max_rooms)).dump());
+            return true;
+        }
+        json joined = {
+            {"type", "room_joined"},
+            {"room", *room}
+        };
+        send(joined.dump());
+        server_.send_chat_history(self, *room);
+        return true;
+    }
+    
+    bool on_leave_room(const ClientFrame& frame) {
+        auto room = room_param(frame);
+        if (!room) {
+            send(room_error("Некорректное имя комнаты").dump());
+            return true;
+        }
+        if (server_.leave_room(shared_from_this(), *room)) rooms_.erase(*room);
+        json left = {
+            {"type", "room_left"},
+            {"room", *room}
+        };
+        send(left.dump());
+        return true;
+    }
+    
+    bool on_direct(const ClientFrame& frame) {
+        // Личное сообщение пользователю с никнеймом "to"
+        if (!frame.to || !frame.text) return false;
+        const User* user = authenticate(frame);
+        if (!user) {
+            send(auth_error().dump());
+            return true;
+        }
+        
+        auto recipient = server_.db().get_user_by_nickname(*frame.to);
+        if (!recipient) {
+            send(direct_error().dump());
+            return true;
+        }
+        
+        server_.publish_direct(*user, *recipient, *frame.text,
+            [self = shared_from_this(), client_id = frame.client_id](bool saved, long long id) {
+                json ack = {
+                    {"type", "direct_saved"},
+                    {"success", saved}
+                };
+                if (saved) ack["id"] = id;
+                if (!client_id.is_null()) ack["client_id"] = client_id;
+                self->send(ack.dump());
+            });
+        return true;
+    }
+    
+    bool on_direct_history(const ClientFrame& frame) {
+        // Страница переписки с пользователем "with"; доступна только её участнику
+        if (!frame.with) return false;
+        const User* user = authenticate(frame);
+        auto peer = user ? server_.db().get_user_by_nickname(*frame.with) : std::nullopt;
+        if (!user || !peer) {
+            send((user ? direct_error() : auth_error()).dump());
+        } else {
+            server_.send_direct_history(shared_from_this(), *user, *peer, frame.before_id, frame.limit);
+        }
+        return true;
+    }
+    
+    bool on_search(const ClientFrame& frame) {
+        // Полнотекстовый поиск в комнате, на которую подписана сессия
+        if (!frame.query) return false;
+        auto room = room_param(frame);
+        auto self = shared_from_this();
+        if (!room || !server_.is_member(self, *room)) {
+            send(search_error("Поиск доступен только в комнатах, на которые вы подписаны").dump());
+            return true;
+        }
+        SearchQuery query;
+        query.text = *frame.query;
+        query.room = *room;
+        query.offset = frame.offset;
+        query.limit = frame.limit;
+        if (!time_param(frame.since, query.since) || !time_param(frame.until, query.until)) {
+            send(search_error("Некорректное время: ожидается YYYY-MM-DD или YYYY-MM-DD HH:MM:SS").dump());
+            return true;
+        }
+        // Страницы листают только окно CHAT_SEARCH_CANDIDATES: за ним совпадения не ранжируются
+        std::size_t window = server_.config().search_candidates;
+        if (window > 0 && query.offset >= window) {
+            send(search_error("Результаты поиска доступны только среди " + std::to_string(window) +
+                              " самых новых совпадений").dump());
+            return true;
+        }
+        if (frame.author) {
+            auto author = server_.db().get_user_by_nickname(*frame.author);
+            if (!author) {
+                send(search_error("Пользователь не найден").dump());
+                return true;
+            }
+            query.user_id = author->id;
+        }
+        server_.send_search_results(self, std::move(query));
+        return true;
+    }
+    
+    bool on_clear_history(const ClientFrame& frame) {
+        // Очистить историю может только вошедший администратор (CHAT_ADMINS)
+        const User* user = authenticate(frame);
+        if (!user || !server_.config().is_admin(user->nickname)) {
+            LOG_WARN("Clear history rejected for " << (user ? user->nickname : std::string("anonymous")));
+            send(json{{"type", "system"}, {"text", "Очистить историю может только администратор"}}.dump());
+            return true;
+        }
+        LOG_INFO("Clear history command received from " << user->nickname);
+        server_.clear_chat_history();
+        return true;
+    }
+    
+    bool on_typing(const ClientFrame& frame) {
+        // Индикатор набора не пересылается как есть (в кадре клиента есть токен):
+        // сервер собирает события в пакетные кадры "presence". Без входа — игнорируем.
+        const User* user = authenticate(frame);
+        auto room = room_param(frame);
+        if (user && room && server_.is_member(shared_from_this(), *room)) {
+            server_.publish_typing(*user, *room);
+        }
+        return true;
+    }
+    
+    bool on_ping(const ClientFrame& frame) {
+        // Проверка соединения: отвечаем только этому клиенту
+        json pong = {{"type", "pong"}};
+        if (frame.timestamp) pong["timestamp"] = *frame.timestamp;
+        send(pong.dump());
+        return true;
+    }
+    
+    bool on_message(const ClientFrame& frame) {
+        if (!frame.user || !frame.text) return false;
+        const std::string& username = *frame.user;
+        LOG_DEBUG("Message from " << username << ": " << *frame.text);
+        
+        // Пользователь уже привязан к сессии при join; токен проверяется
+        // повторно, только если срок его действия истёк
+        const User* user = authenticate(frame);
+        
+        // Проверяем по display_name, так как это отображаемое имя
+        if (!user || user->display_name != username) {
+            // Отправляем ошибку только текущему клиенту
+            send(auth_error().dump());
+            return true;
+        }
+        
+        // Писать можно только в комнату, на которую сессия подписана
+        auto room = room_param(frame);
+        auto self = shared_from_this();
+        if (!room || !server_.is_member(self, *room)) {
+            send(room_error(room ? "Вы не состоите в этой комнате"
+                                 : "Некорректное имя комнаты").dump());
+            return true;
+        }
+        
+        // Публикуем сообщение: сервер присваивает ему id и рассылает кадр,
+        // собранный на сервере (токен автора другим клиентам не уходит).
+        // Запись в БД выполняется потоком MessageWriter; рассылка не ждёт диска.
+        // Подтверждение сохранения отправляем только автору сообщения.
+        server_.publish_message(user->id, *room, username, *frame.text,
+            [self, client_id = frame.client_id](bool saved, long long id) {
+                json ack = {
+                    {"type", "message_saved"},
+                    {"success", saved}
+                };
+                if (saved) ack["id"] = id;
+                if (!client_id.is_null()) ack["client_id"] = client_id;
+                self->send(ack.dump()); // send сам переходит на strand сессии
+            });
+        return true;
+    }
+    
+    void do_read() {
+        ws_.async_read(buffer_,
+            [self = shared_from_this()](beast::error_code ec, std::size_t) {
+                if (ec) {
+                    self->server_.leave(self);
+                    return;
+                }
+                // Кадр разбирается прямо из буфера чтения, без копирования в строку.
+                // Бинарные кадры принимаются в формате, выбранном подпротоколом.
+                auto data = self->buffer_.data();
+                WireFormat format = self->ws_.got_binary() ? self->format_ : WireFormat::json;
+                if (format == WireFormat::json && self->ws_.got_binary()) {
+                    LOG_WARN("Binary frame on a JSON connection from " << self->remote_ << ", ignoring");
+                } else {
+                    self->handle_frame(std::string_view(static_cast<const char*>(data.data()), data.size()), format);
+                }
+                self->buffer_.consume(self->buffer_.size());
+                self->do_read();
+            });
+    }
+
+    void do_write() {
+        // Проверяем, что очередь не пуста и соединение установлено
+        if (queue_.empty() || !connected_) {
+            return;
+        }
+        
+        // Буфер кадра живёт, пока он находится в очереди
+        ws_.async_write(boost::asio::buffer(payload(queue_.front())),
+            [self = shared_from_this()](beast::error_code ec, std::size_t) {
+                if (ec) {
+                    LOG_ERROR("Error writing to WebSocket: " << ec.message());
+                    self->server_.leave(self);
+                    return;
+                }
+                metrics().frames_out.inc();
+                metrics().bytes_out.inc(self->payload(self->queue_.front()).size());
+                self->queued_bytes_ -= self->payload(self->queue_.front()).size();
+                self->queue_.pop_front();
+                self->update_queue_stats();
+                if (!self->queue_.empty()) {
+                    self->do_write();
+                } else if (self->closing_) {
+                    self->do_close();
+                }
+            });
+    }
+};
@@ -0,0 +1,166 @@
+#pragma once
+#include <nlohmann/json.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include "frame.hpp"
+
+// Кадр клиента с уже извлечёнными полями. Заполняется за один проход SAX-разбора
+// прямо из буфера чтения: DOM не строится, поля, которых нет в протоколе, и
+// вложенные объекты и массивы пропускаются. Поле неподходящего типа считается
+// отсутствующим (кроме "room": некорректную комнату нужно отличать от отсутствующей).
+struct ClientFrame {
+    std::string type;
+    std::uint64_t type_hash = 0; // frame_type_hash(type), вычисляется при разборе
+
+    std::optional<std::string> user;
+    std::optional<std::string> text;
+    std::optional<std::string> token;
+    std::optional<std::string> room;
+    bool bad_room = false;       // "room" есть, но это не строка
+    std::optional<std::string> to;
+    std::optional<std::string> with;
+    std::optional<std::string> nickname;
+    std::optional<std::string> display_name;
+    std::optional<std::string> password;
+    std::optional<std::string> timestamp;
+    std::optional<std::string> query;
+    std::optional<std::string> author;
+    std::optional<std::string> since;
+    std::optional<std::string> until;
+    long long before_id = 0;
+    long long last_id = 0;
+    std::size_t offset = 0;
+    std::size_t limit = 0;
+    nlohmann::json client_id;    // Число или строка; возвращается клиенту как есть
+};
+
+// FNV-1a: типы кадров таблицы обработчиков хешируются при компиляции,
+// тип входящего кадра — один раз при разборе
+constexpr std::uint64_t frame_type_hash(std::string_view type) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (char c : type) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+namespace client_frame_detail {
+
+class FrameSax {
+public:
+    using json = nlohmann::json;
+
+    explicit FrameSax(ClientFrame& frame) : frame_(frame) {}
+
+    bool null() { return skip(); }
+    bool boolean(bool) { return skip(); }
+    bool number_integer(json::number_integer_t value) { return number(value); }
+    bool number_unsigned(json::number_unsigned_t value) {
+        return number(static_cast<long long>(value));
+    }
+    bool number_float(json::number_float_t, const json::string_t&) { return skip(); }
+    bool binary(json::binary_t&) { return skip(); }
+
+    bool string(json::string_t& value) {
+        if (depth_ != 1) return true;
+        if (auto* field = string_field()) {
+            *field = std::move(value);
+            if (field == &frame_.room) frame_.bad_room = false;
+        } else if (key_ == "type") {
+            frame_.type_hash = frame_type_hash(value);
+            frame_.type = std::move(value);
+        } else if (key_ == "client_id") {
+            frame_.client_id = std::move(value);
+        }
+        return true;
+    }
+
+    bool start_object(std::size_t) { return nested(); }
+    bool start_array(std::size_t) { return nested(); }
+    bool end_object() { --depth_; return true; }
+    bool end_array() { --depth_; return true; }
+
+    bool key(json::string_t& value) {
+        if (depth_ == 1) key_ = std::move(value);
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& e) {
+        error_ = e.what();
+        return false;
+    }
+
+    const std::string& error() const { return error_; }
+
+private:
+    ClientFrame& frame_;
+    int depth_ = 0;
+    std::string key_;
+    std::string error_;
+
+    std::optional<std::string>* string_field() {
+        if (key_ == "user") return &frame_.user;
+        if (key_ == "text") return &frame_.text;
+        if (key_ == "token") return &frame_.token;
+        if (key_ == "room") return &frame_.room;
+        if (key_ == "to") return &frame_.to;
+        if (key_ == "with") return &frame_.with;
+        if (key_ == "nickname") return &frame_.nickname;
+        if (key_ == "display_name") return &frame_.display_name;
+        if (key_ == "password") return &frame_.password;
+        if (key_ == "timestamp") return &frame_.timestamp;
+        if (key_ == "query") return &frame_.query;
+        if (key_ == "author") return &frame_.author;
+        if (key_ == "since") return &frame_.since;
+        if (key_ == "until") return &frame_.until;
+        return nullptr;
+    }
+
+    bool number(long long value) {
+        if (depth_ != 1) return true;
+        if (key_ == "before_id") frame_.before_id = value;
+        else if (key_ == "last_id") frame_.last_id = value;
+        else if (key_ == "offset") frame_.offset = value > 0 ? static_cast<std::size_t>(value) : 0;
+        else if (key_ == "limit") frame_.limit = value > 0 ? static_cast<std::size_t>(value) : 0;
+        else if (key_ == "client_id") frame_.client_id = value;
+        else return skip();
+        return true;
+    }
+
+    // Значение, которое не извлекается: сбрасывает поле с тем же ключом
+    bool skip() {
+        if (depth_ == 1) reset_field();
+        return true;
+    }
+
+    bool nested() {
+        if (depth_ == 1) reset_field();
+        ++depth_;
+        return true;
+    }
+
+    void reset_field() {
+        if (auto* field = string_field()) {
+            field->reset();
+            if (field == &frame_.room) frame_.bad_room = true;
+        }
+    }
+};
+
+} // namespace client_frame_detail
+
+// Разбирает кадр клиента в формате соединения. false — некорректный кадр (error — причина).
+// Кадр, который не является объектом, разбирается как кадр без типа.
+inline bool parse_client_frame(std::string_view data, WireFormat format, ClientFrame& frame, std::string& error) {
+    client_frame_detail::FrameSax sax(frame);
+    auto input = format == WireFormat::msgpack ? nlohmann::json::input_format_t::msgpack
+               : format == WireFormat::cbor    ? nlohmann::json::input_format_t::cbor
+                                               : nlohmann::json::input_format_t::json;
+    if (nlohmann::json::sax_parse(data.begin(), data.end(), &sax, input)) return true;
+    error = sax.error();
+    return false;
+}
@@ -0,0 +1,236 @@
+#include "cluster_bus.hpp"
+#include "logger.hpp"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+
+namespace {
+
+constexpr std::size_t kMaxEvent = 16 * 1024 * 1024; // Предел одного кадра шины
+constexpr std::size_t kMaxQueue = 65536;            // Событий в очереди одного соединения
+constexpr auto kRetryDelay = std::chrono::milliseconds(100);
+
+// Абстрактное имя доступно любому процессу хоста, поэтому соединение принимается,
+// только если процесс на другом конце работает от того же пользователя (SO_PEERCRED)
+bool same_user(boost::asio::local::stream_protocol::socket& socket) {
+    ucred cred{};
+    socklen_t length = sizeof(cred);
+    if (::getsockopt(socket.native_handle(), SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0) return false;
+    return cred.uid == ::geteuid();
+}
+
+} // namespace
+
+ClusterBus::ClusterBus(boost::asio::io_context& ioc, std::string name, Sequencer sequencer,
+                       Handler handler, ResetHandler on_reset)
+    : strand_(boost::asio::make_strand(ioc)), name_(std::move(name)), node_(::getpid()),
+      sequencer_(std::move(sequencer)), handler_(std::move(handler)), on_reset_(std::move(on_reset)),
+      acceptor_(strand_), retry_timer_(strand_) {}
+
+void ClusterBus::start() {
+    boost::asio::post(strand_, [this] { elect(); });
+}
+
+void ClusterBus::publish(json request, Completion done) {
+    boost::asio::post(strand_, [this, request = std::move(request), done = std::move(done)]() mutable {
+        long long req = ++next_request_;
+        request["node"] = node_;
+        request["req"] = req;
+        if (done) pending_.emplace(req, std::move(done));
+        if (hub_) {
+            submit(std::move(request));
+        } else if (upstream_) {
+            send(upstream_, encode(request));
+        } else if (backlog_.size() < kMaxQueue) {
+            backlog_.push_back(std::move(request));
+        } else {
+            LOG_WARN("Cluster bus " << name_ << ": no hub, request dropped");
+            auto it = pending_.find(req);
+            if (it == pending_.end()) return;
+            auto callback = std::move(it->second);
+            pending_.erase(it);
+            callback(nullptr);
+        }
+    });
+}
+
+ClusterBus::Wire ClusterBus::encode(const json& value) {
+    std::string body = value.dump();
+    auto length = static_cast<std::uint32_t>(body.size());
+    std::string wire;
+    wire.reserve(4 + body.size());
+    for (int i = 0; i < 4; ++i) wire.push_back(static_cast<char>((length >> (8 * i)) & 0xff));
+    wire += body;
+    return std::make_shared<const std::string>(std::move(wire));
+}
+
+ClusterBus::local::endpoint ClusterBus::endpoint() const {
+    // Ведущий нулевой байт — абстрактное имя: файла нет, имя живёт, пока жив сокет
+    return local::endpoint(std::string(1, '\0') + name_);
+}
+
+void ClusterBus::elect() {
+    boost::system::error_code ec;
+    local::acceptor acceptor(strand_);
+    acceptor.open(local(), ec);
+    if (!ec) acceptor.bind(endpoint(), ec);
+    if (!ec) acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+    if (ec) {
+        // Имя занято: ведущий уже есть
+        connect();
+        return;
+    }
+
+    acceptor_ = std::move(acceptor);
+    hub_ = true;
+    LOG_INFO("Cluster bus " << name_ << ": this process is the hub");
+    // Запросы, накопленные без ведущего, теперь упорядочивает этот процесс
+    auto backlog = std::move(backlog_);
+    backlog_.clear();
+    for (auto& request : backlog) submit(std::move(request));
+    do_accept();
+}
+
+void ClusterBus::connect() {
+    auto link = std::make_shared<Link>(local::socket(strand_));
+    link->socket.async_connect(endpoint(), [this, link](boost::system::error_code ec) {
+        if (ec) {
+            // Ведущий только что завершился или ещё не начал слушать
+            retry();
+            return;
+        }
+        if (!same_user(link->socket)) {
+            // Попытки повторяются, пока имя не освободится; в журнал — только первая
+            if (!foreign_hub_) LOG_ERROR("Cluster bus " << name_ << ": hub runs as another user, not connecting");
+            foreign_hub_ = true;
+            boost::system::error_code ignored;
+            link->socket.close(ignored);
+            retry();
+            return;
+        }
+        upstream_ = link;
+        foreign_hub_ = false;
+        LOG_INFO("Cluster bus " << name_ << ": connected to the hub");
+        for (auto& request : backlog_) send(link, encode(request));
+        backlog_.clear();
+        read(link);
+    });
+}
+
+void ClusterBus::retry() {
+    retry_timer_.expires_after(kRetryDelay);
+    retry_timer_.async_wait([this](boost::system::error_code ec) {
+        if (!ec) elect();
+    });
+}
+
+void ClusterBus::do_accept() {
+    acceptor_.async_accept(strand_, [this](boost::system::error_code ec, local::socket socket) {
+        if (!ec && !same_user(socket)) {
+            LOG_WARN("Cluster bus " << name_ << ": rejected node running as another user");
+        } else if (!ec) {
+            auto link = std::make_shared<Link>(std::move(socket));
+            peers_.push_back(link);
+            LOG_INFO("Cluster bus " << name_ << ": node connected (" << peers_.size() << " total)");
+            read(link);
+        }
+        do_accept();
+    });
+}
+
+void ClusterBus::read(std::shared_ptr<Link> link) {
+    boost::asio::async_read(link->socket, boost::asio::buffer(link->header),
+        [this, link](boost::system::error_code ec, std::size_t) {
+            if (ec) return closed(link);
+            std::uint32_t length = 0;
+            for (int i = 0; i < 4; ++i) length |= static_cast<std::uint32_t>(link->header[i]) << (8 * i);
+            if (length > kMaxEvent) {
+                LOG_WARN("Cluster bus " << name_ << ": oversized frame (" << length << " bytes)");
+                return closed(link);
+            }
+            link->body.resize(length);
+            boost::asio::async_read(link->socket, boost::asio::buffer(link->body),
+                [this, link](boost::system::error_code ec, std::size_t) {
+                    if (ec) return closed(link);
+                    auto value = json::parse(link->body, nullptr, false);
+                    if (!value.is_object()) {
+                        LOG_WARN("Cluster bus " << name_ << ": malformed frame");
+                        return closed(link);
+                    }
+                    // От ведущего приходят события, к ведущему — запросы
+                    if (link == upstream_) deliver(value);
+                    else submit(std::move(value));
+                    read(link);
+                });
+        });
+}
+
+void ClusterBus::send(const std::shared_ptr<Link>& link, Wire wire) {
+    if (link->closed) return;
+    if (link->queue.size() >= kMaxQueue) {
+        // Процесс не успевает читать шину. Соединение закрывается, а сам процесс
+        // переподключится и попросит свои сессии дозапросить пропущенное.
+        // Из списков соединение удалит обработчик чтения.
+        LOG_WARN("Cluster bus " << name_ << ": node queue overflow, dropping connection");
+        boost::system::error_code ec;
+        link->socket.close(ec);
+        return;
+    }
+    link->queue.push_back(std::move(wire));
+    if (link->queue.size() == 1) write(link);
+}
+
+void ClusterBus::write(std::shared_ptr<Link> link) {
+    boost::asio::async_write(link->socket, boost::asio::buffer(*link->queue.front()),
+        [this, link](boost::system::error_code ec, std::size_t) {
+            if (ec) return closed(link);
+            link->queue.pop_front();
+            if (!link->queue.empty()) write(link);
+        });
+}
+
+void ClusterBus::closed(const std::shared_ptr<Link>& link) {
+    if (link->closed) return;
+    link->closed = true;
+    link->queue.clear();
+    boost::system::error_code ec;
+    link->socket.close(ec);
+
+    if (link != upstream_) {
+        peers_.remove(link);
+        LOG_INFO("Cluster bus " << name_ << ": node disconnected (" << peers_.size() << " left)");
+        return;
+    }
+    upstream_.reset();
+    LOG_WARN("Cluster bus " << name_ << ": lost connection to the hub");
+    fail_pending();
+    if (on_reset_) on_reset_();
+    elect();
+}
+
+void ClusterBus::submit(json request) {
+    sequencer_(request);
+    auto wire = encode(request);
+    for (auto& peer : peers_) send(peer, wire);
+    deliver(request);
+}
+
+void ClusterBus::deliver(const json& event) {
+    handler_(event);
+    if (event.value("node", 0LL) != node_) return;
+    auto it = pending_.find(event.value("req", 0LL));
+    if (it == pending_.end()) return;
+    auto done = std::move(it->second);
+    pending_.erase(it);
+    done(&event);
+}
+
+void ClusterBus::fail_pending() {
+    // Запросы, отправленные прежнему ведущему, могли и не дойти: их итог неизвестен,
+    // поэтому сообщается как неудача
+    auto pending = std::move(pending_);
+    pending_.clear();
+    for (auto& [req, done] : pending) done(nullptr);
+}
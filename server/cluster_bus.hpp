@@ -0,0 +1,92 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <nlohmann/json.hpp>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+// Локальная шина кластера: несколько процессов сервера на одном хосте делят порт
+// (SO_REUSEPORT) и обмениваются событиями рассылки через Unix-сокет в абстрактном
+// пространстве имён Linux. Ведущим становится процесс, первым занявший имя шины:
+// он упорядочивает запросы всех процессов и раздаёт события в одном общем порядке,
+// поэтому порядок сообщений каждой комнаты одинаков во всех процессах. Остальные
+// процессы подключаются к ведущему. Имя освобождается ядром вместе с процессом,
+// так что после падения ведущего его место занимает один из оставшихся.
+// Соединения с процессами других пользователей отклоняются (SO_PEERCRED).
+//
+// Кадр шины — длина (4 байта, little-endian) и JSON-объект.
+class ClusterBus {
+public:
+    using json = nlohmann::json;
+    // Дополняет запрос до события (например, присваивает id сообщения).
+    // Вызывается только у ведущего, строго по одному запросу за раз.
+    using Sequencer = std::function<void(json& request)>;
+    // Событие в общем порядке кластера; вызывается на strand шины
+    using Handler = std::function<void(const json& event)>;
+    // Итог запроса этого процесса: разосланное событие или nullptr, если связь
+    // с ведущим прервалась раньше, чем событие вернулось
+    using Completion = std::function<void(const json* event)>;
+    // Связь с ведущим прервалась: события за время разрыва могли быть пропущены
+    using ResetHandler = std::function<void()>;
+
+    ClusterBus(boost::asio::io_context& ioc, std::string name, Sequencer sequencer,
+               Handler handler, ResetHandler on_reset);
+
+    void start();
+    // Отправляет запрос ведущему; безопасно вызывать из любых потоков
+    void publish(json request, Completion done = nullptr);
+
+    bool is_hub() const { return hub_.load(); }
+
+private:
+    using local = boost::asio::local::stream_protocol;
+    using Wire = std::shared_ptr<const std::string>;
+
+    // Соединение с ведущим (у остальных процессов) или с одним из процессов (у ведущего)
+    struct Link {
+        explicit Link(local::socket s) : socket(std::move(s)) {}
+        local::socket socket;
+        std::deque<Wire> queue;
+        std::array<unsigned char, 4> header{};
+        std::string body;
+        bool closed = false;
+    };
+
+    static Wire encode(const json& value);
+    local::endpoint endpoint() const;
+
+    // Всё ниже выполняется на strand_
+    void elect();
+    void connect();
+    void retry();
+    void do_accept();
+    void read(std::shared_ptr<Link> link);
+    void send(const std::shared_ptr<Link>& link, Wire wire);
+    void write(std::shared_ptr<Link> link);
+    void closed(const std::shared_ptr<Link>& link);
+    void submit(json request);           // У ведущего: упорядочить и разослать
+    void deliver(const json& event);     // Применить событие у себя
+    void fail_pending();
+
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    const std::string name_;
+    const long long node_; // pid процесса
+    Sequencer sequencer_;
+    Handler handler_;
+    ResetHandler on_reset_;
+
+    std::atomic<bool> hub_{false};
+    local::acceptor acceptor_;
+    std::shared_ptr<Link> upstream_;         // Связь с ведущим
+    std::list<std::shared_ptr<Link>> peers_; // У ведущего: подключённые процессы
+    std::deque<json> backlog_;               // Запросы, ожидающие подключения к ведущему
+    std::unordered_map<long long, Completion> pending_;
+    long long next_request_ = 0;
+    boost::asio::steady_timer retry_timer_;
+    bool foreign_hub_ = false; // Имя шины занял процесс другого пользователя (сообщено в журнал)
+};
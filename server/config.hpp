@@ -0,0 +1,180 @@
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "logger.hpp"
+
+// Что делать, когда очередь отправки сессии переполнена (медленный клиент)
+enum class OverflowPolicy {
+    drop_oldest, // Отбросить самые старые кадры из очереди
+    coalesce,    // Заменить очередь одним кадром "resync": клиент сам дозапросит пропущенное
+    disconnect   // Закрыть соединение с указанием причины
+};
+
+// Где хранятся сообщения (пользователи всегда в SQLite)
+enum class MessageStoreKind {
+    sqlite,  // Таблицы messages и direct_messages файла БД
+    segments // Сегментированный журнал в файлах, отображённых в память (см. segment_log.hpp)
+};
+
+// Настройки сервера. Значения по умолчанию можно переопределить
+// переменными окружения (CHAT_*), чтобы не пересобирать сервер.
+struct ServerConfig {
+    // Количество потоков, обслуживающих io_context
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    // Режим кластера: несколько процессов на одном хосте слушают один порт (SO_REUSEPORT)
+    // и обмениваются рассылками через локальную шину. Имя шины по умолчанию — по порту.
+    bool cluster = false;
+    std::string cluster_bus;
+    // Файл базы данных SQLite (":memory:" — база в памяти, без соединений для чтения)
+    std::string db_path = "chat.db";
+    // Перевести БД, созданную до инкрементальной очистки, в auto_vacuum = INCREMENTAL
+    // (однократный полный VACUUM при запуске; запись на это время блокируется)
+    bool db_convert_vacuum = false;
+    // Хранилище сообщений; для segments — каталог сегментов и размер одного сегмента.
+    // Каталог сегментов принадлежит одному процессу, поэтому в режиме кластера — только sqlite.
+    MessageStoreKind message_store = MessageStoreKind::sqlite;
+    std::string segments_dir = "chat_segments";
+    std::size_t segment_bytes = 64 * 1024 * 1024;
+    // Пакетная запись сообщений: максимальный размер пакета и окно накопления
+    std::size_t db_batch_size = 64;
+    std::size_t db_flush_ms = 10;
+    // Соединения SQLite только для чтения (история, поиск пользователей)
+    std::size_t db_readers = 4;
+    // Ёмкость LRU-кеша пользователей перед таблицей users
+    std::size_t user_cache = 4096;
+    // Пул для регистрации/входа: число потоков и предел очереди (сверх него — отказ)
+    std::size_t auth_threads = 2;
+    std::size_t auth_queue = 256;
+    // Предел очереди отправки одной сессии (в кадрах и байтах) и политика при переполнении
+    std::size_t send_queue_frames = 1024;
+    std::size_t send_queue_bytes = 4 * 1024 * 1024;
+    OverflowPolicy overflow_policy = OverflowPolicy::coalesce;
+    // Сжатие permessage-deflate (включается явно) и уровень сжатия 1..9;
+    // каждая сессия сжимает свои кадры сама
+    bool deflate = false;
+    int deflate_level = 3;
+    // История: размер страницы при подключении и максимальный размер запрошенной страницы
+    std::size_t history_page_size = 50;
+    std::size_t history_max_page = 500;
+    // Поиск ранжирует только столько самых новых совпадений (0 — все совпадения)
+    std::size_t search_candidates = 1000;
+    // Срок хранения истории: возраст в днях, число последних сообщений, размер хранилища
+    // в байтах (0 — без ограничения). Удаление идёт в фоне пакетами по retention_batch
+    // сообщений, проход — раз в retention_interval_ms.
+    std::size_t retention_days = 0;
+    std::size_t retention_messages = 0;
+    std::size_t retention_bytes = 0;
+    std::size_t retention_batch = 200;
+    std::size_t retention_interval_ms = 1000;
+    // Никнеймы администраторов (CHAT_ADMINS, через запятую): только они очищают историю.
+    // По умолчанию список пуст и очистка отклоняется.
+    std::vector<std::string> admins;
+    // Сколько последних сообщений держать в памяти для досылки при переподключении
+    std::size_t recent_messages = 1024;
+    // Сколько комнат может держать одна сессия, включая комнату по умолчанию: каждая новая
+    // комната копирует карту комнат, а досылка при переподключении читает каждую комнату
+    std::size_t max_rooms = 32;
+    // Индикаторы набора: период пакетной рассылки "presence" и минимальный интервал
+    // между принимаемыми событиями одного пользователя в одной комнате
+    std::size_t typing_flush_ms = 250;
+    std::size_t typing_interval_ms = 1000;
+    // Уровень журнала (debug — каждый кадр и сообщение) и ёмкость очереди асинхронного журнала
+    LogLevel log_level = LogLevel::info;
+    std::size_t log_queue = 8192;
+
+    static ServerConfig from_env() {
+        ServerConfig config;
+        config.threads = std::max<std::size_t>(1, env_size("CHAT_THREADS", config.threads));
+        config.cluster = env_size("CHAT_CLUSTER", config.cluster ? 1 : 0) != 0;
+        config.cluster_bus = env_string("CHAT_CLUSTER_BUS", config.cluster_bus);
+        config.db_path = env_string("CHAT_DB_PATH", config.db_path);
+        config.db_convert_vacuum = env_size("CHAT_DB_CONVERT_VACUUM", config.db_convert_vacuum ? 1 : 0) != 0;
+        std::string store = env_string("CHAT_MESSAGE_STORE", "");
+        if (store == "sqlite") config.message_store = MessageStoreKind::sqlite;
+        else if (store == "segments") config.message_store = MessageStoreKind::segments;
+        config.segments_dir = env_string("CHAT_SEGMENTS_DIR", config.segments_dir);
+        config.segment_bytes = env_size("CHAT_SEGMENT_BYTES", config.segment_bytes);
+        config.db_batch_size = std::max<std::size_t>(1, env_size("CHAT_DB_BATCH_SIZE", config.db_batch_size));
+        config.db_flush_ms = env_size("CHAT_DB_FLUSH_MS", config.db_flush_ms);
+        config.db_readers = env_size("CHAT_DB_READERS", config.db_readers);
+        config.user_cache = env_size("CHAT_USER_CACHE", config.user_cache);
+        config.auth_threads = std::max<std::size_t>(1, env_size("CHAT_AUTH_THREADS", config.auth_threads));
+        config.auth_queue = std::max<std::size_t>(1, env_size("CHAT_AUTH_QUEUE", config.auth_queue));
+        config.history_page_size = std::max<std::size_t>(1, env_size("CHAT_HISTORY_PAGE", config.history_page_size));
+        config.history_max_page = std::max(config.history_page_size, env_size("CHAT_HISTORY_MAX_PAGE", config.history_max_page));
+        config.search_candidates = env_size("CHAT_SEARCH_CANDIDATES", config.search_candidates);
+        config.retention_days = env_size("CHAT_RETENTION_DAYS", config.retention_days);
+        config.retention_messages = env_size("CHAT_RETENTION_MESSAGES", config.retention_messages);
+        config.retention_bytes = env_size("CHAT_RETENTION_BYTES", config.retention_bytes);
+        config.retention_batch = std::max<std::size_t>(1, env_size("CHAT_RETENTION_BATCH", config.retention_batch));
+        config.retention_interval_ms = std::max<std::size_t>(1, env_size("CHAT_RETENTION_INTERVAL_MS", config.retention_interval_ms));
+        config.admins = env_list("CHAT_ADMINS");
+        config.recent_messages = std::max<std::size_t>(1, env_size("CHAT_RECENT_MESSAGES", config.recent_messages));
+        config.max_rooms = std::max<std::size_t>(1, env_size("CHAT_MAX_ROOMS", config.max_rooms));
+        config.send_queue_frames = std::max<std::size_t>(1, env_size("CHAT_SEND_QUEUE_FRAMES", config.send_queue_frames));
+        config.send_queue_bytes = std::max<std::size_t>(1, env_size("CHAT_SEND_QUEUE_BYTES", config.send_queue_bytes));
+
+        config.deflate = env_size("CHAT_DEFLATE", config.deflate ? 1 : 0) != 0;
+        config.deflate_level = static_cast<int>(std::min<std::size_t>(9, std::max<std::size_t>(1,
+            env_size("CHAT_DEFLATE_LEVEL", static_cast<std::size_t>(config.deflate_level)))));
+
+        config.typing_flush_ms = std::max<std::size_t>(1, env_size("CHAT_TYPING_FLUSH_MS", config.typing_flush_ms));
+        config.typing_interval_ms = env_size("CHAT_TYPING_INTERVAL_MS", config.typing_interval_ms);
+
+        config.log_queue = std::max<std::size_t>(1, env_size("CHAT_LOG_QUEUE", config.log_queue));
+        if (auto level = Log::parse_level(env_string("CHAT_LOG_LEVEL", ""))) config.log_level = *level;
+
+        std::string policy = env_string("CHAT_SLOW_CONSUMER", "");
+        if (policy == "drop_oldest") config.overflow_policy = OverflowPolicy::drop_oldest;
+        else if (policy == "coalesce") config.overflow_policy = OverflowPolicy::coalesce;
+        else if (policy == "disconnect") config.overflow_policy = OverflowPolicy::disconnect;
+        return config;
+    }
+
+    // Несовместимые сочетания настроек: std::invalid_argument с описанием
+    void validate() const {
+        if (cluster && message_store == MessageStoreKind::segments) {
+            throw std::invalid_argument("CHAT_MESSAGE_STORE=segments cannot be used with CHAT_CLUSTER=1: "
+                                        "the segment directory is locked by a single process, use sqlite");
+        }
+    }
+
+    bool is_admin(const std::string& nickname) const {
+        return std::find(admins.begin(), admins.end(), nickname) != admins.end();
+    }
+
+private:
+    static std::string env_string(const char* name, const std::string& fallback) {
+        const char* value = std::getenv(name);
+        return value && *value ? value : fallback;
+    }
+
+    // Непустые элементы списка через запятую, без пробелов по краям
+    static std::vector<std::string> env_list(const char* name) {
+        std::vector<std::string> items;
+        std::istringstream in(env_string(name, ""));
+        std::string item;
+        while (std::getline(in, item, ',')) {
+            std::size_t first = item.find_first_not_of(" \t");
+            if (first == std::string::npos) continue;
+            std::size_t last = item.find_last_not_of(" \t");
+            items.push_back(item.substr(first, last - first + 1));
+        }
+        return items;
+    }
+
+    static std::size_t env_size(const char* name, std::size_t fallback) {
+        const char* value = std::getenv(name);
+        if (!value || !*value) return fallback;
+        try {
+            return static_cast<std::size_t>(std::stoull(value));
+        } catch (...) {
+            return fallback;
+        }
+    }
+};
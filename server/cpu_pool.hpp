@@ -0,0 +1,38 @@
+#pragma once
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+
+// Пул потоков для тяжёлой CPU-работы (хеширование паролей, регистрация, вход),
+// чтобы она не занимала потоки io_context. Очередь ограничена: при перегрузке
+// задача сразу отклоняется, а не ждёт.
+class CpuPool {
+public:
+    CpuPool(std::size_t threads, std::size_t max_queue)
+        : pool_(std::max<std::size_t>(1, threads)), max_queue_(max_queue) {}
+
+    ~CpuPool() { pool_.join(); }
+
+    // false — очередь заполнена, задача не принята
+    bool try_post(std::function<void()> job) {
+        if (pending_.fetch_add(1, std::memory_order_relaxed) >= max_queue_) {
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        boost::asio::post(pool_, [this, job = std::move(job)] {
+            job();
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+        });
+        return true;
+    }
+
+    // Задачи в очереди и в работе
+    std::size_t depth() const { return pending_.load(std::memory_order_relaxed); }
+
+private:
+    boost::asio::thread_pool pool_;
+    const std::size_t max_queue_;
+    std::atomic<std::size_t> pending_{0};
+};
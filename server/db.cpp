@@ -1,237 +1,832 @@
 #include "db.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "search_index.hpp"
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <iterator>
+#include <limits>
 #include <stdexcept>
-#include <iostream>
 
-Db::Db(const std::string& file) {
-    if (sqlite3_open(file.c_str(), &db_) != SQLITE_OK)
-        throw std::runtime_error("Cannot open database");
-    init();
-}
+// Подготовленный запрос из кеша соединения. При выходе из области видимости
+// запрос сбрасывается и освобождает параметры, но не финализируется.
+class Db::Statement {
+public:
+    Statement(Connection& conn, const char* sql) : stmt_(conn.prepare(sql)) {}
+    ~Statement() {
+        if (stmt_) {
+            sqlite3_reset(stmt_);
+            sqlite3_clear_bindings(stmt_);
+        }
+    }
+    Statement(const Statement&) = delete;
+    Statement& operator=(const Statement&) = delete;
 
-Db::~Db() {
-    sqlite3_close(db_);
-}
+    sqlite3_stmt* get() const { return stmt_; }
+    explicit operator bool() const { return stmt_ != nullptr; }
 
-void Db::init() {
-    const char* messages_sql =
-        "CREATE TABLE IF NOT EXISTS messages ("
-        "id INTEGER PRIMARY KEY,"
-        "user_id INTEGER,"
-        "text TEXT,"
-        "ts DATETIME DEFAULT CURRENT_TIMESTAMP);";
-    
-    const char* users_sql =
-        "CREATE TABLE IF NOT EXISTS users ("
-        "id INTEGER PRIMARY KEY,"
-        "nickname TEXT UNIQUE NOT NULL," // Уникальный никнейм пользователя
-        "display_name TEXT NOT NULL,"    // Отображаемое имя пользователя
-        "password_hash TEXT NOT NULL);";
-    
-    // Миграция старой схемы при необходимости (если таблица существует в старом формате)
-    const char* check_column_sql = 
-        "SELECT COUNT(*) FROM pragma_table_info('users') WHERE name='display_name';";
-    
+private:
+    sqlite3_stmt* stmt_;
+};
+
+// Соединение для чтения, взятое из пула на время одного запроса.
+// Если пула нет (БД в памяти), используется соединение для записи под его мьютексом.
+class Db::ReadLease {
+public:
+    explicit ReadLease(Db& db) : db_(db) {
+        if (db_.readers_.empty()) {
+            writer_lock_ = std::unique_lock<std::mutex>(db_.mtx_);
+            conn_ = &db_.writer_;
+            return;
+        }
+        std::unique_lock<std::mutex> l(db_.readers_mtx_);
+        db_.readers_cv_.wait(l, [this] { return !db_.idle_readers_.empty(); });
+        conn_ = db_.idle_readers_.back();
+        db_.idle_readers_.pop_back();
+    }
+    ~ReadLease() {
+        if (writer_lock_.owns_lock()) return;
+        {
+            std::lock_guard<std::mutex> l(db_.readers_mtx_);
+            db_.idle_readers_.push_back(conn_);
+        }
+        db_.readers_cv_.notify_one();
+    }
+    ReadLease(const ReadLease&) = delete;
+    ReadLease& operator=(const ReadLease&) = delete;
+
+    Connection& connection() { return *conn_; }
+
+private:
+    Db& db_;
+    Connection* conn_ = nullptr;
+    std::unique_lock<std::mutex> writer_lock_;
+};
+
+// Сообщения в таблицах messages и direct_messages той же БД
+class Db::SqliteMessages final : public MessageStore {
+public:
+    explicit SqliteMessages(Db& db);
+
+    std::vector<long long> save_messages(const std::vector<NewMessage>& messages) override;
+    std::vector<StoredMessage> load_messages(const std::string& room, long long before_id, std::size_t limit) override;
+    std::vector<StoredMessage> load_messages_after(const std::string& room, long long after_id, std::size_t limit) override;
+    long long last_message_id() override;
+    std::vector<StoredDirectMessage> load_direct_messages(int user_id, int peer_id, long long before_id,
+                                                          std::size_t limit) override;
+    long long last_direct_message_id() override;
+    void clear_messages(long long up_to_id) override;
+    std::vector<StoredMessage> search_messages(const SearchQuery& query) override;
+    std::size_t expire_messages(const RetentionPolicy& policy, std::size_t batch) override;
+
+private:
+    // Страниц, возвращаемых файлу за один шаг хранения
+    static constexpr int kVacuumPages = 256;
+
+    Db& db_;
+    // Граница очистки истории (cleared_history.up_to): сообщения комнат с id <= неё
+    // уже не читаются, а удаляются фоновыми шагами expire_messages
+    std::atomic<long long> cleared_up_to_{0};
+
+    // Последний id среди batch самых старых строк, нарушающих политику (0 — таких нет)
+    long long expired_up_to(const char* sql, bool over_bytes, const RetentionPolicy& policy,
+                            long long age_cutoff, long long cleared_up_to, std::size_t batch);
+    // Удаляет строки с id <= up_to, возвращает их число
+    std::size_t delete_up_to(const char* sql, long long up_to);
+};
+
+namespace {
+
+void exec(sqlite3* db, const char* sql) {
     char* err = nullptr;
-    if (sqlite3_exec(db_, messages_sql, nullptr, nullptr, &err) != SQLITE_OK) {
-        std::string e = err;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &err) != SQLITE_OK) {
+        std::string e = err ? err : "unknown error";
         sqlite3_free(err);
-        throw std::runtime_error("DB messages table init failed: " + e);
+        throw std::runtime_error(std::string("DB statement failed: ") + e);
     }
+}
 
-    if (sqlite3_exec(db_, users_sql, nullptr, nullptr, &err) != SQLITE_OK) {
-        std::string e = err;
-        sqlite3_free(err);
-        throw std::runtime_error("DB users table init failed: " + e);
+bool is_memory_database(const std::string& file) {
+    return file.empty() || file == ":memory:" || file.rfind("file::memory:", 0) == 0;
+}
+
+User read_user(sqlite3_stmt* stmt) {
+    User user;
+    user.id = sqlite3_column_int(stmt, 0);
+    user.nickname = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+    user.display_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+    user.password_hash = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+    return user;
+}
+
+std::vector<StoredMessage> read_messages(sqlite3_stmt* stmt) {
+    std::vector<StoredMessage> messages;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        StoredMessage m;
+        m.id = sqlite3_column_int64(stmt, 0);
+        m.user_id = sqlite3_column_int(stmt, 1);
+        const char* user = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+        const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        m.ts = sqlite3_column_int64(stmt, 4);
+        const char* room = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5));
+        m.user = user ? user : "";
+        m.room = room ? room : kDefaultRoom;
+        m.text = text ? text : "";
+        messages.push_back(std::move(m));
     }
-    
-    // Проверяем, нужна ли миграция данных
-    sqlite3_stmt* stmt;
-    bool needs_migration = false;
-    
-    if (sqlite3_prepare_v2(db_, check_column_sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            int has_display_name = sqlite3_column_int(stmt, 0);
-            needs_migration = (has_display_name == 0);
+    return messages;
+}
+
+std::vector<StoredDirectMessage> read_direct_messages(sqlite3_stmt* stmt) {
+    std::vector<StoredDirectMessage> messages;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        StoredDirectMessage m;
+        m.id = sqlite3_column_int64(stmt, 0);
+        m.sender_id = sqlite3_column_int(stmt, 1);
+        m.recipient_id = sqlite3_column_int(stmt, 2);
+        const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        m.text = text ? text : "";
+        m.ts = sqlite3_column_int64(stmt, 4);
+        messages.push_back(std::move(m));
+    }
+    return messages;
+}
+
+int query_int(sqlite3* db, const char* sql) {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        throw std::runtime_error(std::string("DB query failed: ") + sqlite3_errmsg(db));
+    }
+    int value = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+int schema_version(sqlite3* db) { return query_int(db, "PRAGMA user_version;"); }
+
+// Версия 1: схема, которая складывалась до появления версий. Шаги проверяют, что уже
+// есть, поэтому миграция приводит к версии 1 базу любого более раннего вида.
+void migrate_initial_schema(sqlite3* db) {
+    exec(db,
+         "CREATE TABLE IF NOT EXISTS messages ("
+         "id INTEGER PRIMARY KEY,"
+         "user_id INTEGER,"
+         "text TEXT,"
+         "ts DATETIME DEFAULT CURRENT_TIMESTAMP,"
+         "room_id TEXT NOT NULL DEFAULT 'general');");
+    exec(db,
+         "CREATE TABLE IF NOT EXISTS users ("
+         "id INTEGER PRIMARY KEY,"
+         "nickname TEXT UNIQUE NOT NULL," // Уникальный никнейм пользователя
+         "display_name TEXT NOT NULL,"    // Отображаемое имя пользователя
+         "password_hash TEXT NOT NULL);");
+
+    // Старая таблица users: username вместо пары nickname / display_name
+    if (query_int(db, "SELECT COUNT(*) FROM pragma_table_info('users') WHERE name='display_name';") == 0) {
+        exec(db, "ALTER TABLE users RENAME TO users_old;");
+        exec(db,
+             "CREATE TABLE users ("
+             "id INTEGER PRIMARY KEY,"
+             "nickname TEXT UNIQUE NOT NULL,"
+             "display_name TEXT NOT NULL,"
+             "password_hash TEXT NOT NULL);");
+        exec(db,
+             "INSERT INTO users (id, nickname, display_name, password_hash) "
+             "SELECT id, username, username, password_hash FROM users_old;");
+        exec(db, "DROP TABLE users_old;");
+    }
+
+    // Комнаты: сообщения, сохранённые до их появления, попадают в комнату по умолчанию
+    if (query_int(db, "SELECT COUNT(*) FROM pragma_table_info('messages') WHERE name='room_id';") == 0) {
+        exec(db, "ALTER TABLE messages ADD COLUMN room_id TEXT NOT NULL DEFAULT 'general';");
+    }
+    exec(db, "CREATE INDEX IF NOT EXISTS idx_messages_room_id ON messages(room_id, id);");
+
+    exec(db,
+         "CREATE TABLE IF NOT EXISTS direct_messages ("
+         "id INTEGER PRIMARY KEY,"
+         "sender_id INTEGER NOT NULL,"
+         "recipient_id INTEGER NOT NULL,"
+         "text TEXT,"
+         "ts DATETIME DEFAULT CURRENT_TIMESTAMP);");
+    exec(db, "CREATE INDEX IF NOT EXISTS idx_direct_messages_pair ON direct_messages(sender_id, recipient_id, id);");
+
+    // Полнотекстовый индекс сообщений комнат: rowid — id сообщения. unicode61 приводит
+    // к нижнему регистру и латиницу, и кириллицу. Индекс хранит свою копию текста,
+    // фильтры и сами сообщения берутся из messages по id.
+    if (query_int(db, "SELECT COUNT(*) FROM sqlite_master WHERE name='messages_fts';") == 0) {
+        exec(db, "CREATE VIRTUAL TABLE messages_fts USING fts5(text, tokenize = 'unicode61 remove_diacritics 2');");
+        // Сообщения комнат хранились как JSON {"user", "text"}, самые старые — простым текстом
+        exec(db,
+             "INSERT INTO messages_fts(rowid, text) SELECT id, "
+             "CASE WHEN json_valid(text) THEN COALESCE(json_extract(text, '$.text'), text) ELSE text END "
+             "FROM messages;");
+    }
+}
+
+// Версия 2: типизированные столбцы вместо JSON {"user", "text"} в messages.text и
+// время в секундах Unix вместо строки. Автор — users.display_name по user_id;
+// author заполняется только у старых строк, где сохранённое имя с ним не совпадает
+// (или пользователя нет). Таблицы пересоздаются: тип и ограничения столбца в SQLite
+// на месте не меняются.
+void migrate_typed_messages(sqlite3* db) {
+    exec(db,
+         "CREATE TABLE messages_v2 ("
+         "id INTEGER PRIMARY KEY,"
+         "room_id TEXT NOT NULL,"
+         "user_id INTEGER NOT NULL,"
+         "author TEXT,"       // NULL — имя берётся из users
+         "text TEXT NOT NULL,"
+         "ts INTEGER NOT NULL DEFAULT (CAST(strftime('%s', 'now') AS INTEGER)));");
+    exec(db,
+         "INSERT INTO messages_v2 (id, room_id, user_id, author, text, ts) "
+         "SELECT id, room_id, user_id, "
+         "CASE WHEN stored_user IS NULL THEN (CASE WHEN display_name IS NULL THEN 'User_' || user_id END) "
+         "WHEN stored_user IS NOT display_name THEN stored_user END, "
+         "COALESCE(stored_text, text, ''), ts "
+         "FROM (SELECT m.id, m.room_id, COALESCE(m.user_id, 0) AS user_id, m.text, u.display_name, "
+         "COALESCE(CAST(strftime('%s', m.ts) AS INTEGER), 0) AS ts, "
+         "CASE WHEN json_valid(m.text) THEN (CASE WHEN json_type(m.text, '$.user') = 'text' "
+         "THEN json_extract(m.text, '$.user') END) END AS stored_user, "
+         "CASE WHEN json_valid(m.text) THEN (CASE WHEN json_type(m.text, '$.text') = 'text' "
+         "THEN json_extract(m.text, '$.text') END) END AS stored_text "
+         "FROM messages m LEFT JOIN users u ON u.id = m.user_id);");
+    exec(db, "DROP TABLE messages;");
+    exec(db, "ALTER TABLE messages_v2 RENAME TO messages;");
+    // История и досылка читаются постранично в пределах комнаты, сообщения автора — по user_id
+    exec(db, "CREATE INDEX idx_messages_room_id ON messages(room_id, id);");
+    exec(db, "CREATE INDEX idx_messages_user_id ON messages(user_id, id);");
+
+    exec(db,
+         "CREATE TABLE direct_messages_v2 ("
+         "id INTEGER PRIMARY KEY,"
+         "sender_id INTEGER NOT NULL,"
+         "recipient_id INTEGER NOT NULL,"
+         "text TEXT NOT NULL,"
+         "ts INTEGER NOT NULL DEFAULT (CAST(strftime('%s', 'now') AS INTEGER)));");
+    exec(db,
+         "INSERT INTO direct_messages_v2 (id, sender_id, recipient_id, text, ts) "
+         "SELECT id, sender_id, recipient_id, COALESCE(text, ''), COALESCE(CAST(strftime('%s', ts) AS INTEGER), 0) "
+         "FROM direct_messages;");
+    exec(db, "DROP TABLE direct_messages;");
+    exec(db, "ALTER TABLE direct_messages_v2 RENAME TO direct_messages;");
+    // Переписка читается по паре (отправитель, получатель) в обе стороны
+    exec(db, "CREATE INDEX idx_direct_messages_pair ON direct_messages(sender_id, recipient_id, id);");
+}
+
+// Версия 3: граница очистки истории. Очистка только записывает её (одна строка),
+// сами сообщения удаляются потом фоновыми шагами, а id не начинаются заново,
+// даже если удалены все сообщения.
+void migrate_cleared_history(sqlite3* db) {
+    exec(db,
+         "CREATE TABLE cleared_history ("
+         "id INTEGER PRIMARY KEY CHECK (id = 1),"
+         "up_to INTEGER NOT NULL);");
+}
+
+// Миграции схемы по возрастанию версии. Версия БД — PRAGMA user_version, номер последней
+// применённой миграции. Применённые миграции не меняются: новая схема — новая миграция
+// в конце списка. Каждая выполняется в одной транзакции вместе с записью версии.
+struct Migration {
+    int version;
+    const char* name;
+    void (*apply)(sqlite3* db);
+};
+
+constexpr Migration kMigrations[] = {
+    {1, "initial schema", migrate_initial_schema},
+    {2, "typed message columns", migrate_typed_messages},
+    {3, "cleared history bound", migrate_cleared_history},
+};
+
+} // namespace
+
+Db::Connection::~Connection() {
+    for (auto& entry : statements) sqlite3_finalize(entry.second);
+    if (handle) sqlite3_close(handle);
+}
+
+sqlite3_stmt* Db::Connection::prepare(const char* sql) {
+    auto it = statements.find(sql);
+    if (it != statements.end()) return it->second;
+
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v3(handle, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+        return nullptr;
+    }
+    statements.emplace(sql, stmt);
+    return stmt;
+}
+
+Db::Db(const std::string& file, std::size_t readers, std::size_t user_cache,
+       std::unique_ptr<MessageStore> messages, bool convert_auto_vacuum)
+    : users_(user_cache), messages_(std::move(messages)) {
+    if (sqlite3_open_v2(file.c_str(), &writer_.handle,
+                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, nullptr) != SQLITE_OK)
+        throw std::runtime_error("Cannot open database");
+
+    // Удалённые сообщения освобождают страницы, которые фоновое удаление истории
+    // возвращает файлу понемногу (PRAGMA incremental_vacuum). Режим действует, только
+    // если задан до первой записи в файл (здесь — до перехода в WAL); у существующей
+    // БД без него ничего не меняется, см. init.
+    exec(writer_.handle, "PRAGMA auto_vacuum=INCREMENTAL;");
+
+    // WAL: читатели не блокируют писателя и наоборот. synchronous=NORMAL в режиме WAL
+    // сохраняет зафиксированные транзакции при падении процесса и не делает fsync на каждый коммит.
+    exec(writer_.handle, "PRAGMA journal_mode=WAL;");
+    exec(writer_.handle, "PRAGMA synchronous=NORMAL;");
+    exec(writer_.handle, "PRAGMA busy_timeout=5000;");
+    exec(writer_.handle, "PRAGMA temp_store=MEMORY;");
+    exec(writer_.handle, "PRAGMA cache_size=-16000;"); // 16 МБ
+    init(convert_auto_vacuum);
+
+    if (!is_memory_database(file)) open_readers(file, readers);
+    if (!messages_) messages_ = std::make_unique<SqliteMessages>(*this);
+}
+
+Db::~Db() = default;
+
+void Db::open_readers(const std::string& file, std::size_t count) {
+    for (std::size_t i = 0; i < count; ++i) {
+        auto conn = std::make_unique<Connection>();
+        // Каждое соединение в каждый момент используется одним потоком (см. ReadLease)
+        if (sqlite3_open_v2(file.c_str(), &conn->handle,
+                            SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI, nullptr) != SQLITE_OK)
+            throw std::runtime_error("Cannot open database reader");
+        exec(conn->handle, "PRAGMA busy_timeout=5000;");
+        exec(conn->handle, "PRAGMA cache_size=-8000;"); // 8 МБ
+        idle_readers_.push_back(conn.get());
+        readers_.push_back(std::move(conn));
+    }
+}
+
+void Db::init(bool convert_auto_vacuum) {
+    // БД, созданная до инкрементальной очистки, переводится в неё только через полный
+    // VACUUM: он переписывает весь файл и блокирует запись, поэтому выполняется лишь
+    // по явному запросу. Без него освобождённые страницы переиспользуются, но файл не уменьшается.
+    if (query_int(writer_.handle, "PRAGMA auto_vacuum;") != 2) { // 2 — INCREMENTAL
+        if (convert_auto_vacuum) {
+            LOG_INFO("Converting database to incremental auto-vacuum (one-time VACUUM)");
+            exec(writer_.handle, "VACUUM;");
+        } else {
+            LOG_WARN("Database is not in incremental auto-vacuum mode, freed pages are not returned to the OS; "
+                     "set CHAT_DB_CONVERT_VACUUM=1 once to convert it (full VACUUM)");
         }
-        sqlite3_finalize(stmt);
     }
-    
-    // Если нужна миграция, выполняем её
-    if (needs_migration) {
-        const char* migration_sql[] = {
-            "BEGIN TRANSACTION;",
-            "ALTER TABLE users RENAME TO users_old;",
-            "CREATE TABLE users ("
-            "id INTEGER PRIMARY KEY,"
-            "nickname TEXT UNIQUE NOT NULL,"
-            "display_name TEXT NOT NULL,"
-            "password_hash TEXT NOT NULL);",
-            "INSERT INTO users (id, nickname, display_name, password_hash) "
-            "SELECT id, username, username, password_hash FROM users_old;",
-            "DROP TABLE users_old;",
-            "COMMIT;"
-        };
-        
-        for (const char* sql : migration_sql) {
-            if (sqlite3_exec(db_, sql, nullptr, nullptr, &err) != SQLITE_OK) {
-                std::string e = err;
-                sqlite3_free(err);
-                sqlite3_exec(db_, "ROLLBACK;", nullptr, nullptr, nullptr);
-                std::cerr << "Migration failed: " << e << std::endl;
-                break;
+
+    // Схема приводится к текущей версии миграциями по порядку. BEGIN IMMEDIATE: процессы
+    // кластера, открывшие БД одновременно, применяют каждую миграцию по очереди,
+    // а версия перечитывается уже под блокировкой записи
+    int version = schema_version(writer_.handle);
+    if (version > kMigrations[std::size(kMigrations) - 1].version) {
+        throw std::runtime_error("Database schema version " + std::to_string(version) +
+                                 " is newer than supported by this server");
+    }
+    // Новая БД (в том числе :memory:) проходит все миграции при каждом запуске:
+    // шаги пишутся в DEBUG, в INFO — только обновление существующей схемы
+    const bool fresh = version == 0;
+    for (const auto& migration : kMigrations) {
+        if (version >= migration.version) continue;
+        exec(writer_.handle, "BEGIN IMMEDIATE;");
+        try {
+            version = schema_version(writer_.handle);
+            if (version < migration.version) {
+                if (fresh) {
+                    LOG_DEBUG("Creating schema version " << migration.version << ": " << migration.name);
+                } else {
+                    LOG_INFO("Migrating database to schema version " << migration.version << ": " << migration.name);
+                }
+                migration.apply(writer_.handle);
+                exec(writer_.handle, ("PRAGMA user_version = " + std::to_string(migration.version) + ";").c_str());
+                version = migration.version;
             }
+            exec(writer_.handle, "COMMIT;");
+        } catch (const std::exception& e) {
+            sqlite3_exec(writer_.handle, "ROLLBACK;", nullptr, nullptr, nullptr);
+            throw std::runtime_error("Migration to schema version " + std::to_string(migration.version) +
+                                     " failed: " + e.what());
         }
     }
 }
 
 void Db::save_message(int user_id, const std::string& text) {
-    const char* sql = "INSERT INTO messages(user_id, text) VALUES(?, ?);";
-    sqlite3_stmt* stmt;
-    sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr);
-    sqlite3_bind_int(stmt, 1, user_id);
-    sqlite3_bind_text(stmt, 2, text.c_str(), -1, SQLITE_TRANSIENT);
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        sqlite3_finalize(stmt);
-        throw std::runtime_error("Failed to save message");
+    messages_->save_messages({NewMessage{0, user_id, kDefaultRoom, text}});
+}
+
+std::vector<long long> Db::save_messages(const std::vector<NewMessage>& messages) {
+    ScopedTimer timer(metrics().db(DbOp::save_messages)); // Включая ожидание мьютекса записи
+    return messages_->save_messages(messages);
+}
+
+std::vector<StoredMessage> Db::load_messages(const std::string& room, long long before_id, std::size_t limit) {
+    ScopedTimer timer(metrics().db(DbOp::load_messages));
+    return resolve_authors(messages_->load_messages(room, before_id, limit));
+}
+
+std::vector<StoredMessage> Db::load_messages_after(const std::string& room, long long after_id, std::size_t limit) {
+    ScopedTimer timer(metrics().db(DbOp::load_messages_after));
+    return resolve_authors(messages_->load_messages_after(room, after_id, limit));
+}
+
+long long Db::last_message_id() { return messages_->last_message_id(); }
+
+std::vector<StoredDirectMessage> Db::load_direct_messages(int user_id, int peer_id, long long before_id, std::size_t limit) {
+    ScopedTimer timer(metrics().db(DbOp::load_direct_messages));
+    return messages_->load_direct_messages(user_id, peer_id, before_id, limit);
+}
+
+long long Db::last_direct_message_id() { return messages_->last_direct_message_id(); }
+
+void Db::clear_messages(long long up_to_id) { messages_->clear_messages(up_to_id); }
+
+std::vector<StoredMessage> Db::search_messages(const SearchQuery& query) {
+    ScopedTimer timer(metrics().db(DbOp::search_messages));
+    return resolve_authors(messages_->search_messages(query));
+}
+
+std::size_t Db::expire_messages(const RetentionPolicy& policy, std::size_t batch) {
+    ScopedTimer timer(metrics().db(DbOp::expire_messages));
+    return messages_->expire_messages(policy, batch);
+}
+
+std::vector<StoredMessage> Db::resolve_authors(std::vector<StoredMessage> messages) {
+    for (auto& m : messages) {
+        if (!m.user.empty()) continue;
+        if (auto user = get_user_by_id(m.user_id)) m.user = user->display_name;
     }
-    sqlite3_finalize(stmt);
+    return messages;
+}
+
+Db::SqliteMessages::SqliteMessages(Db& db) : db_(db) {
+    std::lock_guard<std::mutex> l(db_.mtx_);
+    Statement stmt(db_.writer_, "SELECT up_to FROM cleared_history WHERE id = 1;");
+    if (stmt && sqlite3_step(stmt.get()) == SQLITE_ROW) cleared_up_to_ = sqlite3_column_int64(stmt.get(), 0);
 }
 
-void Db::load_messages(const std::function<void(int, const std::string&, const std::string&)>& callback) {
-    const char* sql = "SELECT user_id, text, ts FROM messages ORDER BY id ASC;";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        throw std::runtime_error("Failed to load messages");
+std::vector<long long> Db::SqliteMessages::save_messages(const std::vector<NewMessage>& messages) {
+    std::lock_guard<std::mutex> l(db_.mtx_);
+    std::vector<long long> ids;
+    ids.reserve(messages.size());
+    if (messages.empty()) return ids;
+
+    {
+        Statement begin(db_.writer_, "BEGIN;");
+        if (!begin || sqlite3_step(begin.get()) != SQLITE_DONE) {
+            throw std::runtime_error(std::string("Failed to begin transaction: ") + sqlite3_errmsg(db_.writer_.handle));
+        }
     }
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        int user_id = sqlite3_column_int(stmt, 0);
-        const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        const char* ts = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        callback(user_id, text, ts);
+    auto rollback = [this] {
+        Statement stmt(db_.writer_, "ROLLBACK;");
+        if (stmt) sqlite3_step(stmt.get());
+    };
+
+    {
+        Statement room_stmt(db_.writer_, "INSERT INTO messages(id, user_id, room_id, text) VALUES(?, ?, ?, ?);");
+        Statement direct_stmt(db_.writer_, "INSERT INTO direct_messages(id, sender_id, recipient_id, text) VALUES(?, ?, ?, ?);");
+        Statement fts_stmt(db_.writer_, "INSERT INTO messages_fts(rowid, text) VALUES(?, ?);");
+        if (!room_stmt || !direct_stmt || !fts_stmt) {
+            rollback();
+            throw std::runtime_error("Failed to save messages");
+        }
+        for (const auto& m : messages) {
+            sqlite3_stmt* stmt = m.recipient_id ? direct_stmt.get() : room_stmt.get();
+            if (m.id > 0) {
+                sqlite3_bind_int64(stmt, 1, m.id);
+            } else {
+                sqlite3_bind_null(stmt, 1);
+            }
+            sqlite3_bind_int(stmt, 2, m.user_id);
+            if (m.recipient_id) {
+                sqlite3_bind_int(stmt, 3, m.recipient_id);
+            } else {
+                sqlite3_bind_text(stmt, 3, m.room.c_str(), static_cast<int>(m.room.size()), SQLITE_STATIC);
+            }
+            sqlite3_bind_text(stmt, 4, m.text.c_str(), static_cast<int>(m.text.size()), SQLITE_STATIC);
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                sqlite3_reset(stmt);
+                rollback();
+                throw std::runtime_error("Failed to save messages");
+            }
+            ids.push_back(sqlite3_last_insert_rowid(db_.writer_.handle));
+            sqlite3_reset(stmt);
+            if (m.recipient_id) continue;
+
+            // Сообщение комнаты попадает в полнотекстовый индекс в той же транзакции
+            sqlite3_bind_int64(fts_stmt.get(), 1, ids.back());
+            sqlite3_bind_text(fts_stmt.get(), 2, m.text.c_str(), static_cast<int>(m.text.size()), SQLITE_STATIC);
+            if (sqlite3_step(fts_stmt.get()) != SQLITE_DONE) {
+                sqlite3_reset(fts_stmt.get());
+                rollback();
+                throw std::runtime_error("Failed to index messages");
+            }
+            sqlite3_reset(fts_stmt.get());
+        }
     }
-    sqlite3_finalize(stmt);
+
+    Statement commit(db_.writer_, "COMMIT;");
+    if (!commit || sqlite3_step(commit.get()) != SQLITE_DONE) {
+        std::string e = sqlite3_errmsg(db_.writer_.handle);
+        rollback();
+        throw std::runtime_error("Failed to commit messages: " + e);
+    }
+    return ids;
 }
 
-void Db::clear_messages() {
-    const char* sql = "DELETE FROM messages;";
-    char* err = nullptr;
-    if (sqlite3_exec(db_, sql, nullptr, nullptr, &err) != SQLITE_OK) {
-        std::string e = err;
-        sqlite3_free(err);
-        throw std::runtime_error("Failed to clear messages: " + e);
+std::vector<StoredMessage> Db::SqliteMessages::load_messages(const std::string& room, long long before_id, std::size_t limit) {
+    ReadLease lease(db_);
+    Statement stmt(lease.connection(),
+                   "SELECT m.id, m.user_id, COALESCE(m.author, u.display_name), m.text, m.ts, m.room_id "
+                   "FROM messages m LEFT JOIN users u ON u.id = m.user_id "
+                   "WHERE m.room_id = ? AND m.id < ? AND m.id > ? ORDER BY m.id DESC LIMIT ?;");
+    if (!stmt) throw std::runtime_error("Failed to load messages");
+    sqlite3_bind_text(stmt.get(), 1, room.c_str(), static_cast<int>(room.size()), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt.get(), 2, before_id > 0 ? before_id : std::numeric_limits<sqlite3_int64>::max());
+    sqlite3_bind_int64(stmt.get(), 3, cleared_up_to_.load());
+    sqlite3_bind_int64(stmt.get(), 4, static_cast<sqlite3_int64>(limit));
+
+    auto messages = read_messages(stmt.get());
+    // Выбирали от новых к старым, отдаём в хронологическом порядке
+    std::reverse(messages.begin(), messages.end());
+    return messages;
+}
+
+std::vector<StoredMessage> Db::SqliteMessages::load_messages_after(const std::string& room, long long after_id, std::size_t limit) {
+    ReadLease lease(db_);
+    Statement stmt(lease.connection(),
+                   "SELECT m.id, m.user_id, COALESCE(m.author, u.display_name), m.text, m.ts, m.room_id "
+                   "FROM messages m LEFT JOIN users u ON u.id = m.user_id "
+                   "WHERE m.room_id = ? AND m.id > ? ORDER BY m.id ASC LIMIT ?;");
+    if (!stmt) throw std::runtime_error("Failed to load messages");
+    sqlite3_bind_text(stmt.get(), 1, room.c_str(), static_cast<int>(room.size()), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt.get(), 2, std::max(after_id, cleared_up_to_.load()));
+    sqlite3_bind_int64(stmt.get(), 3, static_cast<sqlite3_int64>(limit));
+    return read_messages(stmt.get());
+}
+
+long long Db::SqliteMessages::last_message_id() {
+    ReadLease lease(db_);
+    Statement stmt(lease.connection(), "SELECT COALESCE(MAX(id), 0) FROM messages;");
+    if (!stmt) throw std::runtime_error("Failed to read last message id");
+    long long id = 0;
+    if (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+        id = sqlite3_column_int64(stmt.get(), 0);
+    }
+    // После очистки таблица может быть пустой: нумерация продолжается от границы
+    return std::max(id, cleared_up_to_.load());
+}
+
+std::vector<StoredDirectMessage> Db::SqliteMessages::load_direct_messages(int user_id, int peer_id, long long before_id, std::size_t limit) {
+    ReadLease lease(db_);
+    Statement stmt(lease.connection(),
+                   // Каждое направление читается отдельно по индексу и не дальше limit строк
+                   "SELECT * FROM (SELECT id, sender_id, recipient_id, text, ts FROM direct_messages "
+                   "WHERE sender_id = ?1 AND recipient_id = ?2 AND id < ?3 ORDER BY id DESC LIMIT ?4) "
+                   "UNION ALL "
+                   "SELECT * FROM (SELECT id, sender_id, recipient_id, text, ts FROM direct_messages "
+                   "WHERE sender_id = ?2 AND recipient_id = ?1 AND id < ?3 ORDER BY id DESC LIMIT ?4) "
+                   "ORDER BY id DESC LIMIT ?4;");
+    if (!stmt) throw std::runtime_error("Failed to load direct messages");
+    sqlite3_bind_int(stmt.get(), 1, user_id);
+    sqlite3_bind_int(stmt.get(), 2, peer_id);
+    sqlite3_bind_int64(stmt.get(), 3, before_id > 0 ? before_id : std::numeric_limits<sqlite3_int64>::max());
+    sqlite3_bind_int64(stmt.get(), 4, static_cast<sqlite3_int64>(limit));
+
+    auto messages = read_direct_messages(stmt.get());
+    std::reverse(messages.begin(), messages.end());
+    return messages;
+}
+
+long long Db::SqliteMessages::last_direct_message_id() {
+    ReadLease lease(db_);
+    Statement stmt(lease.connection(), "SELECT COALESCE(MAX(id), 0) FROM direct_messages;");
+    if (!stmt) throw std::runtime_error("Failed to read last direct message id");
+    long long id = 0;
+    if (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+        id = sqlite3_column_int64(stmt.get(), 0);
+    }
+    return id;
+}
+
+void Db::SqliteMessages::clear_messages(long long up_to_id) {
+    std::lock_guard<std::mutex> l(db_.mtx_);
+    // Граница только растёт: процессы кластера записывают одну и ту же очистку каждый
+    Statement stmt(db_.writer_, "INSERT INTO cleared_history(id, up_to) VALUES(1, ?) "
+                                "ON CONFLICT(id) DO UPDATE SET up_to = MAX(up_to, excluded.up_to);");
+    if (!stmt) throw std::runtime_error("Failed to clear messages");
+    sqlite3_bind_int64(stmt.get(), 1, up_to_id);
+    if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+        throw std::runtime_error(std::string("Failed to clear messages: ") + sqlite3_errmsg(db_.writer_.handle));
     }
+    if (up_to_id > cleared_up_to_) cleared_up_to_ = up_to_id;
+}
+
+std::vector<StoredMessage> Db::SqliteMessages::search_messages(const SearchQuery& query) {
+    // Запрос FTS5 собирается из слов запроса в кавычках: синтаксис FTS5 (операторы,
+    // префиксы, столбцы) клиенту недоступен, а слова объединяются через AND
+    std::string match;
+    for (const auto& term : search_terms(query.text)) {
+        if (!match.empty()) match += ' ';
+        match += '"' + term + '"';
+    }
+    if (match.empty() || query.limit == 0) return {};
+
+    ReadLease lease(db_);
+    // Окно кандидатов — самые новые совпадения по убыванию rowid (FTS5 отдаёт их
+    // без сортировки), BM25 считается только для них. Размер окна не зависит от
+    // страницы, иначе дальние страницы ранжировали бы другой набор совпадений
+    Statement stmt(lease.connection(),
+                   "SELECT m.id, m.user_id, COALESCE(m.author, u.display_name), m.text, m.ts, m.room_id FROM ("
+                   "SELECT f.rowid AS id, f.rank AS rank FROM messages_fts f "
+                   "JOIN messages m ON m.id = f.rowid "
+                   "WHERE messages_fts MATCH ?1 AND m.room_id = ?2 AND (?3 = 0 OR m.user_id = ?3) "
+                   "AND (?4 = 0 OR m.ts >= ?4) AND (?5 = 0 OR m.ts < ?5) AND m.id > ?9 "
+                   "ORDER BY f.rowid DESC LIMIT ?8) r "
+                   "JOIN messages m ON m.id = r.id LEFT JOIN users u ON u.id = m.user_id "
+                   "ORDER BY r.rank, r.id DESC LIMIT ?6 OFFSET ?7;");
+    if (!stmt) throw std::runtime_error(std::string("Failed to search messages: ") +
+                                        sqlite3_errmsg(lease.connection().handle));
+    sqlite3_bind_text(stmt.get(), 1, match.c_str(), static_cast<int>(match.size()), SQLITE_STATIC);
+    sqlite3_bind_text(stmt.get(), 2, query.room.c_str(), static_cast<int>(query.room.size()), SQLITE_STATIC);
+    sqlite3_bind_int(stmt.get(), 3, query.user_id);
+    sqlite3_bind_int64(stmt.get(), 4, query.since);
+    sqlite3_bind_int64(stmt.get(), 5, query.until);
+    sqlite3_bind_int64(stmt.get(), 6, static_cast<sqlite3_int64>(query.limit));
+    sqlite3_bind_int64(stmt.get(), 7, static_cast<sqlite3_int64>(query.offset));
+    sqlite3_bind_int64(stmt.get(), 8, query.candidates == 0 ? -1 // LIMIT -1 — без ограничения
+        : static_cast<sqlite3_int64>(query.candidates));
+    sqlite3_bind_int64(stmt.get(), 9, cleared_up_to_.load());
+    return read_messages(stmt.get());
+}
+
+long long Db::SqliteMessages::expired_up_to(const char* sql, bool over_bytes, const RetentionPolicy& policy,
+                                            long long age_cutoff, long long cleared_up_to, std::size_t batch) {
+    Statement stmt(db_.writer_, sql);
+    if (!stmt) throw std::runtime_error(std::string("Failed to expire messages: ") + sqlite3_errmsg(db_.writer_.handle));
+    sqlite3_bind_int64(stmt.get(), 1, static_cast<sqlite3_int64>(batch));
+    sqlite3_bind_int(stmt.get(), 2, over_bytes ? 1 : 0);
+    sqlite3_bind_int64(stmt.get(), 3, static_cast<sqlite3_int64>(policy.max_messages));
+    sqlite3_bind_int64(stmt.get(), 4, age_cutoff);
+    sqlite3_bind_int64(stmt.get(), 5, cleared_up_to);
+    long long up_to = 0;
+    if (sqlite3_step(stmt.get()) == SQLITE_ROW) up_to = sqlite3_column_int64(stmt.get(), 0); // NULL — 0
+    return up_to;
+}
+
+std::size_t Db::SqliteMessages::delete_up_to(const char* sql, long long up_to) {
+    Statement stmt(db_.writer_, sql);
+    if (!stmt) throw std::runtime_error(std::string("Failed to expire messages: ") + sqlite3_errmsg(db_.writer_.handle));
+    sqlite3_bind_int64(stmt.get(), 1, up_to);
+    if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+        throw std::runtime_error(std::string("Failed to expire messages: ") + sqlite3_errmsg(db_.writer_.handle));
+    }
+    return static_cast<std::size_t>(sqlite3_changes(db_.writer_.handle));
+}
+
+std::size_t Db::SqliteMessages::expire_messages(const RetentionPolicy& policy, std::size_t batch) {
+    std::lock_guard<std::mutex> l(db_.mtx_);
+    bool over_bytes = false;
+    if (policy.max_bytes > 0) {
+        // Занятые страницы файла; свободные уже не считаются, даже если файл ещё не уменьшился
+        Statement size(db_.writer_, "SELECT (p.page_count - f.freelist_count) * s.page_size "
+                                    "FROM pragma_page_count p, pragma_freelist_count f, pragma_page_size s;");
+        if (size && sqlite3_step(size.get()) == SQLITE_ROW) {
+            over_bytes = static_cast<std::size_t>(sqlite3_column_int64(size.get(), 0)) > policy.max_bytes;
+        }
+    }
+    long long age_cutoff = policy.max_age_seconds > 0
+        ? static_cast<long long>(std::time(nullptr)) - policy.max_age_seconds : 0;
+
+    // Кандидаты — batch самых старых строк по первичному ключу, поэтому шаг не сканирует
+    // таблицу, даже когда удалять нечего. Время записи растёт вместе с id, так что
+    // нарушающие политику строки идут в начале таблицы. Сообщения комнат до границы
+    // очистки удаляются всегда, даже без политики хранения.
+    long long messages_up_to = expired_up_to(
+        "SELECT MAX(id) FROM (SELECT id, ts FROM messages ORDER BY id LIMIT ?1) "
+        "WHERE id <= ?5 OR (id < (SELECT MAX(id) FROM messages) AND (?2 OR (?3 > 0 AND id <= (SELECT MAX(id) FROM messages) - ?3) "
+        "OR ts < ?4));",
+        over_bytes, policy, age_cutoff, cleared_up_to_, batch);
+    long long direct_up_to = expired_up_to(
+        "SELECT MAX(id) FROM (SELECT id, ts FROM direct_messages ORDER BY id LIMIT ?1) "
+        "WHERE id <= ?5 OR (id < (SELECT MAX(id) FROM direct_messages) AND (?2 OR (?3 > 0 AND id <= (SELECT MAX(id) FROM direct_messages) - ?3) "
+        "OR ts < ?4));",
+        over_bytes, policy, age_cutoff, 0, batch);
+
+    std::size_t deleted = 0;
+    if (messages_up_to > 0 || direct_up_to > 0) {
+        exec(db_.writer_.handle, "BEGIN;");
+        try {
+            if (messages_up_to > 0) {
+                deleted += delete_up_to("DELETE FROM messages WHERE id <= ?;", messages_up_to);
+                delete_up_to("DELETE FROM messages_fts WHERE rowid <= ?;", messages_up_to);
+            }
+            if (direct_up_to > 0) {
+                deleted += delete_up_to("DELETE FROM direct_messages WHERE id <= ?;", direct_up_to);
+            }
+            exec(db_.writer_.handle, "COMMIT;");
+        } catch (...) {
+            sqlite3_exec(db_.writer_.handle, "ROLLBACK;", nullptr, nullptr, nullptr);
+            throw;
+        }
+    }
+
+    // Свободные страницы (от этого и прошлых удалений, от очистки истории) возвращаются
+    // файлу ограниченными порциями, чтобы шаг оставался коротким
+    Statement freelist(db_.writer_, "SELECT freelist_count FROM pragma_freelist_count;");
+    if (freelist && sqlite3_step(freelist.get()) == SQLITE_ROW && sqlite3_column_int(freelist.get(), 0) > 0) {
+        static const std::string vacuum = "PRAGMA incremental_vacuum(" + std::to_string(kVacuumPages) + ");";
+        exec(db_.writer_.handle, vacuum.c_str());
+    }
+    return deleted;
 }
 
 bool Db::register_user(const std::string& nickname, const std::string& display_name, const std::string& password_hash) {
-    const char* sql = "INSERT INTO users(nickname, display_name, password_hash) VALUES(?, ?, ?);";
-    sqlite3_stmt* stmt;
-    
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    ScopedTimer timer(metrics().db(DbOp::register_user));
+    std::lock_guard<std::mutex> l(mtx_);
+    Statement stmt(writer_, "INSERT INTO users(nickname, display_name, password_hash) VALUES(?, ?, ?);");
+    if (!stmt) {
         return false;
     }
     
-    sqlite3_bind_text(stmt, 1, nickname.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, display_name.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, password_hash.c_str(), -1, SQLITE_TRANSIENT);
-    
-    bool result = sqlite3_step(stmt) == SQLITE_DONE;
-    sqlite3_finalize(stmt);
+    sqlite3_bind_text(stmt.get(), 1, nickname.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt.get(), 2, display_name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt.get(), 3, password_hash.c_str(), -1, SQLITE_STATIC);
     
+    bool result = sqlite3_step(stmt.get()) == SQLITE_DONE;
+    users_.invalidate(nickname);
     return result;
 }
 
 std::optional<User> Db::login_user(const std::string& nickname, const std::string& password_hash) {
-    const char* sql = "SELECT id, nickname, display_name, password_hash FROM users WHERE nickname = ? AND password_hash = ? LIMIT 1;";
-    sqlite3_stmt* stmt;
-    
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    ScopedTimer timer(metrics().db(DbOp::login_user));
+    ReadLease lease(*this);
+    Statement stmt(lease.connection(), "SELECT id, nickname, display_name, password_hash FROM users WHERE nickname = ? AND password_hash = ? LIMIT 1;");
+    if (!stmt) {
         return std::nullopt;
     }
     
-    sqlite3_bind_text(stmt, 1, nickname.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, password_hash.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt.get(), 1, nickname.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt.get(), 2, password_hash.c_str(), -1, SQLITE_STATIC);
     
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        User user;
-        user.id = sqlite3_column_int(stmt, 0);
-        user.nickname = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        user.display_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        user.password_hash = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-        
-        sqlite3_finalize(stmt);
-        return user;
+    if (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+        return read_user(stmt.get());
     }
-    
-    sqlite3_finalize(stmt);
     return std::nullopt;
 }
 
 std::optional<User> Db::get_user_by_id(int user_id) {
-    const char* sql = "SELECT id, nickname, display_name, password_hash FROM users WHERE id = ? LIMIT 1;";
-    sqlite3_stmt* stmt;
+    if (auto cached = users_.find_by_id(user_id)) return cached;
+    ScopedTimer timer(metrics().db(DbOp::get_user)); // Только промахи кеша
     
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    ReadLease lease(*this);
+    Statement stmt(lease.connection(), "SELECT id, nickname, display_name, password_hash FROM users WHERE id = ? LIMIT 1;");
+    if (!stmt) {
         return std::nullopt;
     }
     
-    sqlite3_bind_int(stmt, 1, user_id);
+    sqlite3_bind_int(stmt.get(), 1, user_id);
     
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        User user;
-        user.id = sqlite3_column_int(stmt, 0);
-        user.nickname = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        user.display_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        user.password_hash = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-        
-        sqlite3_finalize(stmt);
+    if (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+        User user = read_user(stmt.get());
+        users_.put(user);
         return user;
     }
-    
-    sqlite3_finalize(stmt);
     return std::nullopt;
 }
 
 std::optional<User> Db::get_user_by_nickname(const std::string& nickname) {
-    const char* sql = "SELECT id, nickname, display_name, password_hash FROM users WHERE nickname = ? LIMIT 1;";
-    sqlite3_stmt* stmt;
+    if (auto cached = users_.find_by_nickname(nickname)) return cached;
+    ScopedTimer timer(metrics().db(DbOp::get_user));
     
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    ReadLease lease(*this);
+    Statement stmt(lease.connection(), "SELECT id, nickname, display_name, password_hash FROM users WHERE nickname = ? LIMIT 1;");
+    if (!stmt) {
         return std::nullopt;
     }
     
-    sqlite3_bind_text(stmt, 1, nickname.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt.get(), 1, nickname.c_str(), -1, SQLITE_STATIC);
     
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        User user;
-        user.id = sqlite3_column_int(stmt, 0);
-        user.nickname = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        user.display_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        user.password_hash = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-        
-        sqlite3_finalize(stmt);
+    if (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+        User user = read_user(stmt.get());
+        users_.put(user);
         return user;
     }
-    
-    sqlite3_finalize(stmt);
     return std::nullopt;
 }
 
 bool Db::check_nickname_exists(const std::string& nickname) {
-    const char* sql = "SELECT COUNT(*) FROM users WHERE nickname = ? LIMIT 1;";
-    sqlite3_stmt* stmt;
-    
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    ReadLease lease(*this);
+    Statement stmt(lease.connection(), "SELECT COUNT(*) FROM users WHERE nickname = ? LIMIT 1;");
+    if (!stmt) {
         return false; // В случае ошибки возвращаем false
     }
     
-    sqlite3_bind_text(stmt, 1, nickname.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt.get(), 1, nickname.c_str(), -1, SQLITE_STATIC);
     
     bool exists = false;
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        int count = sqlite3_column_int(stmt, 0);
+    if (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+        int count = sqlite3_column_int(stmt.get(), 0);
         exists = (count > 0);
     }
-    
-    sqlite3_finalize(stmt);
     return exists;
-}
\ No newline at end of file
+}
@@ -4,31 +4,93 @@
 #include <string>
 #include <functional>
 #include <optional>
-
-struct User {
-    int id;
-    std::string nickname;    // Уникальный никнейм для идентификации пользователя
-    std::string display_name; // Отображаемое имя
-    std::string password_hash;
-};
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "message_store.hpp"
+#include "user.hpp"
+#include "user_cache.hpp"
 
 class Db {
 public:
-    explicit Db(const std::string& file);
+    // readers — число соединений только для чтения (для ":memory:" не используются)
+    // user_cache — ёмкость LRU-кеша пользователей (0 — без кеша)
+    // messages — движок хранения сообщений; nullptr — таблицы этой же БД
+    // convert_auto_vacuum — перевести старую БД в auto_vacuum = INCREMENTAL полным VACUUM
+    explicit Db(const std::string& file, std::size_t readers = 4, std::size_t user_cache = 4096,
+                std::unique_ptr<MessageStore> messages = nullptr, bool convert_auto_vacuum = false);
     ~Db();
 
     void save_message(int user_id, const std::string& text);
-    void load_messages(const std::function<void(int, const std::string&, const std::string&)>& callback);
-    void clear_messages(); // Новый метод для очистки истории сообщений
+    // Сохраняет пакет сообщений (комнат и личных) одной транзакцией, возвращает их id в том же порядке
+    std::vector<long long> save_messages(const std::vector<NewMessage>& messages);
+    // Страница истории комнаты: до limit сообщений с id < before_id (before_id <= 0 — самые новые),
+    // упорядоченных по возрастанию id. Выборка идёт по индексу (room_id, id), без полного сканирования.
+    std::vector<StoredMessage> load_messages(const std::string& room, long long before_id, std::size_t limit);
+    // До limit сообщений комнаты с id > after_id по возрастанию id (досылка после переподключения)
+    std::vector<StoredMessage> load_messages_after(const std::string& room, long long after_id, std::size_t limit);
+    long long last_message_id();
+    // Страница переписки двух пользователей (в обе стороны): до limit личных сообщений
+    // с id < before_id по возрастанию id. Выборка идёт по индексу (sender_id, recipient_id, id).
+    std::vector<StoredDirectMessage> load_direct_messages(int user_id, int peer_id, long long before_id, std::size_t limit);
+    long long last_direct_message_id(); // У личных сообщений своя нумерация
+    // Очистка истории комнат: сообщения с id <= up_to_id сразу перестают читаться,
+    // а удаляются потом шагами expire_messages (см. RetentionTask)
+    void clear_messages(long long up_to_id);
+    // Полнотекстовый поиск в комнате: до query.limit сообщений, содержащих все слова запроса,
+    // по убыванию релевантности (BM25) начиная с query.offset-го. В SQLite идёт по индексу FTS5.
+    std::vector<StoredMessage> search_messages(const SearchQuery& query);
+    // Шаг фонового удаления старой и очищенной истории (см. MessageStore::expire_messages). В SQLite —
+    // одна транзакция не больше чем на batch строк каждой таблицы, после неё файлу
+    // возвращается часть освободившихся страниц (auto_vacuum = INCREMENTAL).
+    std::size_t expire_messages(const RetentionPolicy& policy, std::size_t batch);
     
     // Методы для работы с пользователями
     bool register_user(const std::string& nickname, const std::string& display_name, const std::string& password_hash);
     std::optional<User> login_user(const std::string& nickname, const std::string& password_hash);
+    // Поиск пользователя сначала идёт по LRU-кешу
     std::optional<User> get_user_by_id(int user_id);
     std::optional<User> get_user_by_nickname(const std::string& nickname);
     bool check_nickname_exists(const std::string& nickname); // Проверка существования никнейма
 
 private:
-    sqlite3* db_;
-    void init();
+    // Соединение SQLite с кешем подготовленных запросов: каждый запрос
+    // готовится один раз и переиспользуется до закрытия соединения
+    struct Connection {
+        sqlite3* handle = nullptr;
+        // Ключ — адрес строкового литерала с текстом запроса
+        std::unordered_map<const char*, sqlite3_stmt*> statements;
+
+        Connection() = default;
+        Connection(const Connection&) = delete;
+        Connection& operator=(const Connection&) = delete;
+        ~Connection();
+
+        sqlite3_stmt* prepare(const char* sql);
+    };
+
+    class Statement;
+    class ReadLease;
+    class SqliteMessages;
+
+    UserCache users_;
+    Connection writer_;
+    std::mutex mtx_; // Соединение для записи используется из нескольких потоков
+
+    // Пул соединений для чтения (WAL позволяет читать параллельно с записью)
+    std::vector<std::unique_ptr<Connection>> readers_;
+    std::vector<Connection*> idle_readers_;
+    std::mutex readers_mtx_;
+    std::condition_variable readers_cv_;
+
+    // Объявлено последним: закрывается раньше соединений, которыми может пользоваться
+    std::unique_ptr<MessageStore> messages_;
+
+    void init(bool convert_auto_vacuum);
+    void open_readers(const std::string& file, std::size_t count);
+    // Имена авторов, которых не вернуло хранилище (журнал сегментов хранит только user_id),
+    // берутся из users через кеш пользователей
+    std::vector<StoredMessage> resolve_authors(std::vector<StoredMessage> messages);
 };
\ No newline at end of file
@@ -0,0 +1,73 @@
+#pragma once
+#include <nlohmann/json.hpp>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Формат кадров соединения; выбирается подпротоколом WebSocket при подключении
+enum class WireFormat {
+    json,    // Текстовые кадры JSON (по умолчанию)
+    msgpack, // Бинарные кадры MessagePack, подпротокол "chat.msgpack"
+    cbor     // Бинарные кадры CBOR, подпротокол "chat.cbor"
+};
+
+// Неизменяемый сериализованный кадр. При рассылке сообщение сериализуется
+// один раз, а очереди всех сессий хранят ссылки на один и тот же кадр.
+// Бинарное представление строится из JSON при первом обращении сессии
+// с этим форматом и дальше переиспользуется: каждый формат кодируется
+// не больше одного раза на кадр, сколько бы получателей его ни ждали.
+class FrameData {
+public:
+    explicit FrameData(std::string text, long long message_id = 0, long long ordered_after = 0)
+        : text_(std::move(text)), message_id_(message_id), ordered_after_(ordered_after) {}
+
+    const std::string& text() const { return text_; }
+    // id сообщения комнаты в кадре "message"; 0 — кадр другого вида
+    long long message_id() const { return message_id_; }
+    // Сообщения с id <= ordered_after уже были поставлены в очереди сессий, когда
+    // началась рассылка этого кадра. Сообщения между ним и message_id могли ещё
+    // рассылаться параллельно и прийти в сессию позже этого кадра.
+    long long ordered_after() const { return ordered_after_; }
+
+    // Кадр в формате соединения; безопасно вызывать из любых потоков.
+    // Пустая строка — кадр не является корректным JSON и в бинарном формате не отправляется.
+    const std::string& payload(WireFormat format) const {
+        if (format == WireFormat::json) return text_;
+        auto& slot = binary_[format == WireFormat::msgpack ? 0 : 1];
+        std::call_once(slot.once, [&] {
+            auto value = nlohmann::json::parse(text_, nullptr, false);
+            if (value.is_discarded()) return;
+            std::vector<std::uint8_t> bytes = format == WireFormat::msgpack
+                ? nlohmann::json::to_msgpack(value)
+                : nlohmann::json::to_cbor(value);
+            slot.bytes.assign(bytes.begin(), bytes.end());
+        });
+        return slot.bytes;
+    }
+
+private:
+    struct Encoded {
+        std::once_flag once;
+        std::string bytes;
+    };
+
+    std::string text_;
+    long long message_id_;
+    long long ordered_after_;
+    mutable std::array<Encoded, 2> binary_;
+};
+
+using Frame = std::shared_ptr<const FrameData>;
+
+inline Frame make_frame(std::string payload, long long message_id = 0, long long ordered_after = 0) {
+    return std::make_shared<const FrameData>(std::move(payload), message_id, ordered_after);
+}
+
+// Кадр "resync": клиент сам запрашивает пропущенные сообщения через "resume"
+inline const Frame& resync_frame() {
+    static const Frame frame = make_frame(nlohmann::json{{"type", "resync"}}.dump());
+    return frame;
+}
@@ -0,0 +1,451 @@
+// Нагрузочный клиент для chat_server.
+// Регистрирует (или логинит) N пользователей по loopback, отправляет сообщения
+// с заданной суммарной частотой и измеряет задержку доставки от отправки до
+// получения каждым подписчиком комнаты. Итог — JSON-отчёт для сравнения между версиями.
+//
+//   ./chat_loadgen --users=200 --rate=500 --duration=30 --report=report.json
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace asio      = boost::asio;
+namespace beast     = boost::beast;
+namespace websocket = beast::websocket;
+using tcp  = asio::ip::tcp;
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    std::string host = "127.0.0.1";
+    std::string port = "9002";
+    std::size_t users = 100;
+    double rate = 100;      // Сообщений в секунду суммарно по всем пользователям
+    double duration = 10;   // Секунд измерения
+    double warmup = 2;      // Секунд отправки до начала измерения
+    double drain = 2;       // Секунд ожидания доставки после остановки отправки
+    std::size_t payload = 32;
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string prefix = "loadgen";
+    std::string report;     // Файл JSON-отчёта; пусто — stdout
+};
+
+void usage() {
+    std::cerr << "usage: chat_loadgen [--host=127.0.0.1] [--port=9002] [--users=100] [--rate=100]\n"
+                 "                    [--duration=10] [--warmup=2] [--drain=2] [--payload=32]\n"
+                 "                    [--threads=N] [--prefix=loadgen] [--report=file.json]\n";
+}
+
+Options parse_options(int argc, char** argv) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == std::string::npos) throw std::invalid_argument(arg);
+        std::string key = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+        if (key == "host") o.host = value;
+        else if (key == "port") o.port = value;
+        else if (key == "users") o.users = std::stoul(value);
+        else if (key == "rate") o.rate = std::stod(value);
+        else if (key == "duration") o.duration = std::stod(value);
+        else if (key == "warmup") o.warmup = std::stod(value);
+        else if (key == "drain") o.drain = std::stod(value);
+        else if (key == "payload") o.payload = std::stoul(value);
+        else if (key == "threads") o.threads = std::max<std::size_t>(1, std::stoul(value));
+        else if (key == "prefix") o.prefix = value;
+        else if (key == "report") o.report = value;
+        else throw std::invalid_argument(arg);
+    }
+    if (o.users == 0 || o.rate <= 0 || o.duration <= 0) throw std::invalid_argument("users, rate and duration must be positive");
+    return o;
+}
+
+std::int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Лог-линейная гистограмма задержек в микросекундах: значения до 64 хранятся точно,
+// дальше каждый интервал [2^k, 2^(k+1)) делится на 32 корзины (погрешность до ~3%)
+class LatencyHistogram {
+public:
+    void record(std::uint64_t us) {
+        ++counts_[index(us)];
+        ++count_;
+        sum_ += us;
+        max_ = std::max(max_, us);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (std::size_t i = 0; i < counts_.size(); ++i) counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    std::uint64_t percentile(double q) const {
+        if (count_ == 0) return 0;
+        auto target = static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(count_)));
+        target = std::max<std::uint64_t>(1, target);
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= target) return std::min(upper_bound(i), max_);
+        }
+        return max_;
+    }
+
+    std::uint64_t count() const { return count_; }
+    std::uint64_t max() const { return max_; }
+    double mean() const { return count_ ? static_cast<double>(sum_) / static_cast<double>(count_) : 0.0; }
+
+private:
+    static constexpr std::size_t kExact = 64;
+    static constexpr std::size_t kSub = 32;
+
+    static std::size_t index(std::uint64_t v) {
+        if (v < kExact) return static_cast<std::size_t>(v);
+        int msb = 63 - __builtin_clzll(v);   // >= 6
+        int shift = msb - 5;                 // Оставляем старшие 6 бит: v >> shift в [32, 64)
+        auto top = static_cast<std::size_t>(v >> shift);
+        return kExact + static_cast<std::size_t>(msb - 6) * kSub + (top - kSub);
+    }
+
+    static std::uint64_t upper_bound(std::size_t i) {
+        if (i < kExact) return i;
+        std::size_t msb = (i - kExact) / kSub + 6;
+        std::size_t top = (i - kExact) % kSub + kSub;
+        std::size_t shift = msb - 5;
+        return ((static_cast<std::uint64_t>(top) + 1) << shift) - 1;
+    }
+
+    std::vector<std::uint64_t> counts_ = std::vector<std::uint64_t>(kExact + 58 * kSub);
+    std::uint64_t count_ = 0;
+    std::uint64_t sum_ = 0;
+    std::uint64_t max_ = 0;
+};
+
+// Общее состояние прогона
+struct Run {
+    Options options;
+    tcp::resolver::results_type endpoints;
+    std::atomic<std::size_t> connected{0};
+    std::atomic<std::size_t> joined{0};
+    std::atomic<std::size_t> errors{0};
+    std::atomic<std::size_t> auth_retries{0};
+    std::atomic<std::uint64_t> sent{0};          // Отправлено в окне измерения
+    std::atomic<std::uint64_t> sent_total{0};
+    std::atomic<std::uint64_t> delivered_total{0};
+    std::atomic<bool> sending{false};
+    std::atomic<std::int64_t> window_start{0};   // Окно измерения [start, end) по времени отправки
+    std::atomic<std::int64_t> window_end{0};
+
+    // Гистограмма на каждый поток io_context: запись без синхронизации
+    std::vector<LatencyHistogram> histograms;
+};
+
+thread_local std::size_t thread_index = 0;
+
+class Client : public std::enable_shared_from_this<Client> {
+public:
+    Client(asio::io_context& ioc, Run& run, std::size_t index)
+        : ws_(asio::make_strand(ioc)), timer_(ws_.get_executor()), run_(run), index_(index),
+          nickname_(run.options.prefix + "_" + std::to_string(index)) {}
+
+    void start() {
+        beast::get_lowest_layer(ws_).expires_after(std::chrono::seconds(30));
+        beast::get_lowest_layer(ws_).async_connect(run_.endpoints,
+            [self = shared_from_this()](beast::error_code ec, const tcp::endpoint&) {
+                if (ec) return self->fail("connect", ec);
+                beast::get_lowest_layer(self->ws_).expires_never();
+                self->ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
+                self->ws_.async_handshake(self->run_.options.host, "/",
+                    [self](beast::error_code ec) {
+                        if (ec) return self->fail("handshake", ec);
+                        self->run_.connected.fetch_add(1, std::memory_order_relaxed);
+                        self->do_read();
+                        self->send_auth("register");
+                    });
+            });
+    }
+
+    // Периодическая отправка: interval — период одного пользователя, phase — сдвиг первого сообщения
+    void start_sending(Clock::duration interval, Clock::duration phase) {
+        asio::dispatch(ws_.get_executor(), [self = shared_from_this(), interval, phase] {
+            self->interval_ = interval;
+            self->next_send_ = Clock::now() + phase;
+            self->schedule_send();
+        });
+    }
+
+    void close() {
+        asio::dispatch(ws_.get_executor(), [self = shared_from_this()] {
+            self->closing_ = true;
+            self->timer_.cancel();
+            if (!self->ws_.is_open()) return;
+            self->ws_.async_close(websocket::close_code::normal, [self](beast::error_code) {});
+        });
+    }
+
+private:
+    websocket::stream<beast::tcp_stream> ws_;
+    asio::steady_timer timer_;
+    Run& run_;
+    std::size_t index_;
+    std::string nickname_;
+    std::string token_;
+    bool joined_ = false;
+    bool closing_ = false;
+    beast::flat_buffer buffer_;
+    std::vector<std::string> write_queue_;
+    std::size_t writing_ = 0; // Индекс записываемого кадра + 1; 0 — запись не идёт
+    Clock::duration interval_{};
+    Clock::time_point next_send_{};
+
+    void fail(const char* what, beast::error_code ec) {
+        if (closing_ || ec == asio::error::operation_aborted || ec == websocket::error::closed) return;
+        run_.errors.fetch_add(1, std::memory_order_relaxed);
+        std::cerr << nickname_ << ": " << what << ": " << ec.message() << std::endl;
+    }
+
+    void send_auth(const char* type) {
+        json j = {
+            {"type", type},
+            {"nickname", nickname_},
+            {"display_name", nickname_},
+            {"password", "loadgen"}
+        };
+        send(j.dump());
+    }
+
+    void send(std::string frame) {
+        write_queue_.push_back(std::move(frame));
+        if (!writing_) do_write();
+    }
+
+    void do_write() {
+        writing_ = 1;
+        ws_.async_write(asio::buffer(write_queue_.front()),
+            [self = shared_from_this()](beast::error_code ec, std::size_t) {
+                self->writing_ = 0;
+                if (ec) return self->fail("write", ec);
+                self->write_queue_.erase(self->write_queue_.begin());
+                if (!self->write_queue_.empty()) self->do_write();
+            });
+    }
+
+    void do_read() {
+        ws_.async_read(buffer_, [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if (ec) return self->fail("read", ec);
+            auto data = beast::buffers_to_string(self->buffer_.data());
+            self->buffer_.consume(self->buffer_.size());
+            self->on_frame(data);
+            self->do_read();
+        });
+    }
+
+    void on_frame(const std::string& data) {
+        // Быстрый путь для собственных сообщений нагрузки (основной поток кадров):
+        // разбирать JSON целиком не нужно, чтобы клиент не стал узким местом замера
+        static const std::string kMarker = "\"text\":\"lg ";
+        auto marker = data.find(kMarker);
+        if (marker != std::string::npos && data.find("\"type\":\"message\"") != std::string::npos) {
+            on_message(data.substr(marker + kMarker.size() - 3, 48));
+            return;
+        }
+
+        json j = json::parse(data, nullptr, false);
+        if (j.is_discarded() || !j.contains("type")) return;
+        const std::string type = j["type"].get<std::string>();
+
+        if (type == "message") {
+            on_message(j.value("text", std::string()));
+        } else if (type == "register_response" || type == "login_response") {
+            if (j.value("success", false)) {
+                token_ = j.value("token", std::string());
+                json join = {{"type", "join"}, {"user", nickname_}, {"token", token_}};
+                send(join.dump());
+                return;
+            }
+            std::string error = j.value("error", std::string());
+            if (type == "register_response" && error.find("уже существует") != std::string::npos) {
+                send_auth("login"); // Пользователь остался с прошлого прогона
+            } else if (error.find("перегружен") != std::string::npos) {
+                // Пул регистрации сервера заполнен: повторяем позже
+                run_.auth_retries.fetch_add(1, std::memory_order_relaxed);
+                timer_.expires_after(std::chrono::milliseconds(100 + index_ % 200));
+                timer_.async_wait([self = shared_from_this(), type](beast::error_code ec) {
+                    if (!ec) self->send_auth(type == "register_response" ? "register" : "login");
+                });
+            } else {
+                run_.errors.fetch_add(1, std::memory_order_relaxed);
+                std::cerr << nickname_ << ": " << type << ": " << error << std::endl;
+            }
+        } else if (type == "join" && !joined_ && j.value("user", std::string()) == nickname_) {
+            joined_ = true;
+            run_.joined.fetch_add(1, std::memory_order_relaxed);
+        } else if (type == "auth_error") {
+            run_.errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Текст сообщения: "lg <отправитель> <время отправки, нс> <заполнение>"
+    void on_message(const std::string& text) {
+        if (text.rfind("lg ", 0) != 0) return;
+        auto sent_at_pos = text.find(' ', 3) + 1;
+        std::int64_t sent_at = std::strtoll(text.c_str() + sent_at_pos, nullptr, 10);
+        run_.delivered_total.fetch_add(1, std::memory_order_relaxed);
+        if (sent_at < run_.window_start.load(std::memory_order_relaxed) ||
+            sent_at >= run_.window_end.load(std::memory_order_relaxed)) return;
+        auto latency_us = static_cast<std::uint64_t>(std::max<std::int64_t>(0, now_ns() - sent_at) / 1000);
+        run_.histograms[thread_index].record(latency_us);
+    }
+
+    void schedule_send() {
+        timer_.expires_at(next_send_);
+        timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+            if (ec || self->closing_ || !self->run_.sending.load(std::memory_order_relaxed)) return;
+            self->send_message();
+            // Расписание по абсолютному времени: задержки обработчика не снижают частоту
+            self->next_send_ += self->interval_;
+            self->schedule_send();
+        });
+    }
+
+    void send_message() {
+        std::int64_t sent_at = now_ns();
+        std::string text = "lg " + std::to_string(index_) + " " + std::to_string(sent_at) + " ";
+        if (text.size() < run_.options.payload) text.append(run_.options.payload - text.size(), 'x');
+        json j = {{"type", "message"}, {"user", nickname_}, {"text", text}, {"token", token_}};
+        send(j.dump());
+
+        run_.sent_total.fetch_add(1, std::memory_order_relaxed);
+        if (sent_at >= run_.window_start.load(std::memory_order_relaxed) &&
+            sent_at < run_.window_end.load(std::memory_order_relaxed)) {
+            run_.sent.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+void sleep_seconds(double s) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(s));
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Run run;
+    try {
+        run.options = parse_options(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "invalid argument: " << e.what() << std::endl;
+        usage();
+        return 2;
+    }
+    const Options& o = run.options;
+
+    asio::io_context ioc{static_cast<int>(o.threads)};
+    run.endpoints = tcp::resolver(ioc).resolve(o.host, o.port);
+    run.histograms.resize(o.threads);
+
+    auto work = asio::make_work_guard(ioc);
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < o.threads; ++i) {
+        threads.emplace_back([&ioc, i] {
+            thread_index = i;
+            ioc.run();
+        });
+    }
+
+    // 1. Подключение и вход всех пользователей
+    auto connect_started = Clock::now();
+    std::vector<std::shared_ptr<Client>> clients;
+    clients.reserve(o.users);
+    for (std::size_t i = 0; i < o.users; ++i) {
+        clients.push_back(std::make_shared<Client>(ioc, run, i));
+        clients.back()->start();
+    }
+    auto deadline = Clock::now() + std::chrono::seconds(60);
+    while (run.joined.load() < o.users && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    double connect_seconds = std::chrono::duration<double>(Clock::now() - connect_started).count();
+    std::size_t joined = run.joined.load();
+    std::cerr << "joined " << joined << "/" << o.users << " users in " << connect_seconds << " s" << std::endl;
+
+    // 2. Прогрев и измерение: учитываются только сообщения, отправленные внутри окна
+    std::int64_t start = now_ns() + static_cast<std::int64_t>(o.warmup * 1e9);
+    run.window_start = start;
+    run.window_end = start + static_cast<std::int64_t>(o.duration * 1e9);
+    run.sending = true;
+    auto interval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(static_cast<double>(o.users) / o.rate));
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<Clock::rep> phase(0, std::max<Clock::rep>(1, interval.count()));
+    for (auto& c : clients) c->start_sending(interval, Clock::duration(phase(rng)));
+
+    sleep_seconds(o.warmup + o.duration);
+    run.sending = false;
+    sleep_seconds(o.drain); // Дожидаемся доставки последних сообщений окна
+
+    for (auto& c : clients) c->close();
+    sleep_seconds(0.5);
+    work.reset();
+    ioc.stop();
+    for (auto& t : threads) t.join();
+
+    // 3. Отчёт
+    LatencyHistogram latency;
+    for (const auto& h : run.histograms) latency.merge(h);
+    std::uint64_t sent = run.sent.load();
+    std::uint64_t expected = sent * joined; // Все пользователи в одной комнате, включая отправителя
+    json report = {
+        {"users", o.users},
+        {"joined", joined},
+        {"rate", o.rate},
+        {"duration_s", o.duration},
+        {"payload_bytes", o.payload},
+        {"connect_s", connect_seconds},
+        {"sent", sent},
+        {"delivered", latency.count()},
+        {"expected_deliveries", expected},
+        {"delivery_ratio", expected ? static_cast<double>(latency.count()) / static_cast<double>(expected) : 0.0},
+        {"send_throughput", static_cast<double>(sent) / o.duration},
+        {"delivery_throughput", static_cast<double>(latency.count()) / o.duration},
+        {"latency_us", {
+            {"p50", latency.percentile(0.50)},
+            {"p99", latency.percentile(0.99)},
+            {"p999", latency.percentile(0.999)},
+            {"max", latency.max()},
+            {"mean", latency.mean()}
+        }},
+        {"errors", run.errors.load()},
+        {"auth_retries", run.auth_retries.load()}
+    };
+
+    std::cerr << "sent " << sent << " msgs (" << report["send_throughput"].get<double>() << "/s), delivered "
+              << latency.count() << "/" << expected << ", latency p50 " << latency.percentile(0.50)
+              << " us, p99 " << latency.percentile(0.99) << " us, p999 " << latency.percentile(0.999)
+              << " us" << std::endl;
+
+    if (o.report.empty()) {
+        std::cout << report.dump(2) << std::endl;
+    } else {
+        std::ofstream(o.report) << report.dump(2) << std::endl;
+    }
+    return run.errors.load() == 0 && joined == o.users ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+#include "logger.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <thread>
+
+namespace {
+
+using Clock = std::chrono::system_clock;
+
+struct Record {
+    LogLevel level = LogLevel::info;
+    Clock::time_point time;
+    std::string text;
+};
+
+// Ограниченная очередь многих писателей и одного читателя без блокировок
+// (кольцо с номерами последовательности в ячейках, схема Вьюкова).
+// Писатели занимают ячейку одним CAS по head_, читатель — поток вывода.
+class LogQueue {
+public:
+    explicit LogQueue(std::size_t capacity) {
+        std::size_t size = 2;
+        while (size < capacity) size <<= 1;
+        cells_ = std::make_unique<Cell[]>(size);
+        mask_ = size - 1;
+        for (std::size_t i = 0; i < size; ++i) cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(Record&& record) {
+        std::size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[pos & mask_];
+            std::size_t seq = cell.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.record = std::move(record);
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // Очередь заполнена
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Вызывается только потоком вывода
+    bool try_pop(Record& record) {
+        Cell& cell = cells_[tail_ & mask_];
+        if (cell.seq.load(std::memory_order_acquire) != tail_ + 1) return false;
+        record = std::move(cell.record);
+        cell.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+        ++tail_;
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> seq{0};
+        Record record;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    std::size_t mask_ = 0;
+    alignas(64) std::atomic<std::size_t> head_{0};
+    alignas(64) std::size_t tail_ = 0;
+};
+
+std::unique_ptr<LogQueue> queue_storage;
+std::atomic<LogQueue*> queue{nullptr};
+std::atomic<bool> running{false};
+std::atomic<std::size_t> dropped_records{0};
+std::thread sink;
+
+void format(std::string& out, const Record& record) {
+    auto seconds = Clock::to_time_t(record.time);
+    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(record.time.time_since_epoch()).count() % 1000;
+    std::tm tm{};
+    gmtime_r(&seconds, &tm);
+    char stamp[32];
+    std::size_t n = std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    std::snprintf(stamp + n, sizeof(stamp) - n, ".%03d ", static_cast<int>(millis));
+    out += stamp;
+    out += Log::level_name(record.level);
+    out += ' ';
+    out += record.text;
+    out += '\n';
+}
+
+// Забирает всё, что есть в очереди, и выводит одним fwrite
+std::size_t drain(LogQueue& q, std::string& buffer) {
+    std::size_t count = 0;
+    Record record;
+    buffer.clear();
+    while (q.try_pop(record)) {
+        format(buffer, record);
+        ++count;
+    }
+    if (count) {
+        std::fwrite(buffer.data(), 1, buffer.size(), stderr);
+        std::fflush(stderr);
+    }
+    return count;
+}
+
+void run_sink(LogQueue& q) {
+    std::string buffer;
+    std::size_t reported = 0;
+    while (running.load(std::memory_order_acquire)) {
+        if (drain(q, buffer) == 0) {
+            std::size_t dropped = dropped_records.load(std::memory_order_relaxed);
+            if (dropped != reported) {
+                std::fprintf(stderr, "log queue overflow: %zu records dropped\n", dropped - reported);
+                reported = dropped;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+    drain(q, buffer);
+}
+
+} // namespace
+
+void Log::start(LogLevel level, std::size_t queue_capacity) {
+    set_level(level);
+    if (running.exchange(true)) return;
+    queue_storage = std::make_unique<LogQueue>(queue_capacity);
+    queue.store(queue_storage.get(), std::memory_order_release);
+    sink = std::thread(run_sink, std::ref(*queue_storage));
+}
+
+void Log::stop() {
+    if (!running.exchange(false)) return;
+    queue.store(nullptr, std::memory_order_release);
+    sink.join(); // Поток вывода дописывает очередь перед выходом
+}
+
+void Log::write(LogLevel level, std::string message) {
+    Record record{level, Clock::now(), std::move(message)};
+    if (LogQueue* q = queue.load(std::memory_order_acquire)) {
+        if (!q->try_push(std::move(record))) dropped_records.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    std::string line;
+    format(line, record);
+    std::fwrite(line.data(), 1, line.size(), stderr);
+}
+
+std::size_t Log::dropped() {
+    return dropped_records.load(std::memory_order_relaxed);
+}
+
+std::optional<LogLevel> Log::parse_level(const std::string& name) {
+    if (name == "debug") return LogLevel::debug;
+    if (name == "info") return LogLevel::info;
+    if (name == "warn") return LogLevel::warn;
+    if (name == "error") return LogLevel::error;
+    if (name == "off") return LogLevel::off;
+    return std::nullopt;
+}
+
+const char* Log::level_name(LogLevel level) {
+    switch (level) {
+    case LogLevel::debug: return "DEBUG";
+    case LogLevel::info:  return "INFO";
+    case LogLevel::warn:  return "WARN";
+    case LogLevel::error: return "ERROR";
+    case LogLevel::off:   return "OFF";
+    }
+    return "";
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <sstream>
+#include <string>
+
+enum class LogLevel {
+    debug, // Каждый кадр и каждое сообщение; по умолчанию выключен
+    info,  // Подключения, очистка истории и другие редкие события
+    warn,  // Медленные клиенты, перегрузка пула
+    error,
+    off
+};
+
+// Асинхронный журнал. Вызывающий поток только форматирует строку и кладёт её
+// в ограниченную очередь без блокировок; в stderr пишет отдельный поток,
+// пакетами и с одним сбросом буфера на пакет. При переполнении очереди записи
+// отбрасываются (их число выводится позже), а сетевые потоки не ждут вывода.
+// Уровень можно менять на ходу: проверка выключенного уровня — одно атомарное чтение.
+class Log {
+public:
+    // До start() (и после stop()) записи выводятся синхронно
+    static void start(LogLevel level, std::size_t queue_capacity);
+    static void stop(); // Дописывает очередь и останавливает поток вывода
+
+    static bool enabled(LogLevel level) {
+        return static_cast<int>(level) >= level_.load(std::memory_order_relaxed);
+    }
+    static void set_level(LogLevel level) { level_.store(static_cast<int>(level), std::memory_order_relaxed); }
+    static LogLevel level() { return static_cast<LogLevel>(level_.load(std::memory_order_relaxed)); }
+
+    static void write(LogLevel level, std::string message);
+    static std::size_t dropped(); // Сколько записей отброшено из-за переполнения очереди
+
+    static std::optional<LogLevel> parse_level(const std::string& name);
+    static const char* level_name(LogLevel level);
+
+private:
+    static inline std::atomic<int> level_{static_cast<int>(LogLevel::info)};
+};
+
+// Выражение после << вычисляется, только если уровень включён
+#define CHAT_LOG(level, expr)                          \
+    do {                                               \
+        if (Log::enabled(level)) {                     \
+            std::ostringstream chat_log_stream_;       \
+            chat_log_stream_ << expr;                  \
+            Log::write(level, chat_log_stream_.str()); \
+        }                                              \
+    } while (0)
+
+#define LOG_DEBUG(expr) CHAT_LOG(LogLevel::debug, expr)
+#define LOG_INFO(expr)  CHAT_LOG(LogLevel::info, expr)
+#define LOG_WARN(expr)  CHAT_LOG(LogLevel::warn, expr)
+#define LOG_ERROR(expr) CHAT_LOG(LogLevel::error, expr)
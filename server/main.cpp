@@ -1,10 +1,49 @@
 #include "chat_server.hpp"
+#include "config.hpp"
+#include "logger.hpp"
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <csignal>
+#include <functional>
+#include <thread>
+#include <vector>
 
 int main() {
-    boost::asio::io_context ioc{1};
-    ChatServer server(ioc, {boost::asio::ip::make_address("0.0.0.0"), 9002});
+    auto config = ServerConfig::from_env();
+    Log::start(config.log_level, config.log_queue);
+    try {
+        config.validate();
+    } catch (const std::invalid_argument& e) {
+        LOG_ERROR("Invalid configuration: " << e.what());
+        Log::stop();
+        return 1;
+    }
+    boost::asio::io_context ioc{static_cast<int>(config.threads)};
+    ChatServer server(ioc, {boost::asio::ip::make_address("0.0.0.0"), 9002}, config);
     server.run();
+
+    // SIGUSR1 включает и выключает журнал каждого сообщения (уровень debug) без перезапуска
+    boost::asio::signal_set signals(ioc, SIGUSR1);
+    std::function<void()> wait_toggle = [&] {
+        signals.async_wait([&](const boost::system::error_code& ec, int) {
+            if (ec) return;
+            LogLevel normal = std::max(config.log_level, LogLevel::info);
+            Log::set_level(Log::level() == LogLevel::debug ? normal : LogLevel::debug);
+            // Сообщение о переключении выводится при любом настроенном уровне
+            Log::write(LogLevel::info, std::string("Log level: ") + Log::level_name(Log::level()));
+            wait_toggle();
+        });
+    };
+    wait_toggle();
+
+    // Пул рабочих потоков: текущий поток тоже обслуживает io_context
+    std::vector<std::thread> workers;
+    workers.reserve(config.threads - 1);
+    for (std::size_t i = 1; i < config.threads; ++i) {
+        workers.emplace_back([&ioc] { ioc.run(); });
+    }
     ioc.run();
+    for (auto& t : workers) t.join();
+    Log::stop();
     return 0;
-}
\ No newline at end of file
+}
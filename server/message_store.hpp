@@ -0,0 +1,88 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Комната, в которую попадают сообщения без явного указания комнаты
+// (и все сообщения, сохранённые до появления комнат)
+inline constexpr const char* kDefaultRoom = "general";
+
+// Сообщение, ожидающее записи в БД
+struct NewMessage {
+    long long id; // Присваивается сервером при публикации; 0 — выбрать автоматически
+    int user_id;
+    std::string room;
+    std::string text;     // Текст как есть; автор определяется по user_id
+    int recipient_id = 0; // Получатель личного сообщения; 0 — сообщение комнаты
+};
+
+// Сообщение, прочитанное из истории
+struct StoredMessage {
+    long long id;
+    int user_id;
+    std::string user; // Отображаемое имя автора; пустое — не известно хранилищу (см. Db)
+    std::string room;
+    std::string text;
+    long long ts;     // Время UTC, секунды
+};
+
+// Личное сообщение, прочитанное из истории переписки
+struct StoredDirectMessage {
+    long long id;
+    int sender_id;
+    int recipient_id;
+    std::string text;
+    long long ts; // Время UTC, секунды
+};
+
+// Полнотекстовый поиск по сообщениям комнаты (см. search_terms в search_index.hpp)
+struct SearchQuery {
+    std::string text;    // Найдутся сообщения, содержащие все слова запроса
+    std::string room;
+    int user_id = 0;     // Автор; 0 — любой
+    long long since = 0; // Время UTC в секундах: не раньше since (0 — без ограничения)
+    long long until = 0; // и раньше until (0 — без ограничения)
+    std::size_t offset = 0;
+    std::size_t limit = 0;
+    // Ранжируются только столько самых новых совпадений, на всех страницах одни и те же;
+    // 0 — все. Ограничивает время запроса по словам, которые есть почти в каждом сообщении.
+    std::size_t candidates = 0;
+};
+
+// Сколько истории хранить. Ограничения независимы, нулевое не действует; сообщение
+// удаляется, если нарушает любое из них. Самые старые сообщения удаляются первыми.
+struct RetentionPolicy {
+    long long max_age_seconds = 0; // Возраст сообщения
+    std::size_t max_messages = 0;  // Последних сообщений комнат и, отдельно, личных сообщений
+    std::size_t max_bytes = 0;     // Размер хранилища на диске
+
+    bool enabled() const { return max_age_seconds > 0 || max_messages > 0 || max_bytes > 0; }
+};
+
+// Хранилище сообщений комнат и личных сообщений. Db выбирает движок при открытии,
+// пользователи и аутентификация всегда остаются в SQLite.
+// Запись идёт из одного потока (MessageWriter), чтение — из любых потоков параллельно с ней.
+// Семантика методов — как у одноимённых методов Db.
+class MessageStore {
+public:
+    virtual ~MessageStore() = default;
+
+    virtual std::vector<long long> save_messages(const std::vector<NewMessage>& messages) = 0;
+    virtual std::vector<StoredMessage> load_messages(const std::string& room, long long before_id,
+                                                     std::size_t limit) = 0;
+    virtual std::vector<StoredMessage> load_messages_after(const std::string& room, long long after_id,
+                                                           std::size_t limit) = 0;
+    virtual long long last_message_id() = 0;
+    virtual std::vector<StoredDirectMessage> load_direct_messages(int user_id, int peer_id, long long before_id,
+                                                                  std::size_t limit) = 0;
+    virtual long long last_direct_message_id() = 0;
+    // Запоминает границу очистки: сообщения комнат с id <= up_to_id больше не читаются,
+    // а last_message_id не меньше границы. Вызов короткий, само удаление — в expire_messages.
+    virtual void clear_messages(long long up_to_id) = 0;
+    // Сообщения, найденные по запросу, начиная с offset-го, по убыванию релевантности
+    virtual std::vector<StoredMessage> search_messages(const SearchQuery& query) = 0;
+    // Один короткий шаг хранения: удаляет часть самых старых сообщений (комнат и личных),
+    // нарушающих policy или очищенных, — не больше batch, если движок удаляет по сообщениям.
+    // Самое новое сообщение каждого вида по policy не удаляется, чтобы нумерация не начиналась заново.
+    // Возвращает число удалённых сообщений; 0 — удалять больше нечего.
+    virtual std::size_t expire_messages(const RetentionPolicy& policy, std::size_t batch) = 0;
+};
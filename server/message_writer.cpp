@@ -0,0 +1,90 @@
+#include "message_writer.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <utility>
+
+MessageWriter::MessageWriter(Db& db, std::size_t batch_size, std::chrono::milliseconds flush_interval)
+    : db_(db), batch_size_(std::max<std::size_t>(1, batch_size)), flush_interval_(flush_interval) {
+    thread_ = std::thread([this] { run(); });
+}
+
+MessageWriter::~MessageWriter() {
+    {
+        std::lock_guard<std::mutex> l(mtx_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join(); // Поток дописывает оставшиеся сообщения перед выходом
+}
+
+void MessageWriter::enqueue(NewMessage message, Callback on_saved) {
+    std::size_t size;
+    {
+        std::lock_guard<std::mutex> l(mtx_);
+        // Сообщения комнат ставятся в очередь в порядке id (под мьютексом публикации сервера)
+        if (message.recipient_id == 0) enqueued_id_ = std::max(enqueued_id_, message.id);
+        queue_.push_back({std::move(message), std::move(on_saved)});
+        size = queue_.size();
+    }
+    // Будим поток только при появлении первого сообщения или заполнении пакета
+    if (size == 1 || size >= batch_size_) cv_.notify_one();
+}
+
+void MessageWriter::wait_persisted(long long id) {
+    std::unique_lock<std::mutex> l(mtx_);
+    // id может быть больше поставленных в очередь (граница из БД при запуске или очистки)
+    long long target = std::min(id, enqueued_id_);
+    if (persisted_id_ >= target) return;
+    ++flush_waiters_;
+    cv_.notify_one();
+    persisted_cv_.wait(l, [this, target] { return persisted_id_ >= target; });
+    --flush_waiters_;
+}
+
+void MessageWriter::run() {
+    std::unique_lock<std::mutex> l(mtx_);
+    for (;;) {
+        cv_.wait(l, [this] { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) break; // Остановка, всё записано
+
+        // Окно накопления: ждём полный пакет, но не дольше flush_interval_
+        auto deadline = std::chrono::steady_clock::now() + flush_interval_;
+        cv_.wait_until(l, deadline, [this] {
+            return stopping_ || flush_waiters_ > 0 || queue_.size() >= batch_size_;
+        });
+
+        std::deque<Pending> batch;
+        long long batch_id = persisted_id_;
+        while (!queue_.empty() && batch.size() < batch_size_) {
+            if (queue_.front().message.recipient_id == 0) batch_id = std::max(batch_id, queue_.front().message.id);
+            batch.push_back(std::move(queue_.front()));
+            queue_.pop_front();
+        }
+        l.unlock();
+
+        write_batch(batch);
+
+        l.lock();
+        persisted_id_ = batch_id;
+        if (flush_waiters_ > 0) persisted_cv_.notify_all();
+    }
+}
+
+void MessageWriter::write_batch(std::deque<Pending>& batch) {
+    std::vector<NewMessage> messages;
+    messages.reserve(batch.size());
+    for (auto& p : batch) messages.push_back(std::move(p.message));
+
+    std::vector<long long> ids;
+    bool saved = true;
+    try {
+        ids = db_.save_messages(messages);
+    } catch (const std::exception& e) {
+        LOG_ERROR("Error saving message batch: " << e.what());
+        saved = false;
+    }
+
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        if (batch[i].on_saved) batch[i].on_saved(saved, saved ? ids[i] : 0);
+    }
+}
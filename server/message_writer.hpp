@@ -0,0 +1,50 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "db.hpp"
+
+// Отложенная запись сообщений: отдельный поток БД накапливает сообщения
+// и сохраняет их пакетами, по одной транзакции на пакет. Сетевые потоки
+// только ставят сообщение в очередь и не ждут диска.
+class MessageWriter {
+public:
+    // Вызывается в потоке БД после фиксации транзакции: (успех, id сообщения)
+    using Callback = std::function<void(bool, long long)>;
+
+    MessageWriter(Db& db, std::size_t batch_size, std::chrono::milliseconds flush_interval);
+    ~MessageWriter();
+
+    void enqueue(NewMessage message, Callback on_saved);
+    // Блокирует, пока не записаны (или не отвергнуты с ошибкой) все сообщения комнат
+    // с id <= id, уже поставленные в очередь. Более новые сообщения не ждёт, поэтому
+    // при непрерывной публикации не зависает.
+    void wait_persisted(long long id);
+
+private:
+    struct Pending {
+        NewMessage message;
+        Callback on_saved;
+    };
+
+    void run();
+    void write_batch(std::deque<Pending>& batch);
+
+    Db& db_;
+    const std::size_t batch_size_;
+    const std::chrono::milliseconds flush_interval_;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;         // Новые сообщения, flush или остановка
+    std::condition_variable persisted_cv_; // Записан очередной пакет
+    std::deque<Pending> queue_;
+    std::size_t flush_waiters_ = 0; // Ждущие wait_persisted: пакет пишется без окна накопления
+    long long enqueued_id_ = 0;     // Последний id сообщения комнаты, поставленного в очередь
+    long long persisted_id_ = 0;    // Сообщения комнат до него включительно обработаны потоком БД
+    bool stopping_ = false;
+    std::thread thread_;
+};
@@ -0,0 +1,78 @@
+#include "metrics.hpp"
+#include <string>
+
+namespace {
+
+const char* db_op_name(DbOp op) {
+    switch (op) {
+    case DbOp::save_messages:        return "save_messages";
+    case DbOp::load_messages:        return "load_messages";
+    case DbOp::load_messages_after:  return "load_messages_after";
+    case DbOp::load_direct_messages: return "load_direct_messages";
+    case DbOp::search_messages:      return "search_messages";
+    case DbOp::expire_messages:      return "expire_messages";
+    case DbOp::register_user:        return "register_user";
+    case DbOp::login_user:           return "login_user";
+    case DbOp::get_user:             return "get_user";
+    case DbOp::count:                break;
+    }
+    return "unknown";
+}
+
+void write_counter(std::ostream& out, const char* name, const char* help, const Counter& counter) {
+    out << "# HELP " << name << ' ' << help << '\n'
+        << "# TYPE " << name << " counter\n"
+        << name << ' ' << counter.value() << '\n';
+}
+
+void write_histogram_header(std::ostream& out, const char* name, const char* help) {
+    out << "# HELP " << name << ' ' << help << '\n'
+        << "# TYPE " << name << " histogram\n";
+}
+
+} // namespace
+
+void Histogram::write(std::ostream& out, const char* name, const char* labels) const {
+    std::string prefix = labels[0] ? std::string(labels) + "," : std::string();
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i < buckets_.size(); ++i) {
+        cumulative += buckets_[i].load(std::memory_order_relaxed);
+        out << name << "_bucket{" << prefix << "le=\"";
+        if (i < kBounds.size()) out << kBounds[i];
+        else out << "+Inf";
+        out << "\"} " << cumulative << '\n';
+    }
+    std::string braces = labels[0] ? "{" + std::string(labels) + "}" : std::string();
+    out << name << "_sum" << braces << ' '
+        << static_cast<double>(sum_ns_.load(std::memory_order_relaxed)) / 1e9 << '\n';
+    out << name << "_count" << braces << ' ' << cumulative << '\n';
+}
+
+void Metrics::write(std::ostream& out) const {
+    write_counter(out, "chat_connections_total", "Accepted WebSocket connections", connections_total);
+    write_counter(out, "chat_frames_in_total", "Frames received from clients", frames_in);
+    write_counter(out, "chat_frames_out_total", "Frames written to clients", frames_out);
+    write_counter(out, "chat_bytes_out_total", "Bytes written to clients", bytes_out);
+    write_counter(out, "chat_frames_dropped_total", "Frames dropped by send queue overflow", frames_dropped);
+    write_counter(out, "chat_frames_rejected_total", "Client frames of unknown type or without required fields",
+                  frames_rejected);
+    write_counter(out, "chat_http_requests_total", "Plain HTTP requests", http_requests);
+    write_counter(out, "chat_messages_expired_total", "Messages deleted by the retention policy", messages_expired);
+
+    write_histogram_header(out, "chat_broadcast_seconds", "Time to queue one frame for all recipients");
+    broadcast_seconds.write(out, "chat_broadcast_seconds");
+
+    write_histogram_header(out, "chat_auth_seconds", "Register/login latency including pool queueing");
+    auth_seconds.write(out, "chat_auth_seconds");
+
+    write_histogram_header(out, "chat_db_seconds", "Db call latency");
+    for (std::size_t i = 0; i < db_seconds.size(); ++i) {
+        std::string labels = std::string("op=\"") + db_op_name(static_cast<DbOp>(i)) + "\"";
+        db_seconds[i].write(out, "chat_db_seconds", labels.c_str());
+    }
+}
+
+Metrics& metrics() {
+    static Metrics instance;
+    return instance;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Счётчики и гистограммы сервера в формате Prometheus (страница /metrics).
+// Запись — только атомарные операции без блокировок; счётчики горячего пути
+// разнесены по полосам, чтобы потоки не делили одну кеш-линию.
+
+// Монотонный счётчик. Каждый поток пишет в свою полосу, чтение суммирует полосы.
+class Counter {
+public:
+    void inc(std::uint64_t n = 1) {
+        stripes_[stripe()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t value() const {
+        std::uint64_t total = 0;
+        for (const auto& s : stripes_) total += s.value.load(std::memory_order_relaxed);
+        return total;
+    }
+
+private:
+    static constexpr std::size_t kStripes = 16;
+
+    struct alignas(64) Stripe {
+        std::atomic<std::uint64_t> value{0};
+    };
+
+    static std::size_t stripe() {
+        static std::atomic<std::size_t> next{0};
+        thread_local std::size_t index = next.fetch_add(1, std::memory_order_relaxed) % kStripes;
+        return index;
+    }
+
+    std::array<Stripe, kStripes> stripes_;
+};
+
+// Гистограмма длительностей с фиксированными границами корзин (в секундах)
+class Histogram {
+public:
+    static constexpr std::array<double, 15> kBounds = {
+        0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+        0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5
+    };
+
+    void observe(std::chrono::nanoseconds duration) {
+        double seconds = std::chrono::duration<double>(duration).count();
+        std::size_t bucket = 0;
+        while (bucket < kBounds.size() && seconds > kBounds[bucket]) ++bucket;
+        buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+        sum_ns_.fetch_add(static_cast<std::uint64_t>(duration.count()), std::memory_order_relaxed);
+    }
+
+    // name{labels,le="..."}: корзины выводятся накопительно, как требует формат
+    void write(std::ostream& out, const char* name, const char* labels = "") const;
+
+private:
+    std::array<std::atomic<std::uint64_t>, kBounds.size() + 1> buckets_{}; // Последняя — +Inf
+    std::atomic<std::uint64_t> sum_ns_{0};
+};
+
+// Замер длительности области видимости
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { histogram_.observe(std::chrono::steady_clock::now() - start_); }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Histogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Операции Db, для которых собирается гистограмма задержек
+enum class DbOp {
+    save_messages,
+    load_messages,
+    load_messages_after,
+    load_direct_messages,
+    search_messages,
+    expire_messages,
+    register_user,
+    login_user,
+    get_user,
+    count
+};
+
+// Метрики процесса
+struct Metrics {
+    Counter connections_total;  // Принятые WebSocket-соединения
+    Counter frames_in;          // Кадры, прочитанные от клиентов
+    Counter frames_out;         // Кадры, записанные клиентам
+    Counter bytes_out;
+    Counter frames_dropped;     // Отброшены из-за переполнения очереди отправки
+    Counter frames_rejected;    // Кадры клиентов неизвестного типа или без обязательных полей
+    Counter http_requests;      // Обычные HTTP-запросы (без upgrade)
+    Counter messages_expired;   // Удалены по сроку хранения
+    Histogram broadcast_seconds; // Постановка кадра в очереди всех получателей
+    Histogram auth_seconds;      // Регистрация/вход: от постановки в пул до готового ответа
+    std::array<Histogram, static_cast<std::size_t>(DbOp::count)> db_seconds;
+
+    Histogram& db(DbOp op) { return db_seconds[static_cast<std::size_t>(op)]; }
+
+    // Всё, кроме метрик, которые ChatServer снимает с сессий в момент запроса
+    void write(std::ostream& out) const;
+};
+
+Metrics& metrics();
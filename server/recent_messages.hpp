@@ -0,0 +1,114 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "frame.hpp"
+
+// Кольцо последних разосланных сообщений в уже сериализованном виде.
+// Писатель один (добавление идёт под мьютексом публикации ChatServer),
+// читатели не берут блокировок сервера. id и хеш комнаты слота читаются под счётчиком
+// версии (seqlock): слоты чужих комнат и вытесненные слоты отсеиваются без блокировок.
+// Кадр подходящего слота копируется атомарной операцией над shared_ptr, а она
+// в libstdc++ не lock-free: на время копирования указателя берётся короткая
+// блокировка из общего пула. Её берёт только чтение кадров, которые уходят клиенту.
+class RecentMessages {
+public:
+    explicit RecentMessages(std::size_t capacity)
+        : slots_(std::max<std::size_t>(1, capacity)) {}
+
+    // id должны строго возрастать на единицу (нумерация общая для всех комнат)
+    void push(long long id, std::string room, Frame frame) {
+        std::size_t room_hash = std::hash<std::string>{}(room);
+        write(slots_[slot(id)], id, room_hash,
+              std::make_shared<const Entry>(Entry{id, std::move(room), std::move(frame)}));
+        last_id_.store(id, std::memory_order_release);
+    }
+
+    // Кадры комнат rooms с id > after_id в порядке возрастания; up_to — последний
+    // просмотренный id (все сообщения до него включительно есть в результате).
+    // std::nullopt — часть разрыва уже вытеснена из кольца (или кольцо очищено),
+    // такие сообщения нужно читать из БД.
+    std::optional<std::vector<Frame>> since(long long after_id, const std::unordered_set<std::string>& rooms,
+                                            long long* up_to = nullptr) const {
+        long long last = last_id_.load(std::memory_order_acquire);
+        if (up_to) *up_to = last;
+        return between(after_id, last + 1, rooms);
+    }
+
+    // Кадры комнат rooms с after_id < id < before_id в порядке возрастания;
+    // std::nullopt — часть из них уже вытеснена из кольца (или ещё не добавлена)
+    std::optional<std::vector<Frame>> between(long long after_id, long long before_id,
+                                              const std::unordered_set<std::string>& rooms) const {
+        long long last = std::min(before_id - 1, last_id_.load(std::memory_order_acquire));
+        if (last < before_id - 1) return std::nullopt;
+        if (after_id >= last) return std::vector<Frame>{};
+        if (static_cast<unsigned long long>(last - after_id) > slots_.size()) return std::nullopt;
+
+        std::vector<std::size_t> hashes;
+        hashes.reserve(rooms.size());
+        for (const auto& room : rooms) hashes.push_back(std::hash<std::string>{}(room));
+
+        std::vector<Frame> frames;
+        for (long long id = after_id + 1; id <= last; ++id) {
+            const Slot& s = slots_[slot(id)];
+            std::uint64_t version = s.version.load(std::memory_order_acquire);
+            long long slot_id = s.id.load(std::memory_order_relaxed);
+            std::size_t room_hash = s.room_hash.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // Слот переписывается или уже перезаписан более новым сообщением
+            if ((version & 1) || s.version.load(std::memory_order_relaxed) != version || slot_id != id) {
+                return std::nullopt;
+            }
+            if (std::find(hashes.begin(), hashes.end(), room_hash) == hashes.end()) continue;
+
+            auto entry = std::atomic_load_explicit(&s.entry, std::memory_order_acquire);
+            if (!entry || entry->id != id) return std::nullopt;
+            if (rooms.count(entry->room)) frames.push_back(entry->frame); // Хеши могли совпасть
+        }
+        return frames;
+    }
+
+    // Начальная граница (последний id в БД при запуске или после очистки):
+    // более ранние сообщения в кольце отсутствуют
+    void reset(long long last_id) {
+        for (auto& s : slots_) write(s, 0, 0, nullptr);
+        last_id_.store(last_id, std::memory_order_release);
+    }
+
+    long long last_id() const { return last_id_.load(std::memory_order_acquire); }
+
+private:
+    struct Entry {
+        long long id;
+        std::string room;
+        Frame frame;
+    };
+
+    struct Slot {
+        std::atomic<std::uint64_t> version{0}; // Нечётная — слот переписывается
+        std::atomic<long long> id{0};
+        std::atomic<std::size_t> room_hash{0};
+        std::shared_ptr<const Entry> entry;    // Только через atomic_load/atomic_store
+    };
+
+    static void write(Slot& s, long long id, std::size_t room_hash, std::shared_ptr<const Entry> entry) {
+        std::uint64_t version = s.version.load(std::memory_order_relaxed);
+        s.version.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s.id.store(id, std::memory_order_relaxed);
+        s.room_hash.store(room_hash, std::memory_order_relaxed);
+        std::atomic_store_explicit(&s.entry, std::move(entry), std::memory_order_release);
+        s.version.store(version + 2, std::memory_order_release);
+    }
+
+    std::size_t slot(long long id) const { return static_cast<std::size_t>(id) % slots_.size(); }
+
+    std::vector<Slot> slots_;
+    std::atomic<long long> last_id_{0};
+};
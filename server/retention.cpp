@@ -0,0 +1,71 @@
+#include "retention.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+// Пауза между шагами одного прохода: писатель и читатели успевают взять соединение
+constexpr std::chrono::milliseconds kStepPause{5};
+
+} // namespace
+
+RetentionTask::RetentionTask(Db& db, RetentionPolicy policy, std::size_t batch, std::chrono::milliseconds interval,
+                             std::function<bool()> active)
+    : db_(db), policy_(policy), batch_(std::max<std::size_t>(1, batch)),
+      interval_(std::max(interval, std::chrono::milliseconds(1))), active_(std::move(active)) {
+    thread_ = std::thread([this] { run(); });
+}
+
+RetentionTask::~RetentionTask() {
+    {
+        std::lock_guard<std::mutex> l(mtx_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join(); // Текущий шаг завершается, следующий не начинается
+}
+
+void RetentionTask::wake() {
+    {
+        std::lock_guard<std::mutex> l(mtx_);
+        woken_ = true;
+    }
+    cv_.notify_one();
+}
+
+void RetentionTask::run() {
+    std::unique_lock<std::mutex> l(mtx_);
+    auto ready = [this] { return stopping_ || woken_; };
+    for (;;) {
+        // Без политики хранения проходы идут только по запросу
+        if (policy_.enabled()) cv_.wait_for(l, interval_, ready);
+        else cv_.wait(l, ready);
+        if (stopping_) break;
+        woken_ = false;
+        l.unlock();
+        if (!active_ || active_()) expire();
+        l.lock();
+    }
+}
+
+void RetentionTask::expire() {
+    std::size_t total = 0;
+    for (;;) {
+        std::size_t deleted = 0;
+        try {
+            deleted = db_.expire_messages(policy_, batch_);
+        } catch (const std::exception& e) {
+            LOG_ERROR("Error expiring messages: " << e.what());
+            break;
+        }
+        if (deleted == 0) break;
+        total += deleted;
+        metrics().messages_expired.inc(deleted);
+
+        std::unique_lock<std::mutex> l(mtx_);
+        if (cv_.wait_for(l, kStepPause, [this] { return stopping_; })) break;
+    }
+    if (total > 0) LOG_DEBUG("Retention: " << total << " messages deleted");
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "db.hpp"
+
+// Фоновое удаление старой и очищенной истории. Раз в interval (если задана RetentionPolicy)
+// и по запросу wake поток удаляет сообщения короткими шагами Db::expire_messages
+// (не больше batch строк за шаг) с паузой между шагами, чтобы запись новых сообщений
+// и чтение истории не ждали одну большую транзакцию.
+class RetentionTask {
+public:
+    // active — выполнять ли проход сейчас (в кластере удаляет только ведущий процесс).
+    // Первый проход запускается сразу: очистка истории могла не завершиться до перезапуска.
+    RetentionTask(Db& db, RetentionPolicy policy, std::size_t batch, std::chrono::milliseconds interval,
+                  std::function<bool()> active = nullptr);
+    ~RetentionTask();
+
+    RetentionTask(const RetentionTask&) = delete;
+    RetentionTask& operator=(const RetentionTask&) = delete;
+
+    // Запускает проход, не дожидаясь interval (после Db::clear_messages)
+    void wake();
+
+private:
+    void run();
+    void expire(); // Один проход: шаги, пока есть что удалять
+
+    Db& db_;
+    const RetentionPolicy policy_;
+    const std::size_t batch_;
+    const std::chrono::milliseconds interval_;
+    const std::function<bool()> active_;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    bool woken_ = true;
+    std::thread thread_;
+};
@@ -0,0 +1,260 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Слова текста для полнотекстового поиска: последовательности букв и цифр,
+// приведённые к нижнему регистру (латиница и кириллица). Знаки препинания,
+// пробелы и эмодзи разделяют слова; слова длиннее kMaxTermBytes отбрасываются.
+// Тем же разбиением пользуются индекс и запрос, поэтому регистр при поиске не важен.
+inline constexpr std::size_t kMaxTermBytes = 64;
+
+namespace search_detail {
+
+inline void append_utf8(std::string& out, char32_t cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xc0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xe0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else {
+        out += static_cast<char>(0xf0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+}
+
+// Следующий символ UTF-8; некорректный байт читается как отдельный символ-разделитель
+inline char32_t next_code_point(std::string_view text, std::size_t& i) {
+    unsigned char c = static_cast<unsigned char>(text[i++]);
+    if (c < 0x80) return c;
+    int extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : -1;
+    if (extra < 0 || i + extra > text.size()) return 0;
+    char32_t cp = c & (0x3f >> extra);
+    for (int k = 0; k < extra; ++k) {
+        unsigned char next = static_cast<unsigned char>(text[i]);
+        if ((next & 0xc0) != 0x80) return 0;
+        cp = (cp << 6) | (next & 0x3f);
+        ++i;
+    }
+    return cp;
+}
+
+inline bool is_word_char(char32_t cp) {
+    if (cp < 0x80) return (cp >= '0' && cp <= '9') || (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z');
+    if (cp <= 0xbf || cp == 0xd7 || cp == 0xf7) return false;  // Латиница-1: знаки
+    if (cp >= 0x2000 && cp <= 0x2bff) return false;            // Пунктуация, стрелки, символы
+    if (cp >= 0x3000 && cp <= 0x303f) return false;            // Пунктуация CJK
+    if (cp >= 0xfe00 && cp <= 0xfe0f) return false;            // Селекторы вариантов
+    if (cp >= 0x1f000) return false;                           // Эмодзи
+    return true;
+}
+
+inline char32_t to_lower(char32_t cp) {
+    if (cp >= 'A' && cp <= 'Z') return cp + 0x20;
+    if (cp >= 0x410 && cp <= 0x42f) return cp + 0x20; // А-Я
+    if (cp >= 0x400 && cp <= 0x40f) return cp + 0x50; // Ё и другие
+    if (cp >= 0xc0 && cp <= 0xde && cp != 0xd7) return cp + 0x20;
+    return cp;
+}
+
+} // namespace search_detail
+
+// Вызывает on_term(std::string&&) для каждого слова текста по порядку
+template <class OnTerm>
+void for_each_search_term(std::string_view text, OnTerm on_term) {
+    std::string term;
+    auto emit = [&] {
+        if (!term.empty() && term.size() <= kMaxTermBytes) on_term(std::move(term));
+        term.clear();
+    };
+    for (std::size_t i = 0; i < text.size();) {
+        char32_t cp = search_detail::next_code_point(text, i);
+        if (search_detail::is_word_char(cp)) {
+            search_detail::append_utf8(term, search_detail::to_lower(cp));
+        } else {
+            emit();
+        }
+    }
+    emit();
+}
+
+// Различные слова текста в порядке первого появления
+inline std::vector<std::string> search_terms(std::string_view text) {
+    std::vector<std::string> terms;
+    for_each_search_term(text, [&](std::string&& term) {
+        if (std::find(terms.begin(), terms.end(), term) == terms.end()) terms.push_back(std::move(term));
+    });
+    return terms;
+}
+
+// Инвертированный индекс в памяти: для каждого слова — список документов, где оно
+// встречается, с частотой слова и длиной документа. Документ — число, которое
+// возрастает в порядке добавления (например, позиция записи в журнале), поэтому
+// списки отсортированы без отдельной сортировки, а пересечение идёт одним проходом.
+// Ранжирование — BM25. Синхронизация — на стороне владельца.
+class SearchIndex {
+public:
+    using DocId = std::uint64_t;
+
+    struct Hit {
+        DocId doc;
+        double score;
+    };
+
+    // doc должен быть больше всех уже добавленных
+    void add(DocId doc, std::string_view text) {
+        std::vector<std::string> terms;
+        for_each_search_term(text, [&](std::string&& term) { terms.push_back(std::move(term)); });
+        if (terms.empty()) return;
+        std::sort(terms.begin(), terms.end());
+        auto length = static_cast<std::uint16_t>(std::min<std::size_t>(terms.size(), 0xffff));
+        for (std::size_t i = 0; i < terms.size();) {
+            std::size_t j = i;
+            while (j < terms.size() && terms[j] == terms[i]) ++j;
+            auto tf = static_cast<std::uint16_t>(std::min<std::size_t>(j - i, 0xffff));
+            postings_[std::move(terms[i])].push_back({doc, tf, length});
+            i = j;
+        }
+        docs_.push_back({doc, length});
+        total_length_ += length;
+    }
+
+    // Удаляет самые старые документы, пока expired(doc) истинно
+    template <class Expired>
+    void drop_front(Expired expired) {
+        std::size_t n = 0;
+        while (n < docs_.size() && expired(docs_[n].doc)) total_length_ -= docs_[n++].length;
+        if (n == 0) return;
+        docs_.erase(docs_.begin(), docs_.begin() + n);
+        if (docs_.empty()) {
+            postings_.clear();
+            return;
+        }
+        DocId first = docs_.front().doc;
+        for (auto it = postings_.begin(); it != postings_.end();) {
+            auto& list = it->second;
+            list.erase(list.begin(), std::lower_bound(list.begin(), list.end(), first,
+                                                      [](const Posting& p, DocId d) { return p.doc < d; }));
+            if (list.empty()) {
+                it = postings_.erase(it);
+            } else {
+                list.shrink_to_fit();
+                ++it;
+            }
+        }
+    }
+
+    // Документы, содержащие все terms и принятые accept(doc), — не больше top лучших,
+    // по убыванию оценки (при равной оценке — более новые). Совпадения просматриваются
+    // от новых к старым; candidates > 0 — ранжируются только столько самых новых из них.
+    // Просматриваются только документы из [from, to): остальные не читаются вовсе.
+    template <class Accept>
+    std::vector<Hit> search(const std::vector<std::string>& terms, std::size_t top, std::size_t candidates,
+                            Accept accept, DocId from = 0, DocId to = ~DocId(0)) const {
+        std::vector<Hit> hits;
+        if (terms.empty() || top == 0) return hits;
+        std::vector<Cursor> lists;
+        lists.reserve(terms.size());
+        for (const auto& term : terms) {
+            auto it = postings_.find(term);
+            if (it == postings_.end()) return hits;
+            lists.push_back({&it->second, it->second.size(), idf(it->second.size())});
+        }
+        // Кандидаты берутся из самого короткого списка, остальные только проверяются
+        std::sort(lists.begin(), lists.end(),
+                  [](const Cursor& a, const Cursor& b) { return a.list->size() < b.list->size(); });
+
+        double avg_length = docs_.empty() ? 1.0 : static_cast<double>(total_length_) / docs_.size();
+        auto better = [](const Hit& a, const Hit& b) {
+            return a.score != b.score ? a.score > b.score : a.doc > b.doc;
+        };
+        std::priority_queue<Hit, std::vector<Hit>, decltype(better)> best(better); // Наверху — худший из лучших
+
+        std::size_t seen = 0;
+        const auto& shortest = *lists.front().list;
+        auto newest = std::lower_bound(shortest.begin(), shortest.end(), to,
+                                       [](const Posting& p, DocId d) { return p.doc < d; });
+        for (auto posting = std::make_reverse_iterator(newest); posting != shortest.rend(); ++posting) {
+            if (posting->doc < from) break;
+            double score = lists.front().idf * bm25(*posting, avg_length);
+            bool all = true;
+            for (std::size_t k = 1; k < lists.size() && all; ++k) {
+                // Документы идут по убыванию, поэтому остальные списки сужаются с конца
+                auto& cursor = lists[k];
+                const auto& list = *cursor.list;
+                cursor.end = std::lower_bound(list.begin(), list.begin() + cursor.end, posting->doc,
+                                              [](const Posting& p, DocId d) { return p.doc < d; }) - list.begin();
+                all = cursor.end < list.size() && list[cursor.end].doc == posting->doc;
+                if (all) score += cursor.idf * bm25(list[cursor.end], avg_length);
+                if (cursor.end == 0 && !all) return finish(best);
+            }
+            if (!all) continue;
+            Hit hit{posting->doc, score};
+            // Без окна кандидатов фильтр проверяется, только если документ попадёт в лучшие
+            if (candidates == 0 && best.size() == top && !better(hit, best.top())) continue;
+            if (!accept(posting->doc)) continue;
+            best.push(hit);
+            if (best.size() > top) best.pop();
+            if (++seen == candidates) break;
+        }
+        return finish(best);
+    }
+
+    std::size_t documents() const { return docs_.size(); }
+    std::size_t terms() const { return postings_.size(); }
+
+private:
+    static constexpr double kK1 = 1.2;
+    static constexpr double kB = 0.75;
+
+    struct Posting {
+        DocId doc;
+        std::uint16_t tf;     // Сколько раз слово встречается в документе
+        std::uint16_t length; // Слов в документе
+    };
+
+    struct Document {
+        DocId doc;
+        std::uint16_t length;
+    };
+
+    struct Cursor {
+        const std::vector<Posting>* list;
+        std::size_t end; // Ещё не просмотренная часть списка — [0, end)
+        double idf;
+    };
+
+    double idf(std::size_t df) const {
+        double n = static_cast<double>(docs_.size());
+        return std::log(1.0 + (n - df + 0.5) / (df + 0.5));
+    }
+
+    static double bm25(const Posting& p, double avg_length) {
+        return p.tf * (kK1 + 1) / (p.tf + kK1 * (1 - kB + kB * p.length / avg_length));
+    }
+
+    template <class Queue>
+    static std::vector<Hit> finish(Queue& best) {
+        std::vector<Hit> hits(best.size());
+        for (auto i = hits.size(); i > 0; --i) {
+            hits[i - 1] = best.top();
+            best.pop();
+        }
+        return hits;
+    }
+
+    std::unordered_map<std::string, std::vector<Posting>> postings_;
+    std::vector<Document> docs_; // В порядке добавления
+    std::uint64_t total_length_ = 0;
+};
@@ -0,0 +1,512 @@
+#include "segment_log.hpp"
+#include "logger.hpp"
+#include <nlohmann/json.hpp>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+
+namespace {
+
+std::size_t align8(std::size_t n) { return (n + 7) & ~std::size_t(7); }
+
+std::uint32_t fnv1a(const char* data, std::size_t size) {
+    std::uint32_t hash = 2166136261u;
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+std::runtime_error sys_error(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Разбирает JSON-обёртку {"user", "text"} записи старого формата; поле, которого нет,
+// не меняется (простой текст остаётся текстом)
+void unwrap_legacy_text(std::string_view stored, std::string& user, std::string& text) {
+    auto value = nlohmann::json::parse(stored.begin(), stored.end(), nullptr, false);
+    if (!value.is_object()) return;
+    auto it = value.find("user");
+    if (it != value.end() && it->is_string()) user = it->get<std::string>();
+    it = value.find("text");
+    if (it != value.end() && it->is_string()) text = it->get<std::string>();
+}
+
+std::string segment_name(std::uint32_t seq) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%010u.seg", seq);
+    return buf;
+}
+
+} // namespace
+
+SegmentLogStore::SegmentLogStore(const std::string& dir, std::size_t segment_bytes)
+    : dir_(dir), segment_bytes_(std::max<std::size_t>(segment_bytes, 64 * 1024)) {
+    std::filesystem::create_directories(dir_);
+
+    // Два процесса, дописывающие одни сегменты, испортили бы журнал
+    lock_fd_ = ::open((dir_ + "/LOCK").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd_ < 0) throw sys_error("Cannot open " + dir_ + "/LOCK");
+    if (::flock(lock_fd_, LOCK_EX | LOCK_NB) != 0) {
+        ::close(lock_fd_);
+        throw std::runtime_error("Message log " + dir_ + " is used by another process");
+    }
+
+    std::vector<std::uint32_t> seqs;
+    for (const auto& entry : std::filesystem::directory_iterator(dir_)) {
+        const auto name = entry.path().filename().string();
+        unsigned seq = 0;
+        char tail = 0;
+        if (std::sscanf(name.c_str(), "%10u.se%c", &seq, &tail) == 2 && tail == 'g' && seq > 0) seqs.push_back(seq);
+    }
+    std::sort(seqs.begin(), seqs.end());
+    if (!seqs.empty()) first_seq_ = seqs.front();
+    for (auto seq : seqs) {
+        open_segment(seq, 0, false);
+        recover(*segments_.back());
+    }
+
+    if (!segments_.empty()) {
+        // Хвост активного сегмента после последней целой записи обнуляется:
+        // там могут остаться байты записи, прерванной падением процесса
+        auto& last = *segments_.back();
+        std::memset(last.base + last.used, 0, last.size - last.used);
+    }
+    if (!seqs.empty()) {
+        LOG_INFO("Message log " << dir_ << ": " << seqs.size() << " segments, " << rooms_.size() << " rooms, "
+                 << "last message id " << last_message_id_ << ", " << search_.terms() << " search terms");
+    }
+}
+
+SegmentLogStore::~SegmentLogStore() {
+    for (auto& segment : segments_) {
+        if (!segment) continue;
+        if (segment == segments_.back()) ::msync(segment->base, segment->size, MS_SYNC);
+        ::munmap(segment->base, segment->size);
+        ::close(segment->fd);
+    }
+    if (lock_fd_ >= 0) ::close(lock_fd_);
+}
+
+std::uint64_t SegmentLogStore::pair_key(int a, int b) {
+    if (a > b) std::swap(a, b);
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(a)) << 32) | static_cast<std::uint32_t>(b);
+}
+
+void SegmentLogStore::open_segment(std::uint32_t seq, std::size_t size, bool create) {
+    auto segment = std::make_unique<Segment>();
+    segment->seq = seq;
+    std::string path = dir_ + "/" + segment_name(seq);
+    segment->fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (segment->fd < 0) throw sys_error("Cannot open " + path);
+    if (!create) {
+        struct stat st{};
+        if (::fstat(segment->fd, &st) != 0) {
+            ::close(segment->fd);
+            throw sys_error("Cannot stat " + path);
+        }
+        size = static_cast<std::size_t>(st.st_size);
+        // Пустой файл — процесс завершился между созданием сегмента и выделением места
+        create = size == 0;
+        if (create) size = segment_bytes_;
+    }
+    if (create) {
+        // Место выделяется сразу: нехватка диска — ошибка здесь, а не SIGBUS при записи в отображение
+        int err = ::posix_fallocate(segment->fd, 0, static_cast<off_t>(size));
+        if (err != 0) {
+            ::close(segment->fd);
+            ::unlink(path.c_str());
+            errno = err;
+            throw sys_error("Cannot allocate " + path);
+        }
+    }
+    segment->size = size;
+    void* base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (base == MAP_FAILED) {
+        ::close(segment->fd);
+        throw sys_error("Cannot map " + path);
+    }
+    segment->base = static_cast<char*>(base);
+
+    if (segments_.empty()) first_seq_ = seq;
+    // Пропуски в нумерации (сегменты, удалённые вручную) остаются пустыми местами
+    segments_.resize(seq - first_seq_);
+    segments_.push_back(std::move(segment));
+}
+
+void SegmentLogStore::recover(Segment& segment) {
+    std::size_t offset = 0;
+    while (offset + sizeof(Record) <= segment.size) {
+        const auto& record = *reinterpret_cast<const Record*>(segment.base + offset);
+        if (record.size == 0) break;
+        bool valid = record.size >= sizeof(Record) && record.size % 8 == 0 &&
+                     offset + record.size <= segment.size &&
+                     sizeof(Record) + record.room_size + record.text_size <= record.size &&
+                     fnv1a(segment.base + offset + 8, record.size - 8) == record.checksum;
+        if (!valid) {
+            LOG_WARN("Message log " << dir_ << ": damaged record in " << segment_name(segment.seq)
+                     << " at offset " << offset << ", rest of the segment is ignored");
+            break;
+        }
+        index(record, (static_cast<Location>(segment.seq) << 32) | offset);
+        offset += record.size;
+    }
+    segment.used = offset;
+}
+
+SegmentLogStore::Segment& SegmentLogStore::writable(std::size_t bytes) {
+    if (!segments_.empty()) {
+        auto& active = *segments_.back();
+        if (active.used + bytes <= active.size) return active;
+        // Заполненный сегмент больше не меняется: сбрасываем его на диск целиком
+        ::msync(active.base, active.size, MS_SYNC);
+    }
+    std::uint32_t seq = segments_.empty() ? first_seq_ : segments_.back()->seq + 1;
+    open_segment(seq, std::max(segment_bytes_, bytes), true);
+    return *segments_.back();
+}
+
+SegmentLogStore::Location SegmentLogStore::append(Kind kind, long long id, int user_id, int recipient_id,
+                                                  const std::string& room, const std::string& text) {
+    if (room.size() > 0xffff) throw std::runtime_error("Room name is too long");
+    std::size_t bytes = align8(sizeof(Record) + room.size() + text.size());
+    if (bytes > 0xffffffffu) throw std::runtime_error("Message is too large");
+    auto& segment = writable(bytes);
+    char* p = segment.base + segment.used;
+
+    Location prev = 0;
+    if (kind == Kind::room) {
+        auto it = rooms_.find(room);
+        if (it != rooms_.end()) prev = it->second.head;
+    } else if (kind == Kind::direct) {
+        auto it = directs_.find(pair_key(user_id, recipient_id));
+        if (it != directs_.end()) prev = it->second.head;
+    }
+
+    Record header{};
+    header.id = id;
+    header.ts = static_cast<std::int64_t>(std::time(nullptr));
+    header.prev = prev;
+    header.user_id = user_id;
+    header.recipient_id = recipient_id;
+    header.kind = kind;
+    header.flags = kPlainText;
+    header.room_size = static_cast<std::uint16_t>(room.size());
+    header.text_size = static_cast<std::uint32_t>(text.size());
+    std::memcpy(p, &header, sizeof(header));
+    std::memcpy(p + sizeof(header), room.data(), room.size());
+    std::memcpy(p + sizeof(header) + room.size(), text.data(), text.size());
+
+    auto* record = reinterpret_cast<Record*>(p);
+    record->checksum = fnv1a(p + 8, bytes - 8);
+    // Размер пишется последним: запись, прерванную падением, восстановление не увидит
+    __atomic_store_n(&record->size, static_cast<std::uint32_t>(bytes), __ATOMIC_RELEASE);
+
+    Location loc = (static_cast<Location>(segment.seq) << 32) | segment.used;
+    segment.used += bytes;
+    index(*record, loc);
+    return loc;
+}
+
+void SegmentLogStore::index(const Record& record, Location loc) {
+    Stream* stream = nullptr;
+    switch (record.kind) {
+    case Kind::room:
+        stream = &rooms_[std::string(record.room(), record.room_size)];
+        last_message_id_ = std::max<long long>(last_message_id_, record.id);
+        break;
+    case Kind::direct:
+        stream = &directs_[pair_key(record.user_id, record.recipient_id)];
+        last_direct_id_ = std::max<long long>(last_direct_id_, record.id);
+        break;
+    case Kind::clear: {
+        auto& segment = *segments_[(loc >> 32) - first_seq_];
+        segment.cleared_up_to = std::max<long long>(segment.cleared_up_to, record.id);
+        cleared_up_to_ = std::max<long long>(cleared_up_to_, record.id);
+        last_message_id_ = std::max(last_message_id_, cleared_up_to_);
+        // Комнаты, в которых не осталось видимых сообщений, забываются целиком
+        for (auto it = rooms_.begin(); it != rooms_.end();) {
+            if (it->second.last_id <= cleared_up_to_) it = rooms_.erase(it);
+            else ++it;
+        }
+        // Сообщения комнат пишутся в порядке id, поэтому очищенные — в начале индекса
+        search_.drop_front([this](Location doc) {
+            const Record* r = at(doc);
+            return !r || r->id <= cleared_up_to_;
+        });
+        return;
+    }
+    default:
+        return;
+    }
+
+    if (stream->count % kSparseEvery == 0) stream->sparse.push_back({record.id, record.ts, loc});
+    ++stream->count;
+    stream->head = loc;
+    stream->last_id = record.id;
+
+    auto& segment = *segments_[(loc >> 32) - first_seq_];
+    ++segment.messages;
+    (record.kind == Kind::room ? segment.last_message_id : segment.last_direct_id) = record.id;
+    segment.last_ts = record.ts;
+
+    if (record.kind == Kind::room) {
+        if (record.flags & kPlainText) {
+            search_.add(loc, {record.text(), record.text_size});
+        } else {
+            search_.add(loc, stored_message(record, std::string()).text);
+        }
+    }
+}
+
+StoredMessage SegmentLogStore::stored_message(const Record& record, const std::string& room) {
+    StoredMessage m{record.id, record.user_id, std::string(), room, std::string(record.text(), record.text_size),
+                    record.ts};
+    if (!(record.flags & kPlainText)) unwrap_legacy_text(m.text, m.user, m.text);
+    return m;
+}
+
+const SegmentLogStore::Record* SegmentLogStore::at(Location loc) const {
+    std::size_t i = (loc >> 32) - first_seq_;
+    // Сегмент, на который ещё ссылаются записи, мог быть удалён с диска
+    if (loc == 0 || (loc >> 32) < first_seq_ || i >= segments_.size() || !segments_[i]) return nullptr;
+    return reinterpret_cast<const Record*>(segments_[i]->base + (loc & 0xffffffffu));
+}
+
+std::vector<const SegmentLogStore::Record*> SegmentLogStore::page_before(const Stream& stream, long long before_id,
+                                                                         std::size_t limit, long long floor) const {
+    Location loc = stream.head;
+    if (before_id > 0) {
+        // Опорная запись с id >= before_id: нужные записи не дальше kSparseEvery шагов назад от неё
+        auto it = std::lower_bound(stream.sparse.begin(), stream.sparse.end(), before_id,
+                                   [](const IndexEntry& e, long long id) { return e.id < id; });
+        if (it != stream.sparse.end()) loc = it->loc;
+    }
+    std::vector<const Record*> page;
+    for (const Record* r = at(loc); r && page.size() < limit; r = at(r->prev)) {
+        if (r->id <= floor) break;
+        if (before_id <= 0 || r->id < before_id) page.push_back(r);
+    }
+    std::reverse(page.begin(), page.end());
+    return page;
+}
+
+std::vector<long long> SegmentLogStore::save_messages(const std::vector<NewMessage>& messages) {
+    std::unique_lock<std::shared_mutex> l(mtx_);
+    std::vector<long long> ids;
+    ids.reserve(messages.size());
+    for (const auto& m : messages) {
+        if (m.recipient_id) {
+            long long id = m.id > 0 ? m.id : last_direct_id_ + 1;
+            append(Kind::direct, id, m.user_id, m.recipient_id, std::string(), m.text);
+            ids.push_back(id);
+        } else {
+            long long id = m.id > 0 ? m.id : last_message_id_ + 1;
+            append(Kind::room, id, m.user_id, 0, m.room.empty() ? std::string(kDefaultRoom) : m.room, m.text);
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+std::vector<StoredMessage> SegmentLogStore::load_messages(const std::string& room, long long before_id,
+                                                          std::size_t limit) {
+    std::shared_lock<std::shared_mutex> l(mtx_);
+    std::vector<StoredMessage> messages;
+    auto it = rooms_.find(room);
+    if (it == rooms_.end()) return messages;
+    auto page = page_before(it->second, before_id, limit, cleared_up_to_);
+    messages.reserve(page.size());
+    for (const auto* r : page) {
+        messages.push_back(stored_message(*r, room));
+    }
+    return messages;
+}
+
+std::vector<StoredMessage> SegmentLogStore::load_messages_after(const std::string& room, long long after_id,
+                                                                std::size_t limit) {
+    std::shared_lock<std::shared_mutex> l(mtx_);
+    std::vector<StoredMessage> messages;
+    auto it = rooms_.find(room);
+    if (it == rooms_.end()) return messages;
+    const auto& stream = it->second;
+    const auto& sparse = stream.sparse;
+
+    // Ссылки идут только назад, поэтому поток читается отрезками между опорными
+    // записями: отрезок j — записи после опорной j-1 до опорной j включительно
+    std::size_t first = std::upper_bound(sparse.begin(), sparse.end(), after_id,
+                                         [](long long id, const IndexEntry& e) { return id < e.id; }) - sparse.begin();
+    std::vector<const Record*> chunk;
+    for (std::size_t j = first; messages.size() < limit; ++j) {
+        Location loc = j < sparse.size() ? sparse[j].loc : stream.head;
+        long long stop = std::max(after_id, cleared_up_to_);
+        if (j > 0) stop = std::max(stop, sparse[j - 1].id);
+        chunk.clear();
+        for (const Record* r = at(loc); r && r->id > stop; r = at(r->prev)) chunk.push_back(r);
+        for (auto r = chunk.rbegin(); r != chunk.rend() && messages.size() < limit; ++r) {
+            messages.push_back(stored_message(**r, room));
+        }
+        if (j >= sparse.size()) break;
+    }
+    return messages;
+}
+
+long long SegmentLogStore::last_message_id() {
+    std::shared_lock<std::shared_mutex> l(mtx_);
+    return last_message_id_;
+}
+
+std::vector<StoredDirectMessage> SegmentLogStore::load_direct_messages(int user_id, int peer_id, long long before_id,
+                                                                       std::size_t limit) {
+    std::shared_lock<std::shared_mutex> l(mtx_);
+    std::vector<StoredDirectMessage> messages;
+    auto it = directs_.find(pair_key(user_id, peer_id));
+    if (it == directs_.end()) return messages;
+    auto page = page_before(it->second, before_id, limit, 0);
+    messages.reserve(page.size());
+    for (const auto* r : page) {
+        messages.push_back({r->id, r->user_id, r->recipient_id, std::string(r->text(), r->text_size), r->ts});
+    }
+    return messages;
+}
+
+long long SegmentLogStore::last_direct_message_id() {
+    std::shared_lock<std::shared_mutex> l(mtx_);
+    return last_direct_id_;
+}
+
+void SegmentLogStore::clear_messages(long long up_to_id) {
+    std::unique_lock<std::shared_mutex> l(mtx_);
+    append(Kind::clear, up_to_id, 0, 0, std::string(), std::string());
+}
+
+std::vector<StoredMessage> SegmentLogStore::search_messages(const SearchQuery& query) {
+    std::shared_lock<std::shared_mutex> l(mtx_);
+    std::vector<StoredMessage> messages;
+    auto terms = search_terms(query.text);
+    auto stream = rooms_.find(query.room);
+    if (terms.empty() || query.limit == 0 || stream == rooms_.end()) return messages;
+
+    // since/until сужают поиск до позиций записей по разреженному индексу комнаты:
+    // время записей потока не убывает, поэтому опорные записи упорядочены и по времени
+    Location from = 0, to = ~Location(0);
+    const auto& sparse = stream->second.sparse;
+    auto by_ts = [](const IndexEntry& e, long long ts) { return e.ts < ts; };
+    if (query.since > 0) {
+        auto it = std::lower_bound(sparse.begin(), sparse.end(), query.since, by_ts);
+        // Записи от предыдущей опорной до этой ещё могут быть не раньше since
+        if (it != sparse.begin()) from = std::prev(it)->loc;
+    }
+    if (query.until > 0) {
+        auto it = std::lower_bound(sparse.begin(), sparse.end(), query.until, by_ts);
+        if (it != sparse.end()) to = it->loc;
+    }
+
+    // Фильтры проверяются по заголовку записи прямо в отображении
+    auto hits = search_.search(terms, query.offset + query.limit, query.candidates, [&](Location doc) {
+        const Record* r = at(doc);
+        return r && r->id > cleared_up_to_ &&
+               std::string_view(r->room(), r->room_size) == query.room &&
+               (query.user_id == 0 || r->user_id == query.user_id) &&
+               (query.since == 0 || r->ts >= query.since) &&
+               (query.until == 0 || r->ts < query.until);
+    }, from, to);
+    for (std::size_t i = query.offset; i < hits.size(); ++i) {
+        const Record* r = at(hits[i].doc);
+        messages.push_back(stored_message(*r, query.room));
+    }
+    return messages;
+}
+
+std::unique_ptr<SegmentLogStore::Segment> SegmentLogStore::detach_oldest() {
+    auto segment = std::move(segments_.front());
+    segments_.erase(segments_.begin());
+    ++first_seq_;
+    // Потоки, все записи которых были в сегменте, забываются; у остальных ссылки
+    // на удалённые записи ведут в пустоту (at() возвращает nullptr)
+    Location first = static_cast<Location>(first_seq_) << 32;
+    auto prune = [first](auto& streams) {
+        for (auto it = streams.begin(); it != streams.end();) {
+            auto& stream = it->second;
+            if (stream.head < first) {
+                it = streams.erase(it);
+                continue;
+            }
+            auto kept = std::find_if(stream.sparse.begin(), stream.sparse.end(),
+                                     [first](const IndexEntry& e) { return e.loc >= first; });
+            stream.sparse.erase(stream.sparse.begin(), kept);
+            ++it;
+        }
+    };
+    prune(rooms_);
+    prune(directs_);
+    search_.drop_front([first](Location doc) { return doc < first; });
+    return segment;
+}
+
+std::size_t SegmentLogStore::expire_messages(const RetentionPolicy& policy, std::size_t) {
+    std::unique_ptr<Segment> expired;
+    {
+        std::unique_lock<std::shared_mutex> l(mtx_);
+        if (segments_.size() < 2) return 0;
+        if (!segments_.front()) {
+            // Пропуск в нумерации сегментов
+            segments_.erase(segments_.begin());
+            ++first_seq_;
+            return 0;
+        }
+        const auto& oldest = *segments_.front();
+        std::size_t bytes = 0;
+        for (const auto& segment : segments_) {
+            if (segment) bytes += segment->size;
+        }
+        long long now = static_cast<long long>(std::time(nullptr));
+        // Записи сегмента идут в порядке id, поэтому его последние сообщения — самые новые в нём
+        bool expired_by_age = policy.max_age_seconds > 0 && oldest.last_ts < now - policy.max_age_seconds;
+        auto old = [&policy](long long last, long long newest) {
+            return last == 0 || last <= newest - static_cast<long long>(policy.max_messages);
+        };
+        bool expired_by_count = policy.max_messages > 0 && old(oldest.last_message_id, last_message_id_) &&
+                                old(oldest.last_direct_id, last_direct_id_);
+        bool expired_by_bytes = policy.max_bytes > 0 && bytes > policy.max_bytes;
+        // Самое новое сообщение вида хранит его нумерацию при перезапуске. Очищенное
+        // сообщение комнаты её не хранит: нумерацию сохранит запись очистки (см. ниже)
+        bool holds_newest = (oldest.last_message_id > 0 && oldest.last_message_id == last_message_id_ &&
+                             last_message_id_ > cleared_up_to_) ||
+                            (oldest.last_direct_id > 0 && oldest.last_direct_id == last_direct_id_);
+        // Сегмент без сообщений или только с очищенными сообщениями комнат больше ничего не хранит
+        bool cleared = oldest.last_direct_id == 0 && oldest.last_message_id <= cleared_up_to_;
+        if (holds_newest ||
+            (oldest.messages > 0 && !cleared && !expired_by_age && !expired_by_count && !expired_by_bytes)) {
+            return 0;
+        }
+        // После очистки нумерацию может хранить только запись очистки: все сообщения комнат
+        // не новее её границы. Запись переносится в активный сегмент, иначе после перезапуска
+        // id очищенных сообщений выдавались бы заново
+        if (oldest.cleared_up_to > 0 && oldest.cleared_up_to == last_message_id_) {
+            append(Kind::clear, oldest.cleared_up_to, 0, 0, std::string(), std::string());
+        }
+        expired = detach_oldest();
+    }
+
+    // Читатели до сегмента уже не доберутся: отображение закрывается без блокировки
+    std::size_t messages = expired->messages;
+    ::munmap(expired->base, expired->size);
+    ::close(expired->fd);
+    std::string path = dir_ + "/" + segment_name(expired->seq);
+    if (::unlink(path.c_str()) != 0) LOG_WARN("Cannot remove " << path << ": " << std::strerror(errno));
+    LOG_INFO("Message log " << dir_ << ": removed " << segment_name(expired->seq) << " (" << messages << " messages)");
+    return messages;
+}
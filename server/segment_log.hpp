@@ -0,0 +1,141 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "message_store.hpp"
+#include "search_index.hpp"
+
+// Сообщения в сегментированном журнале только для дописывания. Сегмент — файл
+// фиксированного размера, отображённый в память: запись пакета — последовательное
+// копирование в отображение, чтение истории идёт прямо из отображения, без
+// системных вызовов и разбора (копируется только выданная страница).
+//
+// Каждая запись ссылается на предыдущую запись своего потока (комнаты или
+// переписки пары пользователей), а разреженный индекс потока хранит id, время
+// и позицию каждой kSparseEvery-й записи. Страница истории — поиск опорной записи
+// по id в индексе и переход по ссылкам назад. Для поиска сообщения комнат попадают
+// в инвертированный индекс в памяти (документ — позиция записи); фильтры since/until
+// переводятся в диапазон позиций поиском опорных записей по времени. Индексы
+// восстанавливаются при открытии одним проходом по сегментам.
+//
+// Порядок: id сообщений одного потока должны возрастать в порядке записи.
+// Каталог принадлежит одному процессу (блокировка файла LOCK).
+// Срок хранения соблюдается целыми сегментами: удаляется самый старый сегмент,
+// все сообщения которого нарушают политику; активный сегмент не удаляется.
+class SegmentLogStore final : public MessageStore {
+public:
+    SegmentLogStore(const std::string& dir, std::size_t segment_bytes);
+    ~SegmentLogStore() override;
+
+    SegmentLogStore(const SegmentLogStore&) = delete;
+    SegmentLogStore& operator=(const SegmentLogStore&) = delete;
+
+    std::vector<long long> save_messages(const std::vector<NewMessage>& messages) override;
+    std::vector<StoredMessage> load_messages(const std::string& room, long long before_id,
+                                             std::size_t limit) override;
+    std::vector<StoredMessage> load_messages_after(const std::string& room, long long after_id,
+                                                   std::size_t limit) override;
+    long long last_message_id() override;
+    std::vector<StoredDirectMessage> load_direct_messages(int user_id, int peer_id, long long before_id,
+                                                          std::size_t limit) override;
+    long long last_direct_message_id() override;
+    // Дописывает запись очистки: сообщения комнат с id <= up_to_id больше не читаются
+    void clear_messages(long long up_to_id) override;
+    std::vector<StoredMessage> search_messages(const SearchQuery& query) override;
+    // Удаляет не больше одного сегмента (batch не используется)
+    std::size_t expire_messages(const RetentionPolicy& policy, std::size_t batch) override;
+
+private:
+    static constexpr std::size_t kSparseEvery = 32;
+
+    // Номер сегмента в старших 32 битах, смещение в младших; 0 — записи нет
+    using Location = std::uint64_t;
+
+    enum class Kind : std::uint8_t { room = 1, direct = 2, clear = 3 };
+
+    // Заголовок записи; за ним имя комнаты, текст и выравнивание до 8 байт
+    struct Record {
+        std::uint32_t size;      // Размер записи целиком; 0 — дальше в сегменте записей нет
+        std::uint32_t checksum;  // FNV-1a всего, что идёт после этого поля
+        std::int64_t id;         // У записи очистки — граница очистки
+        std::int64_t ts;         // Время UTC, секунды
+        Location prev;           // Предыдущая запись того же потока
+        std::int32_t user_id;
+        std::int32_t recipient_id;
+        Kind kind;
+        std::uint8_t flags;
+        std::uint16_t room_size;
+        std::uint32_t text_size;
+
+        const char* room() const { return reinterpret_cast<const char*>(this + 1); }
+        const char* text() const { return room() + room_size; }
+    };
+    static_assert(sizeof(Record) == 48, "Record layout is part of the file format");
+    // Текст сообщения записан как есть. Без флага — запись старого формата: текст
+    // сообщения комнаты обёрнут в JSON {"user", "text"}.
+    static constexpr std::uint8_t kPlainText = 1;
+
+    struct Segment {
+        std::uint32_t seq = 0;
+        int fd = -1;
+        char* base = nullptr;
+        std::size_t size = 0; // Размер файла и отображения
+        std::size_t used = 0; // Занято записями
+        std::size_t messages = 0; // Сообщений комнат и личных
+        // Последние id сообщений комнат и личных сообщений и время последнего сообщения (0 — нет)
+        long long last_message_id = 0, last_direct_id = 0;
+        long long last_ts = 0;
+        long long cleared_up_to = 0; // Наибольшая граница очистки среди записей сегмента
+    };
+
+    struct IndexEntry {
+        long long id;
+        long long ts;
+        Location loc;
+    };
+
+    // Записи одной комнаты или переписки одной пары пользователей
+    struct Stream {
+        Location head = 0;   // Последняя запись
+        long long last_id = 0;
+        std::size_t count = 0;
+        std::vector<IndexEntry> sparse;
+    };
+
+    static std::uint64_t pair_key(int a, int b);
+
+    void open_segment(std::uint32_t seq, std::size_t size, bool create);
+    // Забывает записи самого старого сегмента и отдаёт его для закрытия
+    std::unique_ptr<Segment> detach_oldest();
+    void recover(Segment& segment);
+    Segment& writable(std::size_t bytes);
+    Location append(Kind kind, long long id, int user_id, int recipient_id,
+                    const std::string& room, const std::string& text);
+    void index(const Record& record, Location loc);
+    const Record* at(Location loc) const; // nullptr — записи нет
+    // Сообщение комнаты из записи; автор известен только у записей старого формата
+    static StoredMessage stored_message(const Record& record, const std::string& room);
+
+    // Страница потока с id < before_id (before_id <= 0 — последние), от старых к новым;
+    // записи с id <= floor не читаются
+    std::vector<const Record*> page_before(const Stream& stream, long long before_id, std::size_t limit,
+                                           long long floor) const;
+
+    const std::string dir_;
+    const std::size_t segment_bytes_;
+    int lock_fd_ = -1;
+
+    mutable std::shared_mutex mtx_; // Запись — монопольно, чтение — совместно
+    std::uint32_t first_seq_ = 1;   // Номер сегмента segments_[0]
+    std::vector<std::unique_ptr<Segment>> segments_; // nullptr — сегмента нет на диске
+    std::unordered_map<std::string, Stream> rooms_;
+    std::unordered_map<std::uint64_t, Stream> directs_;
+    long long last_message_id_ = 0;
+    long long last_direct_id_ = 0;
+    long long cleared_up_to_ = 0;
+    SearchIndex search_; // Сообщения комнат, ещё не попавшие под очистку
+};
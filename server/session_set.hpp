@@ -0,0 +1,84 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Множество указателей с копированием при записи, разбитое на шарды.
+// Читатели (рассылка) обходят неизменяемые снимки шардов, не удерживая мьютекс шарда.
+// Сам снимок берётся через std::atomic_load над shared_ptr. Это не lock-free операция:
+// libstdc++ на время копирования указателя берёт короткую внутреннюю блокировку
+// из общего пула. Обход снимка идёт уже без неё, и снимок не меняется, пока его обходят.
+// Вставка и удаление копируют только один шард под его мьютексом, поэтому
+// не ждут рассылку и друг друга в других шардах.
+template <class T, std::size_t Shards = 16>
+class SnapshotSet {
+public:
+    using Ptr = std::shared_ptr<T>;
+    using Snapshot = std::shared_ptr<const std::vector<Ptr>>;
+
+    // false — элемент уже был в множестве
+    bool insert(const Ptr& item) {
+        Shard& shard = shard_for(item);
+        std::lock_guard<std::mutex> l(shard.mtx);
+        auto current = std::atomic_load_explicit(&shard.items, std::memory_order_acquire);
+        if (current && std::find(current->begin(), current->end(), item) != current->end()) return false;
+
+        auto next = current ? std::make_shared<std::vector<Ptr>>(*current)
+                            : std::make_shared<std::vector<Ptr>>();
+        next->push_back(item);
+        std::atomic_store_explicit(&shard.items, Snapshot(std::move(next)), std::memory_order_release);
+        size_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // false — элемента не было в множестве
+    bool erase(const Ptr& item) {
+        Shard& shard = shard_for(item);
+        std::lock_guard<std::mutex> l(shard.mtx);
+        auto current = std::atomic_load_explicit(&shard.items, std::memory_order_acquire);
+        if (!current) return false;
+        auto it = std::find(current->begin(), current->end(), item);
+        if (it == current->end()) return false;
+
+        auto next = std::make_shared<std::vector<Ptr>>();
+        next->reserve(current->size() - 1);
+        next->insert(next->end(), current->begin(), it);
+        next->insert(next->end(), it + 1, current->end());
+        std::atomic_store_explicit(&shard.items, Snapshot(std::move(next)), std::memory_order_release);
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Обходит текущие снимки шардов. Элементы, добавленные во время обхода,
+    // могут быть пропущены, удалённые — ещё встретиться.
+    template <class F>
+    void for_each(F&& f) const {
+        for (const Shard& shard : shards_) {
+            auto items = std::atomic_load_explicit(&shard.items, std::memory_order_acquire);
+            if (!items) continue;
+            for (const Ptr& item : *items) f(item);
+        }
+    }
+
+    std::size_t size() const { return size_.load(std::memory_order_relaxed); }
+    bool empty() const { return size() == 0; }
+
+private:
+    struct Shard {
+        std::mutex mtx; // Только для писателей
+        Snapshot items;
+    };
+
+    Shard& shard_for(const Ptr& item) {
+        // Адреса выровнены, поэтому младшие биты перемешиваем перед выбором шарда
+        auto addr = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(item.get()));
+        return shards_[((addr >> 4) * 0x9E3779B97F4A7C15ull >> 32) % Shards];
+    }
+
+    std::array<Shard, Shards> shards_;
+    std::atomic<std::size_t> size_{0};
+};
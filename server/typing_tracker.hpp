@@ -0,0 +1,53 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Индикаторы набора текста. Они эфемерны: не сохраняются и не попадают в историю.
+// События копятся между рассылками, и пользователь попадает в пакет комнаты
+// не больше одного раза. Повторные события того же пользователя в той же комнате
+// чаще min_interval отбрасываются сразу.
+class TypingTracker {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Комната → имена пользователей, набирающих текст, в порядке поступления событий
+    using Batch = std::unordered_map<std::string, std::vector<std::string>>;
+
+    explicit TypingTracker(std::chrono::milliseconds min_interval) : min_interval_(min_interval) {}
+
+    // true — это первое принятое событие после рассылки, и рассылку нужно запланировать
+    bool add(int user_id, const std::string& display_name, const std::string& room, Clock::time_point now) {
+        std::string key = std::to_string(user_id) + '\n' + room;
+        std::lock_guard<std::mutex> l(mtx_);
+        auto [it, inserted] = last_.try_emplace(std::move(key), now);
+        if (!inserted) {
+            if (now - it->second < min_interval_) return false;
+            it->second = now;
+        }
+        bool first = pending_.empty();
+        auto& names = pending_[room];
+        if (std::find(names.begin(), names.end(), display_name) == names.end()) names.push_back(display_name);
+        return first;
+    }
+
+    // Забирает накопленные события и забывает пользователей, чей интервал истёк
+    Batch take(Clock::time_point now) {
+        std::lock_guard<std::mutex> l(mtx_);
+        for (auto it = last_.begin(); it != last_.end();) {
+            if (now - it->second >= min_interval_) it = last_.erase(it);
+            else ++it;
+        }
+        Batch batch;
+        batch.swap(pending_);
+        return batch;
+    }
+
+private:
+    std::mutex mtx_;
+    std::chrono::milliseconds min_interval_;
+    std::unordered_map<std::string, Clock::time_point> last_; // "user_id\nroom" → последнее принятое событие
+    Batch pending_;
+};
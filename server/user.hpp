@@ -0,0 +1,9 @@
+#pragma once
+#include <string>
+
+struct User {
+    int id;
+    std::string nickname;    // Уникальный никнейм для идентификации пользователя
+    std::string display_name; // Отображаемое имя
+    std::string password_hash;
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include "user.hpp"
+
+// LRU-кеш пользователей перед запросами к таблице users.
+// Операции, меняющие профиль, обязаны вызывать invalidate().
+class UserCache {
+public:
+    explicit UserCache(std::size_t capacity) : capacity_(capacity) {}
+
+    std::optional<User> find_by_id(int user_id) {
+        std::lock_guard<std::mutex> l(mtx_);
+        auto it = by_id_.find(user_id);
+        if (it == by_id_.end()) return std::nullopt;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return *it->second;
+    }
+
+    std::optional<User> find_by_nickname(const std::string& nickname) {
+        std::lock_guard<std::mutex> l(mtx_);
+        auto nick = by_nickname_.find(nickname);
+        if (nick == by_nickname_.end()) return std::nullopt;
+        auto it = by_id_.find(nick->second);
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return *it->second;
+    }
+
+    void put(const User& user) {
+        if (capacity_ == 0) return;
+        std::lock_guard<std::mutex> l(mtx_);
+        erase(user.id);
+        lru_.push_front(user);
+        by_id_[user.id] = lru_.begin();
+        by_nickname_[user.nickname] = user.id;
+        if (lru_.size() > capacity_) erase(lru_.back().id);
+    }
+
+    void invalidate(int user_id) {
+        std::lock_guard<std::mutex> l(mtx_);
+        erase(user_id);
+    }
+
+    void invalidate(const std::string& nickname) {
+        std::lock_guard<std::mutex> l(mtx_);
+        auto nick = by_nickname_.find(nickname);
+        if (nick != by_nickname_.end()) erase(nick->second);
+    }
+
+private:
+    void erase(int user_id) {
+        auto it = by_id_.find(user_id);
+        if (it == by_id_.end()) return;
+        by_nickname_.erase(it->second->nickname);
+        lru_.erase(it->second);
+        by_id_.erase(it);
+    }
+
+    const std::size_t capacity_;
+    std::mutex mtx_;
+    std::list<User> lru_; // В начале — последние использованные
+    std::unordered_map<int, std::list<User>::iterator> by_id_;
+    std::unordered_map<std::string, int> by_nickname_;
+};